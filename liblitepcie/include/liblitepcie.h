@@ -18,6 +18,7 @@ extern "C" {
 #include "litepcie_helpers.h"
 #include "litepcie_dma.h"
 #include "litepcie_flash.h"
+#include "litepcie_time.h"
 #include "litepcie_public.h"
 
 #ifdef __cplusplus
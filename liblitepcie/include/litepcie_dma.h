@@ -23,9 +23,31 @@ typedef struct pollfd pollfd_s;
 #include "litepcie_public.h"
 #include "litepcie_helpers.h"
 
+/* Copy mode: number of overlapped requests kept in flight per direction */
+#define LITEPCIE_DMA_QUEUE_DEPTH_DEFAULT 4
+#define LITEPCIE_DMA_QUEUE_DEPTH_MAX     16
+/* Copy mode: how long litepcie_dma_process waits for the oldest request */
+#define LITEPCIE_DMA_TIMEOUT_MS          100
+
+enum litepcie_dma_slot_state {
+    LITEPCIE_DMA_SLOT_IDLE,    /* read: free to issue / write: free to fill */
+    LITEPCIE_DMA_SLOT_PENDING, /* request in flight */
+    LITEPCIE_DMA_SLOT_DONE,    /* read: completed, data available to user */
+};
+
+/* One in-flight request over a slice of buf_rd/buf_wr */
+struct litepcie_dma_slot {
+#if defined(_WIN32)
+    OVERLAPPED overlapped;
+#endif
+    char *buf;
+    unsigned count; /* read: buffers received / write: buffers filled */
+    enum litepcie_dma_slot_state state;
+};
 
 struct litepcie_dma_ctrl {
     uint8_t use_reader, use_writer, loopback, zero_copy;
+    uint8_t refresh; /* zero-copy: read the hardware progress on every process call */
     file_t dma_fd;
     pollfd_s fds;
     char *buf_rd, *buf_wr;
@@ -34,12 +56,36 @@ struct litepcie_dma_ctrl {
     unsigned buffers_available_read, buffers_available_write;
     unsigned usr_read_buf_offset, usr_write_buf_offset;
     struct litepcie_ioctl_mmap_dma_info mmap_dma_info;
+    struct litepcie_ioctl_mmap_dma mmap_dma;
+    const struct litepcie_dma_shm_status *shm_status;
+    struct litepcie_dma_shm_doorbell *shm_doorbell;
+    uint8_t reader_enabled, writer_enabled;
+    uint8_t cleaning; /* set by litepcie_dma_cleanup, request errors no longer tear down */
     struct litepcie_ioctl_mmap_dma_update mmap_dma_update;
+    /* requested ring geometry, applied by init (0 = keep the driver's value) */
+    struct litepcie_ioctl_dma_config dma_config;
+    /* ring geometry in effect, from LITEPCIE_IOCTL_MMAP_DMA_INFO */
+    unsigned buf_rd_size, buf_rd_count, buf_rd_per_irq;
+    unsigned buf_wr_size, buf_wr_count, buf_wr_per_irq;
+    /* copy mode request queue (queue_depth = 0 selects the default) */
+    unsigned queue_depth, rd_slot_buffers, wr_slot_buffers;
+#if defined(_WIN32)
+    HANDLE iocp;
+#endif
+    struct litepcie_dma_slot rd_slots[LITEPCIE_DMA_QUEUE_DEPTH_MAX];
+    struct litepcie_dma_slot wr_slots[LITEPCIE_DMA_QUEUE_DEPTH_MAX];
+    unsigned rd_head, rd_ready, rd_user_slot;
+    unsigned wr_head, wr_user_slot;
 };
 
 void litepcie_dma_set_loopback(file_t fd, uint8_t loopback_enable);
 void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
 void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
+void litepcie_dma_reader_refresh(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
+void litepcie_dma_writer_refresh(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
+int litepcie_dma_config(file_t fd, struct litepcie_ioctl_dma_config *config);
+int litepcie_dma_irq_interval(file_t fd, struct litepcie_ioctl_dma_irq_interval *interval);
+int litepcie_dma_poll(file_t fd, struct litepcie_ioctl_dma_poll *poll);
 
 uint8_t litepcie_request_dma(file_t fd, uint8_t reader, uint8_t writer);
 void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer);
@@ -47,7 +93,15 @@ void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer);
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy);
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma);
 void litepcie_dma_process(struct litepcie_dma_ctrl *dma);
+/* change the IRQ interval of a running ring (0 = keep) and follow it in the
+   slot caps. Returns -1 on failure, else the DMA_RESTARTED_* of the rings
+   that were reloaded, each with a break in its stream at the buffer in flight */
+int litepcie_dma_set_irq_interval(struct litepcie_dma_ctrl *dma, unsigned writer_per_irq, unsigned reader_per_irq);
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma);
+/* same, with *ts set to when the driver saw the buffer complete, in
+   QueryPerformanceCounter ticks. Zero-copy mode only: in copy mode the
+   buffer-to-request mapping is not visible here and *ts is set to 0. */
+char *litepcie_dma_next_read_buffer_ts(struct litepcie_dma_ctrl *dma, int64_t *ts);
 char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma);
 
 #endif /* LITEPCIE_LIB_DMA_H */
@@ -21,19 +21,55 @@
 #define FLASH_WRDI    0x04
 #define FLASH_PP      0x02
 #define FLASH_SE      0xD8
+#define FLASH_SE_4K   0x20
 #define FLASH_BE      0xC7
 #define FLASH_RDSR    0x05
 #define FLASH_WRSR    0x01
+#define FLASH_RDSFDP  0x5A
 /* status */
 #define FLASH_WIP     0x01
 
 #define FLASH_SECTOR_SIZE (1 << 16)
 
+#define FLASH_SFDP_SIGNATURE 0x50444653 /* "SFDP" */
+#define FLASH_ERASE_TYPES 4
+
+struct litepcie_flash_erase_type {
+    uint32_t size;    /* bytes, 0 if unused */
+    uint8_t  cmd;
+    uint32_t time_us; /* typical, 0 if unknown */
+};
+
+/* geometry and timings, from SFDP when the flash has it */
+struct litepcie_flash_info {
+    uint32_t id;              /* JEDEC manufacturer and device id */
+    int      sfdp;            /* 1 if read from SFDP, else defaults */
+    uint32_t size;            /* bytes, 0 if unknown */
+    uint32_t page_size;
+    uint32_t page_program_us; /* typical */
+    uint8_t  chip_erase_cmd;
+    uint32_t chip_erase_us;   /* typical, 0 if unknown */
+    struct litepcie_flash_erase_type erase[FLASH_ERASE_TYPES]; /* by ascending size */
+};
+
 uint8_t litepcie_flash_read(file_t fd, uint32_t addr);
+/* bulk read, streamed under one chip select when the gateware has software CS */
+void litepcie_flash_read_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint32_t size);
+/* 64-bit FNV-1a of size bytes of flash at base */
+int litepcie_flash_hash(file_t fd, uint32_t base, uint32_t size, uint64_t *hash,
+                        void (*progress_cb)(void *opaque, const char *fmt, ...),
+                        void *opaque);
+int litepcie_flash_get_info(file_t fd, struct litepcie_flash_info *info);
+/* smallest erase size, the alignment of writes and updates */
 int litepcie_flash_get_erase_block_size(file_t fd);
 int litepcie_flash_write(file_t fd,
                          uint8_t *buf, uint32_t base, uint32_t size,
                          void (*progress_cb)(void *opaque, const char *fmt, ...),
                          void *opaque);
+/* like litepcie_flash_write, but only erases/programs what differs from the flash */
+int litepcie_flash_update(file_t fd,
+                          const uint8_t *buf, uint32_t base, uint32_t size,
+                          void (*progress_cb)(void *opaque, const char *fmt, ...),
+                          void *opaque, uint32_t *bytes_written);
 
 #endif //LITEPCIE_LIB_FLASH_H
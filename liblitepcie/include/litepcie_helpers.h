@@ -11,6 +11,7 @@
 #ifndef LITEPCIE_LIB_HELPERS_H
 #define LITEPCIE_LIB_HELPERS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -29,11 +30,45 @@ typedef int file_t
 void _check_ioctl(file_t status, const char *file, int line);
 #endif
 
+/* map BAR0 of a \CTRL file so litepcie_readl/writel skip the ioctl,
+   writable mappings need an elevated process */
+int litepcie_mmap_regs(file_t fd, uint8_t read_only);
+void litepcie_munmap_regs(file_t fd);
+bool litepcie_regs_mapped(file_t fd);
+
 uint32_t litepcie_readl(file_t fd, uint32_t addr);
 void litepcie_writel(file_t fd, uint32_t addr, uint32_t val);
+
+/* run a vector of register operations in one ioctl, returns the number completed */
+struct litepcie_reg_op;
+uint32_t litepcie_reg_batch(file_t fd, struct litepcie_reg_op *ops, uint32_t count);
+void litepcie_readl_batch(file_t fd, const uint32_t *addrs, uint32_t *vals, uint32_t count);
+void litepcie_writel_batch(file_t fd, const uint32_t *addrs, const uint32_t *vals, uint32_t count);
 void litepcie_reload(file_t fd);
 
+/* ICAP register writes with done handshaking, returns the number completed
+   and, if elapsed_us is not NULL, the time the driver spent on them.
+   The ICAP core frames every write with its own sync/desync, so this suits
+   command and register writes (e.g. IPROG), not FDRI frame data. */
+struct litepcie_ioctl_icap;
+uint32_t litepcie_icap_stream(file_t fd, const struct litepcie_ioctl_icap *writes, uint32_t count, uint64_t *elapsed_us);
+
+/* identity, link, sensors and ring geometry in one call */
+struct litepcie_ioctl_info;
+void litepcie_get_info(file_t fd, struct litepcie_ioctl_info *info);
+
+/* driver DPC and copy worker timing, optionally cleared after reading */
+struct litepcie_ioctl_stats;
+void litepcie_stats(file_t fd, struct litepcie_ioctl_stats *stats, uint8_t reset);
+
+/* LitePCIe interfaces present, by index in enumeration order */
+int litepcie_device_count(void);
+int litepcie_device_path(int index, wchar_t* path, size_t maxLen);
+/* device litepcie_open uses, 0 by default */
+void litepcie_select_device(int index);
+
 file_t litepcie_open(const char* name, int32_t flags);
+file_t litepcie_open_device(int index, const char* name, int32_t flags);
 
 void litepcie_close(file_t fd);
 
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_TIME_H
+#define LITEPCIE_LIB_TIME_H
+
+#include <stdint.h>
+#include "litepcie_helpers.h"
+
+#define LITEPCIE_TIME_WINDOW 64 /* samples kept for the fit */
+#define LITEPCIE_TIME_PROBES 8  /* reads per sample, the tightest one is kept */
+
+/* TIMER0 wraps every 2^32 ticks (~43 s at 100 MHz), update at least that often */
+#define LITEPCIE_TIME_UPDATE_MAX_MS 30000
+
+struct litepcie_time_sample {
+    uint64_t dev;     /* TIMER0 ticks since the service started, unwrapped */
+    int64_t  host;    /* host ns at the middle of the read */
+    uint32_t bracket; /* half the host time the read took, ns */
+};
+
+/*
+ * Correlation between the free running TIMER0 of the SoC and the host
+ * monotonic clock (QueryPerformanceCounter / CLOCK_MONOTONIC_RAW). Each
+ * update latches TIMER0 between two host clock reads and refits
+ * host = host0 + (dev - dev0) * ns_per_tick over the last samples.
+ */
+struct litepcie_time {
+    file_t fd;
+    uint32_t last_up;  /* last TIMER0 reading, as an up count */
+    uint64_t dev_now;  /* unwrapped ticks at the last reading */
+
+    struct litepcie_time_sample samples[LITEPCIE_TIME_WINDOW];
+    uint32_t count;
+    uint32_t head;
+
+    /* fit */
+    uint64_t dev0;
+    int64_t  host0;
+    double   ns_per_tick;
+    double   drift_ppm;  /* of TIMER0 against CONFIG_CLOCK_FREQUENCY on the host clock */
+    uint32_t error_ns;   /* largest residual plus bracket over the window */
+    uint32_t bracket_ns; /* of the last sample */
+};
+
+/* host clock the service correlates against */
+int64_t litepcie_time_host_ns(void);
+#if defined(_WIN32)
+/* QueryPerformanceCounter value (e.g. DMA buffer timestamps) on the same scale */
+int64_t litepcie_time_qpc_ns(int64_t qpc);
+#endif
+
+/* start TIMER0 free running unless it already is and take the first sample, 0 on success */
+int litepcie_time_init(struct litepcie_time *t, file_t fd);
+/* take a sample and refit, 0 on success */
+int litepcie_time_update(struct litepcie_time *t);
+/* unwrapped ticks for a raw TIMER0 value read near the last update */
+uint64_t litepcie_time_extend(const struct litepcie_time *t, uint32_t raw);
+/* host ns for unwrapped TIMER0 ticks */
+int64_t litepcie_time_to_host(const struct litepcie_time *t, uint64_t dev);
+/* unwrapped TIMER0 ticks for host ns */
+uint64_t litepcie_time_to_device(const struct litepcie_time *t, int64_t host);
+
+#endif /* LITEPCIE_LIB_TIME_H */
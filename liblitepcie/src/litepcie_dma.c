@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 
 #include "litepcie_dma.h"
@@ -35,10 +36,11 @@ void litepcie_dma_set_loopback(file_t fd, uint8_t loopback_enable) {
         &m, sizeof(struct litepcie_ioctl_dma), &len, 0);
 }
 
-void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+static void dma_writer_ioctl(file_t fd, uint8_t enable, uint8_t refresh, int64_t *hw_count, int64_t *sw_count) {
     struct litepcie_ioctl_dma_writer m;
     DWORD len;
     m.enable = enable;
+    m.refresh = refresh;
     checked_ioctl(fd, LITEPCIE_IOCTL_DMA_WRITER,
         &m, sizeof(struct litepcie_ioctl_dma_writer),
         &m, sizeof(struct litepcie_ioctl_dma_writer), &len, 0);
@@ -46,10 +48,11 @@ void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *
     *sw_count = m.sw_count;
 }
 
-void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+static void dma_reader_ioctl(file_t fd, uint8_t enable, uint8_t refresh, int64_t *hw_count, int64_t *sw_count) {
     struct litepcie_ioctl_dma_reader m;
     DWORD len;
     m.enable = enable;
+    m.refresh = refresh;
     checked_ioctl(fd, LITEPCIE_IOCTL_DMA_READER,
         &m, sizeof(struct litepcie_ioctl_dma_reader),
         &m, sizeof(struct litepcie_ioctl_dma_reader), &len, 0);
@@ -57,6 +60,59 @@ void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *
     *sw_count = m.sw_count;
 }
 
+void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    dma_writer_ioctl(fd, enable, 0, hw_count, sw_count);
+}
+
+void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    dma_reader_ioctl(fd, enable, 0, hw_count, sw_count);
+}
+
+/* same, with the hardware progress read now rather than at the last MSI */
+void litepcie_dma_writer_refresh(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    dma_writer_ioctl(fd, enable, 1, hw_count, sw_count);
+}
+
+void litepcie_dma_reader_refresh(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    dma_reader_ioctl(fd, enable, 1, hw_count, sw_count);
+}
+
+int litepcie_dma_config(file_t fd, struct litepcie_ioctl_dma_config *config) {
+    DWORD len;
+    /* fails while the channel is enabled or mapped, so not a checked_ioctl */
+    if (!DeviceIoControl(fd, LITEPCIE_IOCTL_DMA_CONFIG,
+        config, sizeof(struct litepcie_ioctl_dma_config),
+        config, sizeof(struct litepcie_ioctl_dma_config), &len, 0)) {
+        fprintf(stderr, "DMA config failed: %d\n", GetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+int litepcie_dma_irq_interval(file_t fd, struct litepcie_ioctl_dma_irq_interval *interval) {
+    DWORD len;
+    /* fails for an interval above the ring size, so not a checked_ioctl */
+    if (!DeviceIoControl(fd, LITEPCIE_IOCTL_DMA_IRQ_INTERVAL,
+        interval, sizeof(struct litepcie_ioctl_dma_irq_interval),
+        interval, sizeof(struct litepcie_ioctl_dma_irq_interval), &len, 0)) {
+        fprintf(stderr, "DMA IRQ interval failed: %d\n", GetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+int litepcie_dma_poll(file_t fd, struct litepcie_ioctl_dma_poll *poll) {
+    DWORD len;
+    /* fails for out of range settings, so not a checked_ioctl */
+    if (!DeviceIoControl(fd, LITEPCIE_IOCTL_DMA_POLL,
+        poll, sizeof(struct litepcie_ioctl_dma_poll),
+        poll, sizeof(struct litepcie_ioctl_dma_poll), &len, 0)) {
+        fprintf(stderr, "DMA poll config failed: %d\n", GetLastError());
+        return -1;
+    }
+    return 0;
+}
+
 /* lock */
 
 uint8_t litepcie_request_dma(file_t fd, uint8_t reader, uint8_t writer) {
@@ -84,6 +140,36 @@ void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer) {
         &m, sizeof(struct litepcie_ioctl_lock), &len, 0);
 }
 
+/* Deepest queue whose slots all fit in the buffers the engine leaves free
+   between interrupts, at least one slot. */
+static unsigned dma_clamp_depth(unsigned depth, unsigned count, unsigned per_irq)
+{
+    unsigned free = count > per_irq ? count - per_irq : 1;
+    return depth < free ? depth : free;
+}
+
+/* Size the copy mode slots so a full queue stays clear of the buffers the
+   engine may fill before its next interrupt. queue_depth never exceeds the
+   buffer count (dma_clamp_depth), so a one buffer slot stays in the ring. */
+static void dma_split_slots(struct litepcie_dma_ctrl *dma)
+{
+    dma->rd_slot_buffers = (dma->buf_rd_count - dma->buf_rd_per_irq) / dma->queue_depth;
+    if (dma->rd_slot_buffers == 0)
+        dma->rd_slot_buffers = 1;
+    dma->wr_slot_buffers = (dma->buf_wr_count - dma->buf_wr_per_irq) / dma->queue_depth;
+    if (dma->wr_slot_buffers == 0)
+        dma->wr_slot_buffers = 1;
+
+    for (unsigned i = 0; i < dma->queue_depth; i++) {
+        memset(&dma->rd_slots[i], 0, sizeof(struct litepcie_dma_slot));
+        memset(&dma->wr_slots[i], 0, sizeof(struct litepcie_dma_slot));
+        if (dma->use_writer)
+            dma->rd_slots[i].buf = dma->buf_rd + i * dma->rd_slot_buffers * dma->buf_rd_size;
+        if (dma->use_reader)
+            dma->wr_slots[i].buf = dma->buf_wr + i * dma->wr_slot_buffers * dma->buf_wr_size;
+    }
+}
+
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy)
 {
     DWORD len;
@@ -93,6 +179,12 @@ int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, ui
     dma->writer_sw_count = 0;
 
     dma->zero_copy = zero_copy;
+    dma->shm_status = NULL;
+    dma->shm_doorbell = NULL;
+    dma->reader_enabled = 0;
+    dma->writer_enabled = 0;
+    dma->cleaning = 0;
+    dma->iocp = NULL;
 
     int32_t flags = FILE_ATTRIBUTE_NORMAL;
     //if (zero_copy)
@@ -115,57 +207,242 @@ int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, ui
 
     litepcie_dma_set_loopback(dma->dma_fd, dma->loopback);
 
+    /* apply the requested ring geometry, if any */
+    if (dma->dma_config.writer_buf_size || dma->dma_config.writer_buf_count || dma->dma_config.writer_buf_per_irq ||
+        dma->dma_config.reader_buf_size || dma->dma_config.reader_buf_count || dma->dma_config.reader_buf_per_irq) {
+        if (litepcie_dma_config(dma->dma_fd, &dma->dma_config))
+            return -1;
+    }
+
+    /* get the ring geometry in effect */
+    checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_INFO,
+        &dma->mmap_dma_info, sizeof(struct litepcie_ioctl_mmap_dma_info),
+        &dma->mmap_dma_info, sizeof(struct litepcie_ioctl_mmap_dma_info), &len, 0);
+    dma->buf_rd_size = (unsigned)dma->mmap_dma_info.dma_rx_buf_size;
+    dma->buf_rd_count = (unsigned)dma->mmap_dma_info.dma_rx_buf_count;
+    dma->buf_rd_per_irq = (unsigned)dma->mmap_dma_info.dma_rx_buf_per_irq;
+    dma->buf_wr_size = (unsigned)dma->mmap_dma_info.dma_tx_buf_size;
+    dma->buf_wr_count = (unsigned)dma->mmap_dma_info.dma_tx_buf_count;
+    dma->buf_wr_per_irq = (unsigned)dma->mmap_dma_info.dma_tx_buf_per_irq;
+
     if (dma->zero_copy) {
         /* if mmap: get it from the kernel */
-        checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_INFO,
-            &dma->mmap_dma_info, sizeof(struct litepcie_ioctl_mmap_dma_info),
-            &dma->mmap_dma_info, sizeof(struct litepcie_ioctl_mmap_dma_info), &len, 0);
-        if (dma->use_writer) {
-            //TODO - Review
-            /**
-            dma->buf_rd = mmap(NULL, DMA_BUFFER_TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                               dma->fds.fd, dma->mmap_dma_info.dma_rx_buf_offset);
-            if (dma->buf_rd == MAP_FAILED) {
-                fprintf(stderr, "MMAP failed\n");
-                return -1;
-            }
-            */
-        }
-        if (dma->use_reader) {
-            //TODO - Review
-            /**
-            dma->buf_wr = mmap(NULL, DMA_BUFFER_TOTAL_SIZE, PROT_WRITE, MAP_SHARED,
-                               dma->fds.fd, dma->mmap_dma_info.dma_tx_buf_offset);
-            if (dma->buf_wr == MAP_FAILED) {
-                fprintf(stderr, "MMAP failed\n");
-                return -1;
-            }
-            */
+        if (!DeviceIoControl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA,
+            NULL, 0,
+            &dma->mmap_dma, sizeof(struct litepcie_ioctl_mmap_dma), &len, 0)) {
+            fprintf(stderr, "MMAP failed: %d\n", GetLastError());
+            return -1;
         }
+        if (dma->use_writer)
+            dma->buf_rd = (char *)dma->mmap_dma.dma_rx_buf_addr;
+        if (dma->use_reader)
+            dma->buf_wr = (char *)dma->mmap_dma.dma_tx_buf_addr;
+        dma->shm_status = (const struct litepcie_dma_shm_status *)dma->mmap_dma.dma_status_addr;
+        dma->shm_doorbell = (struct litepcie_dma_shm_doorbell *)dma->mmap_dma.dma_doorbell_addr;
     } else {
         /* else: allocate it */
         if (dma->use_writer) {
-            dma->buf_rd = calloc(1, DMA_BUFFER_TOTAL_SIZE);
+            dma->buf_rd = calloc(dma->buf_rd_count, dma->buf_rd_size);
             if (!dma->buf_rd) {
                 fprintf(stderr, "%d: alloc failed\n", __LINE__);
                 return -1;
             }
         }
         if (dma->use_reader) {
-            dma->buf_wr = calloc(1, DMA_BUFFER_TOTAL_SIZE);
+            dma->buf_wr = calloc(dma->buf_wr_count, dma->buf_wr_size);
             if (!dma->buf_wr) {
                 free(dma->buf_rd);
                 fprintf(stderr, "%d: alloc failed\n", __LINE__);
                 return -1;
             }
         }
+
+        /* split the buffers into queue_depth slices, one overlapped request each */
+        if (dma->queue_depth == 0)
+            dma->queue_depth = LITEPCIE_DMA_QUEUE_DEPTH_DEFAULT;
+        if (dma->queue_depth > LITEPCIE_DMA_QUEUE_DEPTH_MAX)
+            dma->queue_depth = LITEPCIE_DMA_QUEUE_DEPTH_MAX;
+        /* every slot needs a buffer of its own inside the ring */
+        if (dma->use_writer)
+            dma->queue_depth = dma_clamp_depth(dma->queue_depth, dma->buf_rd_count, dma->buf_rd_per_irq);
+        if (dma->use_reader)
+            dma->queue_depth = dma_clamp_depth(dma->queue_depth, dma->buf_wr_count, dma->buf_wr_per_irq);
+        dma_split_slots(dma);
+        dma->rd_head = 0;
+        dma->rd_ready = 0;
+        dma->rd_user_slot = 0;
+        dma->wr_head = 0;
+        dma->wr_user_slot = 0;
+        dma->buffers_available_read = 0;
+        dma->usr_read_buf_offset = 0;
+        /* all write slots can be filled before the first litepcie_dma_process */
+        dma->buffers_available_write = dma->use_reader ? dma->queue_depth * dma->wr_slot_buffers : 0;
+        dma->usr_write_buf_offset = 0;
+
+        /* reads and writes of both directions complete on one port */
+        dma->iocp = CreateIoCompletionPort(dma->dma_fd, NULL, 0, 1);
+        if (dma->iocp == NULL) {
+            fprintf(stderr, "CreateIoCompletionPort failed: %d\n", GetLastError());
+            free(dma->buf_rd);
+            free(dma->buf_wr);
+            return -1;
+        }
     }
 
     return 0;
 }
 
+int litepcie_dma_set_irq_interval(struct litepcie_dma_ctrl *dma, unsigned writer_per_irq, unsigned reader_per_irq)
+{
+    struct litepcie_ioctl_dma_irq_interval m;
+    unsigned i;
+
+    memset(&m, 0, sizeof(m));
+    m.writer_buf_per_irq = writer_per_irq;
+    m.reader_buf_per_irq = reader_per_irq;
+    if (litepcie_dma_irq_interval(dma->dma_fd, &m))
+        return -1;
+    dma->buf_rd_per_irq = m.writer_buf_per_irq;
+    dma->buf_wr_per_irq = m.reader_buf_per_irq;
+
+    if (dma->zero_copy)
+        return (int)m.restarted;
+
+    /* slots can only be resized while none holds data, otherwise the
+       current split is kept until the next init */
+    if (dma->rd_ready)
+        return (int)m.restarted;
+    for (i = 0; i < dma->queue_depth; i++) {
+        if (dma->rd_slots[i].state != LITEPCIE_DMA_SLOT_IDLE ||
+            dma->wr_slots[i].state != LITEPCIE_DMA_SLOT_IDLE || dma->wr_slots[i].count)
+            return (int)m.restarted;
+    }
+    dma_split_slots(dma);
+    dma->buffers_available_write = dma->use_reader ? dma->queue_depth * dma->wr_slot_buffers : 0;
+    dma->wr_user_slot = dma->wr_head;
+    dma->usr_write_buf_offset = 0;
+    return (int)m.restarted;
+}
+
+/* copy mode request queue */
+
+static struct litepcie_dma_slot *dma_find_slot(struct litepcie_dma_ctrl *dma, OVERLAPPED *ov, uint8_t *is_read)
+{
+    for (unsigned i = 0; i < dma->queue_depth; i++) {
+        if (ov == &dma->rd_slots[i].overlapped) {
+            *is_read = 1;
+            return &dma->rd_slots[i];
+        }
+        if (ov == &dma->wr_slots[i].overlapped) {
+            *is_read = 0;
+            return &dma->wr_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Reap one completion packet. Returns 0 when none arrived within timeout. */
+static int dma_reap(struct litepcie_dma_ctrl *dma, DWORD timeout)
+{
+    struct litepcie_dma_slot *slot;
+    OVERLAPPED *ov = NULL;
+    ULONG_PTR key;
+    DWORD len = 0;
+    uint8_t is_read;
+    BOOL ok;
+
+    ok = GetQueuedCompletionStatus(dma->iocp, &len, &key, &ov, timeout);
+    if (ov == NULL)
+        return ok; /* timeout, or a packet with no request attached (ioctl) */
+
+    slot = dma_find_slot(dma, ov, &is_read);
+    if (slot == NULL)
+        return 1;
+
+    if (!ok && GetLastError() != ERROR_OPERATION_ABORTED) {
+        if (dma->cleaning) {
+            /* draining from litepcie_dma_cleanup, the request is over either way */
+            slot->count = 0;
+            slot->state = LITEPCIE_DMA_SLOT_IDLE;
+            return 1;
+        }
+        fprintf(stderr, "%s failed: %d\n", is_read ? "Read" : "Write", GetLastError());
+        fprintf(stderr, "%s args: 0x%p - 0x%x - 0x%x\n", is_read ? "Read" : "Write",
+            slot->buf, slot->count, len);
+        fprintf(stderr, "DMA Writer: 0x%llx - 0x%llx\n", dma->writer_hw_count, dma->writer_sw_count);
+        fprintf(stderr, "DMA Reader: 0x%llx - 0x%llx\n", dma->reader_hw_count, dma->reader_sw_count);
+        slot->state = LITEPCIE_DMA_SLOT_IDLE;
+        litepcie_dma_cleanup(dma);
+        abort();
+    }
+
+    if (is_read) {
+        slot->count = ok ? len / dma->buf_rd_size : 0;
+        slot->state = LITEPCIE_DMA_SLOT_DONE;
+    } else {
+        slot->count = 0;
+        slot->state = LITEPCIE_DMA_SLOT_IDLE;
+    }
+    return 1;
+}
+
+static void dma_issue_read(struct litepcie_dma_ctrl *dma, struct litepcie_dma_slot *slot)
+{
+    memset(&slot->overlapped, 0, sizeof(OVERLAPPED));
+    slot->count = 0;
+    slot->state = LITEPCIE_DMA_SLOT_PENDING;
+    if (!ReadFile(dma->dma_fd, slot->buf, dma->rd_slot_buffers * dma->buf_rd_size, NULL, &slot->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        fprintf(stderr, "Read failed: %d\n", GetLastError());
+        litepcie_dma_cleanup(dma);
+        abort();
+    }
+}
+
+static void dma_issue_write(struct litepcie_dma_ctrl *dma, struct litepcie_dma_slot *slot)
+{
+    memset(&slot->overlapped, 0, sizeof(OVERLAPPED));
+    slot->state = LITEPCIE_DMA_SLOT_PENDING;
+    if (!WriteFile(dma->dma_fd, slot->buf, slot->count * dma->buf_wr_size, NULL, &slot->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        fprintf(stderr, "Write failed: %d\n", GetLastError());
+        litepcie_dma_cleanup(dma);
+        abort();
+    }
+}
+
+static unsigned dma_pending(struct litepcie_dma_ctrl *dma)
+{
+    unsigned pending = 0;
+    for (unsigned i = 0; i < dma->queue_depth; i++) {
+        pending += dma->rd_slots[i].state == LITEPCIE_DMA_SLOT_PENDING;
+        pending += dma->wr_slots[i].state == LITEPCIE_DMA_SLOT_PENDING;
+    }
+    return pending;
+}
+
+/* Cancel outstanding requests and wait for them. Returns 0 if some never completed. */
+static int dma_drain(struct litepcie_dma_ctrl *dma)
+{
+    if (dma->iocp == NULL || dma_pending(dma) == 0)
+        return 1;
+    CancelIoEx(dma->dma_fd, NULL);
+    while (dma_pending(dma)) {
+        if (!dma_reap(dma, 10 * LITEPCIE_DMA_TIMEOUT_MS))
+            return 0;
+    }
+    return 1;
+}
+
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma)
 {
+    DWORD len;
+
+    /* the error paths it is called from may run again while it drains */
+    if (dma->cleaning)
+        return;
+    dma->cleaning = 1;
+
     if (dma->use_reader)
         litepcie_dma_reader(dma->dma_fd, 0, &dma->reader_hw_count, &dma->reader_sw_count);
     if (dma->use_writer)
@@ -174,17 +451,27 @@ void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma)
     litepcie_release_dma(dma->dma_fd, dma->use_reader, dma->use_writer);
 
     if (dma->zero_copy) {
-        if (dma->use_reader)
-            //TODO - Review
-            //munmap(dma->buf_wr, dma->mmap_dma_info.dma_tx_buf_size * dma->mmap_dma_info.dma_tx_buf_count);
-            ;;
-        if (dma->use_writer)
-            //TODO - Review
-            //munmap(dma->buf_rd, dma->mmap_dma_info.dma_tx_buf_size * dma->mmap_dma_info.dma_tx_buf_count);
-            ;;
+        checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MUNMAP_DMA,
+            NULL, 0,
+            NULL, 0, &len, 0);
+        dma->buf_rd = NULL;
+        dma->buf_wr = NULL;
+        dma->shm_status = NULL;
+        dma->shm_doorbell = NULL;
     } else {
-        free(dma->buf_rd);
-        free(dma->buf_wr);
+        /* buffers can only be released once no request references them */
+        if (dma_drain(dma)) {
+            free(dma->buf_rd);
+            free(dma->buf_wr);
+        } else {
+            fprintf(stderr, "DMA requests still pending, leaking buffers\n");
+        }
+        dma->buf_rd = NULL;
+        dma->buf_wr = NULL;
+        if (dma->iocp) {
+            CloseHandle(dma->iocp);
+            dma->iocp = NULL;
+        }
     }
 
     litepcie_close(dma->dma_fd);
@@ -196,113 +483,195 @@ void litepcie_dma_process(struct litepcie_dma_ctrl *dma)
     DWORD retVal;
 
     /* set / get dma */
-    if (dma->use_writer)
-        litepcie_dma_writer(dma->dma_fd, 1, &dma->writer_hw_count, &dma->writer_sw_count);
-    if (dma->use_reader)
-        litepcie_dma_reader(dma->dma_fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+    if (dma->shm_status) {
+        /* enable once, then follow progress through the shared counter pages */
+        if (dma->use_writer && !dma->writer_enabled)
+            litepcie_dma_writer(dma->dma_fd, 1, &dma->writer_hw_count, &dma->writer_sw_count);
+        if (dma->use_reader && !dma->reader_enabled)
+            litepcie_dma_reader(dma->dma_fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+        dma->writer_enabled = dma->use_writer;
+        dma->reader_enabled = dma->use_reader;
+
+        /* low rates: fold the progress made since the last MSI */
+        if (dma->refresh && dma->use_writer)
+            litepcie_dma_writer_refresh(dma->dma_fd, 1, &dma->writer_hw_count, &dma->writer_sw_count);
+        if (dma->refresh && dma->use_reader)
+            litepcie_dma_reader_refresh(dma->dma_fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+
+        dma->writer_hw_count = ReadAcquire64(&dma->shm_status->writer_hw_count);
+        dma->writer_sw_count = ReadAcquire64(&dma->shm_doorbell->writer_sw_count);
+        dma->reader_hw_count = ReadAcquire64(&dma->shm_status->reader_hw_count);
+        dma->reader_sw_count = ReadAcquire64(&dma->shm_doorbell->reader_sw_count);
+    } else {
+        /* one ioctl per call anyway, so always pick up the live progress */
+        if (dma->use_writer)
+            litepcie_dma_writer_refresh(dma->dma_fd, 1, &dma->writer_hw_count, &dma->writer_sw_count);
+        if (dma->use_reader)
+            litepcie_dma_reader_refresh(dma->dma_fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+    }
 
     if (dma->zero_copy) {
         /* count available buffers */
-        dma->buffers_available_write = (DMA_BUFFER_COUNT / 2) - (dma->reader_sw_count - dma->reader_hw_count);
-        if (dma->buffers_available_write >= (DMA_BUFFER_COUNT / 2))
+        dma->buffers_available_write = (dma->buf_wr_count / 2) - (dma->reader_sw_count - dma->reader_hw_count);
+        if (dma->buffers_available_write >= (dma->buf_wr_count / 2))
         {
-            dma->buffers_available_write = DMA_BUFFER_COUNT / 2;
+            dma->buffers_available_write = dma->buf_wr_count / 2;
         }
-        dma->usr_write_buf_offset = dma->reader_sw_count % DMA_BUFFER_COUNT;
+        dma->usr_write_buf_offset = dma->reader_sw_count % dma->buf_wr_count;
 
         /* update dma sw_count */
         dma->mmap_dma_update.sw_count = dma->reader_sw_count + dma->buffers_available_write;
-        checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE,
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &len, 0);
+        if (dma->shm_doorbell)
+            WriteRelease64(&dma->shm_doorbell->reader_sw_count, dma->mmap_dma_update.sw_count);
+        else
+            checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE,
+                &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
+                &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &len, 0);
 
         /* count available buffers */
         dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
-        dma->usr_read_buf_offset = dma->writer_sw_count % DMA_BUFFER_COUNT;
+        dma->usr_read_buf_offset = dma->writer_sw_count % dma->buf_rd_count;
 
         /* update dma sw_count*/
         dma->mmap_dma_update.sw_count = dma->writer_sw_count + dma->buffers_available_read;
-        checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE,
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &len, 0);
+        if (dma->shm_doorbell)
+            WriteRelease64(&dma->shm_doorbell->writer_sw_count, dma->mmap_dma_update.sw_count);
+        else
+            checked_ioctl(dma->dma_fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE,
+                &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
+                &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &len, 0);
 
     }
     else {
-        OVERLAPPED writeData = { 0 };
-        OVERLAPPED readData = { 0 };
-        
-        //Start Write
-        dma->buffers_available_write = (dma->reader_hw_count - dma->reader_sw_count);
-        if (dma->buffers_available_write >= (DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ))
-        {
-            dma->buffers_available_write = DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ;
+        struct litepcie_dma_slot *slot;
+        unsigned i;
+
+        /* Recycle the read slots handed out by the previous call */
+        for (i = 0; i < dma->rd_ready; i++) {
+            dma->rd_slots[dma->rd_head].state = LITEPCIE_DMA_SLOT_IDLE;
+            dma->rd_head = (dma->rd_head + 1) % dma->queue_depth;
         }
-        if (dma->buffers_available_write > 1)
-        {
-            WriteFile(dma->dma_fd, dma->buf_wr, dma->buffers_available_write * DMA_BUFFER_SIZE, &len, &writeData);
+        dma->rd_ready = 0;
+
+        /* Queue reads on every idle slot, in ring order */
+        if (dma->use_writer) {
+            for (i = 0; i < dma->queue_depth; i++) {
+                slot = &dma->rd_slots[(dma->rd_head + i) % dma->queue_depth];
+                if (slot->state == LITEPCIE_DMA_SLOT_IDLE)
+                    dma_issue_read(dma, slot);
+            }
         }
 
-        //Start Read
-        dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
-        if (dma->buffers_available_read >= (DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ))
-        {
-            dma->buffers_available_read = DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ;
+        /* Queue writes for the slots filled since the previous call */
+        if (dma->use_reader) {
+            for (i = 0; i < dma->queue_depth; i++) {
+                slot = &dma->wr_slots[dma->wr_head];
+                if (slot->state != LITEPCIE_DMA_SLOT_IDLE || slot->count == 0)
+                    break;
+                dma_issue_write(dma, slot);
+                dma->wr_head = (dma->wr_head + 1) % dma->queue_depth;
+            }
         }
-        if (dma->buffers_available_read > 1)
-        {
-            ReadFile(dma->dma_fd, dma->buf_rd, dma->buffers_available_read * DMA_BUFFER_SIZE, &len, &readData);
+
+        /* Wait for the oldest read (or the oldest write when only writing),
+           then collect whatever else has completed meanwhile */
+        for (;;) {
+            if (dma->use_writer)
+                slot = &dma->rd_slots[dma->rd_head];
+            else if (dma->use_reader)
+                slot = &dma->wr_slots[dma->wr_head];
+            else
+                break;
+            if (slot->state != LITEPCIE_DMA_SLOT_PENDING)
+                break;
+            if (!dma_reap(dma, LITEPCIE_DMA_TIMEOUT_MS))
+                break;
         }
-        //Complete Read
-        len = 0;
-        if (dma->buffers_available_read > 1)
-        {
-            if (!GetOverlappedResult(dma->dma_fd, &readData, &len, TRUE))
-            {
-                fprintf(stderr, "Read failed: %d\n", GetLastError());
-                fprintf(stderr, "Read args: 0x%p - 0x%lx - 0x%x\n", dma->buf_rd, dma->buffers_available_read, len);
-                fprintf(stderr, "DMA Writer: 0x%llx - 0x%llx\n", dma->writer_hw_count, dma->writer_sw_count);
-                litepcie_dma_cleanup(dma);
-                abort();
-            }
+        while (dma_reap(dma, 0));
+
+        /* Hand completed reads to the user, oldest first */
+        dma->buffers_available_read = 0;
+        for (i = 0; i < dma->queue_depth && dma->use_writer; i++) {
+            slot = &dma->rd_slots[(dma->rd_head + i) % dma->queue_depth];
+            if (slot->state != LITEPCIE_DMA_SLOT_DONE)
+                break;
+            dma->buffers_available_read += slot->count;
+            dma->rd_ready++;
         }
-        dma->buffers_available_read = len / DMA_BUFFER_SIZE;
+        dma->rd_user_slot = dma->rd_head;
         dma->usr_read_buf_offset = 0;
 
-        //Complete Write
-        len = 0;
-        if (dma->buffers_available_write > 1)
-        {
-            if (!GetOverlappedResult(dma->dma_fd, &writeData, &len, TRUE))
-            {
-                fprintf(stderr, "Write failed: %d\n", GetLastError());
-                fprintf(stderr, "Write args: 0x%p - 0x%lx - %x\n", dma->buf_wr, dma->buffers_available_write, len);
-                fprintf(stderr, "DMA Reader: 0x%llx - 0x%llx\n", dma->reader_hw_count, dma->reader_sw_count);
-                litepcie_dma_cleanup(dma);
-                abort();
-            }
+        /* Hand free write slots to the user, oldest first */
+        dma->buffers_available_write = 0;
+        for (i = 0; i < dma->queue_depth && dma->use_reader; i++) {
+            slot = &dma->wr_slots[(dma->wr_head + i) % dma->queue_depth];
+            if (slot->state != LITEPCIE_DMA_SLOT_IDLE)
+                break;
+            dma->buffers_available_write += dma->wr_slot_buffers - slot->count;
         }
-        dma->buffers_available_write = len / DMA_BUFFER_SIZE;
-        dma->usr_write_buf_offset = 0;
-
+        dma->wr_user_slot = dma->wr_head;
+        dma->usr_write_buf_offset = dma->wr_slots[dma->wr_head].count;
     }
 }
 
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma)
 {
+    return litepcie_dma_next_read_buffer_ts(dma, NULL);
+}
+
+char *litepcie_dma_next_read_buffer_ts(struct litepcie_dma_ctrl *dma, int64_t *ts)
+{
+    struct litepcie_dma_slot *slot;
+    char *ret;
+
     if (!dma->buffers_available_read)
         return NULL;
     dma->buffers_available_read--;
-    char *ret = dma->buf_rd + dma->usr_read_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_read_buf_offset = (dma->usr_read_buf_offset + 1) % DMA_BUFFER_COUNT;
+    if (dma->zero_copy) {
+        ret = dma->buf_rd + dma->usr_read_buf_offset * dma->buf_rd_size;
+        if (ts)
+            *ts = dma->shm_status ? ReadNoFence64(&dma->shm_status->writer_ts[dma->usr_read_buf_offset]) : 0;
+        dma->usr_read_buf_offset = (dma->usr_read_buf_offset + 1) % dma->buf_rd_count;
+        return ret;
+    }
+
+    /* skip to the next completed slot once this one is consumed */
+    slot = &dma->rd_slots[dma->rd_user_slot];
+    while (dma->usr_read_buf_offset >= slot->count) {
+        dma->rd_user_slot = (dma->rd_user_slot + 1) % dma->queue_depth;
+        dma->usr_read_buf_offset = 0;
+        slot = &dma->rd_slots[dma->rd_user_slot];
+    }
+    ret = slot->buf + dma->usr_read_buf_offset * dma->buf_rd_size;
+    if (ts)
+        *ts = 0;
+    dma->usr_read_buf_offset++;
     return ret;
 }
 
 char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma)
 {
+    struct litepcie_dma_slot *slot;
+    char *ret;
+
     if (!dma->buffers_available_write)
         return NULL;
     dma->buffers_available_write--;
-    char *ret = dma->buf_wr + dma->usr_write_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_write_buf_offset = (dma->usr_write_buf_offset + 1) % DMA_BUFFER_COUNT;
+    if (dma->zero_copy) {
+        ret = dma->buf_wr + dma->usr_write_buf_offset * dma->buf_wr_size;
+        dma->usr_write_buf_offset = (dma->usr_write_buf_offset + 1) % dma->buf_wr_count;
+        return ret;
+    }
+
+    /* move to the next free slot once this one is full */
+    slot = &dma->wr_slots[dma->wr_user_slot];
+    if (dma->usr_write_buf_offset >= dma->wr_slot_buffers) {
+        dma->wr_user_slot = (dma->wr_user_slot + 1) % dma->queue_depth;
+        dma->usr_write_buf_offset = 0;
+        slot = &dma->wr_slots[dma->wr_user_slot];
+    }
+    ret = slot->buf + dma->usr_write_buf_offset * dma->buf_wr_size;
+    dma->usr_write_buf_offset++;
+    slot->count = dma->usr_write_buf_offset;
     return ret;
 }
@@ -32,9 +32,28 @@
 
 #ifdef CSR_FLASH_BASE
 
-//#define FLASH_FULL_ERASE
 #define FLASH_RETRIES 16
 
+/* WIP polling: a few polls per typical operation time, within these bounds */
+#define FLASH_POLLS_PER_OP 16
+#define FLASH_POLL_MIN_US  10
+#define FLASH_POLL_MAX_US  50000
+
+/* typical times used when the flash has no SFDP table */
+#define FLASH_DEFAULT_PP_US 700
+#define FLASH_DEFAULT_SE_US 150000
+
+/* dwords of the basic flash parameter table used by the parser */
+#define SFDP_BFPT_DWORDS 16
+
+#define FLASH_HASH_INIT 0xcbf29ce484222325ULL
+
+enum {
+    FLASH_UNIT_UNCHANGED,
+    FLASH_UNIT_PROGRAM,
+    FLASH_UNIT_ERASE,
+};
+
 #if defined(_WIN32)
 void usleep(INT64 usec)
 {
@@ -96,10 +115,6 @@ static uint8_t flash_read_status(file_t fd)
     return flash_spi(fd, 16, FLASH_RDSR, 0) & 0xff;
 }
 
-static void flash_erase_sector(file_t fd, uint32_t addr)
-{
-    flash_spi(fd, 32, FLASH_SE, addr << 8);
-}
 /**
 static __attribute__((unused)) void flash_write_status(file_t fd, uint8_t value)
 {
@@ -124,35 +139,21 @@ static void flash_write(file_t fd, uint32_t addr, uint8_t byte)
 
 static void flash_write_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
 {
-    int i;
     DWORD len;
 
-    struct litepcie_ioctl_flash m;
+    struct litepcie_ioctl_flash_program m;
 
     if (size == 1) {
         flash_write(fd, addr, buf[0]);
     } else {
-        /* set cs_n */
-        flash_spi_cs(fd, 0);
-
-        /* send cmd */
-        m.tx_len = 32;
-        m.tx_data = ((uint64_t)FLASH_PP << 32) | ((uint64_t)addr << 8);
-        checked_ioctl(fd, LITEPCIE_IOCTL_FLASH,
-            &m, sizeof(struct litepcie_ioctl_flash),
-            &m, sizeof(struct litepcie_ioctl_flash), &len, 0);
-
-        /* send bytes */
-        for (i=0; i<size; i++) {
-            m.tx_len = 8;
-            m.tx_data = ((uint64_t)buf[i] << 32);
-            checked_ioctl(fd, LITEPCIE_IOCTL_FLASH,
-                &m, sizeof(struct litepcie_ioctl_flash),
-                &m, sizeof(struct litepcie_ioctl_flash), &len, 0);
-        }
-
-        /* release cs_n */
-        flash_spi_cs(fd, 1);
+        /* the driver frames the whole page under one chip select */
+        m.cmd = FLASH_PP;
+        m.addr = addr;
+        m.len = size;
+        memcpy(m.data, buf, size);
+        checked_ioctl(fd, LITEPCIE_IOCTL_FLASH_PROGRAM,
+            &m, sizeof(struct litepcie_ioctl_flash_program),
+            NULL, 0, &len, 0);
     }
 }
 
@@ -161,142 +162,525 @@ uint8_t litepcie_flash_read(file_t fd, uint32_t addr)
     return flash_spi(fd, 40, FLASH_READ, addr << 8) & 0xff;
 }
 
-static void litepcie_flash_read_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
+static int flash_software_cs_probe(file_t fd)
 {
-    int i;
-    DWORD len;
+    int software_cs = 1;
+    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 0);
+    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 0);
+    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 1);
+    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 1);
+    return software_cs;
+}
 
-    struct litepcie_ioctl_flash m;
+/* Probe results by file, shared by the flash workers of all boards. The
+   probe costs four register round trips, so bulk reads and page programs
+   reuse it; litepcie_flash_get_info probes again, which keeps a handle
+   value reused for another board from inheriting a stale answer. */
+#define FLASH_CS_CACHE_MAX 16
 
-    if (size == 1) {
-        buf[0] = litepcie_flash_read(fd, addr);
+static SRWLOCK flash_cs_lock = SRWLOCK_INIT;
+static unsigned flash_cs_next;
 
-    } else {
-        /* set cs_n */
-        flash_spi_cs(fd, 0);
-
-        /* send cmd */
-        m.tx_len = 32;
-        m.tx_data = ((uint64_t)FLASH_READ << 32) | ((uint64_t)addr << 8);
-        checked_ioctl(fd, LITEPCIE_IOCTL_FLASH,
-            &m, sizeof(struct litepcie_ioctl_flash),
-            &m, sizeof(struct litepcie_ioctl_flash), &len, 0);
-
-        /* read bytes */
-        for (i=0; i<size; i++) {
-            m.tx_len = 8;
-            checked_ioctl(fd, LITEPCIE_IOCTL_FLASH,
-                &m, sizeof(struct litepcie_ioctl_flash),
-                &m, sizeof(struct litepcie_ioctl_flash), &len, 0);
-            buf[i] = m.rx_data;
+static struct {
+    file_t fd;
+    int software_cs;
+} flash_cs_cache[FLASH_CS_CACHE_MAX];
+
+static int flash_software_cs_update(file_t fd, int probe)
+{
+    int software_cs = -1;
+    unsigned i;
+
+    if (!probe) {
+        AcquireSRWLockShared(&flash_cs_lock);
+        for (i = 0; i < FLASH_CS_CACHE_MAX; i++) {
+            if (flash_cs_cache[i].fd == fd) {
+                software_cs = flash_cs_cache[i].software_cs;
+                break;
+            }
         }
+        ReleaseSRWLockShared(&flash_cs_lock);
+        if (software_cs >= 0)
+            return software_cs;
+    }
+
+    software_cs = flash_software_cs_probe(fd);
 
-        /* release cs_n */
-        flash_spi_cs(fd, 1);
+    AcquireSRWLockExclusive(&flash_cs_lock);
+    for (i = 0; i < FLASH_CS_CACHE_MAX; i++) {
+        if (flash_cs_cache[i].fd == fd)
+            break;
+    }
+    if (i == FLASH_CS_CACHE_MAX) {
+        i = flash_cs_next;
+        flash_cs_next = (flash_cs_next + 1) % FLASH_CS_CACHE_MAX;
     }
+    flash_cs_cache[i].fd = fd;
+    flash_cs_cache[i].software_cs = software_cs;
+    ReleaseSRWLockExclusive(&flash_cs_lock);
+    return software_cs;
 }
 
-int litepcie_flash_get_erase_block_size(file_t fd)
+static int flash_software_cs(file_t fd)
 {
-    return FLASH_SECTOR_SIZE;
+    return flash_software_cs_update(fd, 0);
 }
 
-static int litepcie_flash_get_flash_program_size(file_t fd)
+/* stream from the flash, up to LITEPCIE_FLASH_READ_MAX per ioctl under one chip select */
+void litepcie_flash_read_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+    DWORD len;
+
+    struct litepcie_ioctl_flash_read m;
+
+    if (size > 1 && flash_software_cs(fd)) {
+        /* the driver clocks 32 data bits per SPI transfer */
+        while (size > 0) {
+            m.cmd = FLASH_READ;
+            m.dummy = 0;
+            m.addr = addr;
+            m.len = size < LITEPCIE_FLASH_READ_MAX ? size : LITEPCIE_FLASH_READ_MAX;
+            /* a driver built without software chip select rejects it,
+               the rest is read byte by byte below */
+            if (!DeviceIoControl(fd, LITEPCIE_IOCTL_FLASH_READ,
+                &m, sizeof(struct litepcie_ioctl_flash_read),
+                buf, m.len, &len, 0))
+                break;
+            addr += m.len;
+            buf += m.len;
+            size -= m.len;
+        }
+    }
+
+    /* every transfer is framed on its own, one READ command per byte */
+    while (size-- > 0)
+        *buf++ = litepcie_flash_read(fd, addr++);
+}
+
+static int litepcie_flash_get_flash_program_size(file_t fd, const struct litepcie_flash_info *info)
 {
-    int software_cs = 1;
     /* if software cs control, program in blocks to speed up update */
-    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 0);
-    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 0);
-    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 1);
-    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 1);
-    if (software_cs)
-        return 256;
+    if (flash_software_cs(fd))
+        return info->page_size < LITEPCIE_FLASH_PAGE_SIZE ? info->page_size : LITEPCIE_FLASH_PAGE_SIZE;
     else
         return 1;
 }
 
-int litepcie_flash_write(file_t fd,
-                     uint8_t *buf, uint32_t base, uint32_t size,
-                     void (*progress_cb)(void *opaque, const char *fmt, ...),
-                     void *opaque)
+/* poll WIP a few times over the typical duration of the running operation */
+static void flash_wait_ready(file_t fd, uint32_t typical_us)
 {
-    int i;
-    int retries;
-    uint16_t flash_program_size;
+    uint32_t interval = typical_us / FLASH_POLLS_PER_OP;
+
+    if (interval < FLASH_POLL_MIN_US)
+        interval = FLASH_POLL_MIN_US;
+    if (interval > FLASH_POLL_MAX_US)
+        interval = FLASH_POLL_MAX_US;
+    while (flash_read_status(fd) & FLASH_WIP)
+        usleep(interval);
+}
 
-    flash_program_size = litepcie_flash_get_flash_program_size(fd);
-    printf("flash_program_size: %d\n", flash_program_size);
+static uint32_t sfdp_dword(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-    uint8_t cmp_buf[256];
+static void sfdp_read(file_t fd, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+    DWORD len;
+    struct litepcie_ioctl_flash_read m;
+
+    /* RDSFDP takes a 24-bit address followed by 8 dummy clocks */
+    m.cmd = FLASH_RDSFDP;
+    m.dummy = 1;
+    m.addr = addr;
+    m.len = size;
+    checked_ioctl(fd, LITEPCIE_IOCTL_FLASH_READ,
+        &m, sizeof(struct litepcie_ioctl_flash_read),
+        buf, m.len, &len, 0);
+}
+
+/* parse the JEDEC basic flash parameter table (JESD216), 0 if there is none */
+static int flash_read_sfdp(file_t fd, struct litepcie_flash_info *info)
+{
+    static const uint32_t erase_units_us[4] = {1000, 16000, 128000, 1000000};
+    static const uint32_t chip_erase_units_us[4] = {16000, 256000, 4000000, 64000000};
+    uint8_t hdr[16], raw[4 * SFDP_BFPT_DWORDS];
+    uint32_t bfpt[SFDP_BFPT_DWORDS] = {0};
+    uint32_t dwords, ptp, density, size;
+    int i, n = 0;
+
+    sfdp_read(fd, 0, hdr, sizeof(hdr));
+    if (sfdp_dword(hdr) != FLASH_SFDP_SIGNATURE)
+        return 0;
+
+    /* the first parameter header always describes the basic table */
+    dwords = hdr[11];
+    ptp = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16);
+    if (hdr[8] != 0x00 || dwords < 9)
+        return 0;
+    if (dwords > SFDP_BFPT_DWORDS)
+        dwords = SFDP_BFPT_DWORDS;
+    sfdp_read(fd, ptp, raw, 4 * dwords);
+    for (i = 0; i < (int)dwords; i++)
+        bfpt[i] = sfdp_dword(raw + 4 * i);
+
+    /* 2nd dword: density in bits, as N-1 or as 2^N */
+    density = bfpt[1];
+    if (density & 0x80000000) {
+        density &= 0x7fffffff;
+        size = (density >= 3 && density < 35) ? (uint32_t)(1ULL << (density - 3)) : 0;
+    } else {
+        size = (uint32_t)(((uint64_t)density + 1) / 8);
+    }
+
+    /* 8th and 9th dwords: erase types as (size exponent, opcode) pairs */
+    for (i = 0; i < FLASH_ERASE_TYPES; i++) {
+        uint32_t type = (bfpt[7 + i / 2] >> (16 * (i % 2))) & 0xffff;
+        uint32_t exponent = type & 0xff;
+        if (exponent < 8 || exponent > 31)
+            continue;
+        info->erase[n].size = 1U << exponent;
+        info->erase[n].cmd = (type >> 8) & 0xff;
+        info->erase[n].time_us = 0;
+        /* 10th dword: typical erase times as 5-bit count and 2-bit units */
+        if (dwords >= 10) {
+            uint32_t time = (bfpt[9] >> (4 + 7 * i)) & 0x7f;
+            info->erase[n].time_us = ((time & 0x1f) + 1) * erase_units_us[time >> 5];
+        }
+        n++;
+    }
+    if (n == 0)
+        return 0;
+    for (; n < FLASH_ERASE_TYPES; n++)
+        memset(&info->erase[n], 0, sizeof(info->erase[n]));
+    info->size = size;
+
+    /* 11th dword: page size, typical page program and chip erase times */
+    if (dwords >= 11) {
+        uint32_t time;
+        info->page_size = 1U << ((bfpt[10] >> 4) & 0xf);
+        time = (bfpt[10] >> 8) & 0x3f;
+        info->page_program_us = ((time & 0x1f) + 1) * ((time & 0x20) ? 64 : 8);
+        time = (bfpt[10] >> 24) & 0x7f;
+        info->chip_erase_us = ((time & 0x1f) + 1) * chip_erase_units_us[time >> 5];
+    }
+
+    return 1;
+}
+
+int litepcie_flash_get_info(file_t fd, struct litepcie_flash_info *info)
+{
+    int i, j;
+
+    /* defaults when the flash has no SFDP table or it can not be read */
+    memset(info, 0, sizeof(*info));
+    info->page_size = 256;
+    info->page_program_us = FLASH_DEFAULT_PP_US;
+    info->chip_erase_cmd = FLASH_BE;
+    info->erase[0].size = FLASH_SECTOR_SIZE;
+    info->erase[0].cmd = FLASH_SE;
+    info->erase[0].time_us = FLASH_DEFAULT_SE_US;
 
     /* dummy command because in some case the first erase does not
        work. */
-    flash_read_id(fd, 0);
+    info->id = flash_read_id(fd, FLASH_READ_ID_REG);
+
+    /* SFDP needs address, dummy and data under one chip select */
+    if (flash_software_cs_update(fd, 1))
+        info->sfdp = flash_read_sfdp(fd, info);
+
+    /* keep erase types sorted by size, the planner relies on it */
+    for (i = 1; i < FLASH_ERASE_TYPES && info->erase[i].size; i++) {
+        struct litepcie_flash_erase_type t = info->erase[i];
+        for (j = i; j > 0 && info->erase[j - 1].size > t.size; j--)
+            info->erase[j] = info->erase[j - 1];
+        info->erase[j] = t;
+    }
+    if (info->page_size == 0 || info->page_size > info->erase[0].size)
+        info->page_size = 256;
 
-    /* disable write protection */
-     flash_write_enable(fd);
+    return 0;
+}
 
-#ifndef FLASH_FULL_ERASE
-    /* erase */
-    for(i = 0; i < size; i += FLASH_SECTOR_SIZE) {
-        if (progress_cb) {
-            progress_cb(opaque, "Erasing @%08x\r", base + i);
-        }
+int litepcie_flash_get_erase_block_size(file_t fd)
+{
+    struct litepcie_flash_info info;
+
+    litepcie_flash_get_info(fd, &info);
+    return info.erase[0].size;
+}
+
+/*
+ * Erase [addr, addr + size) with as few commands as possible: a chip erase when
+ * the range is the whole device, else the largest erase type aligned at each
+ * step, unless the smaller type covers the same span faster. addr and size are
+ * multiples of the smallest erase size.
+ */
+static void flash_erase_range(file_t fd, const struct litepcie_flash_info *info,
+                              uint32_t addr, uint32_t size,
+                              void (*progress_cb)(void *opaque, const char *fmt, ...),
+                              void *opaque)
+{
+    uint32_t end = addr + size;
+    int i;
+
+    if (info->size && addr == 0 && size >= info->size) {
+        if (progress_cb)
+            progress_cb(opaque, "Erasing chip\r");
         flash_write_enable(fd);
-        flash_erase_sector(fd, base + i);
-        while (flash_read_status(fd) & FLASH_WIP) {
-            usleep(1000);
-        }
-    }
-    if (progress_cb) {
-        progress_cb(opaque, "\n");
+        flash_spi(fd, 8, info->chip_erase_cmd, 0);
+        flash_wait_ready(fd, info->chip_erase_us);
+        flash_write_disable(fd);
+        return;
     }
-#else
-    /* erase full flash */
-    printf("Erasing...\n");
-    flash_write_enable(fd);
-    flash_spi(fd, 8, 0xC7, 0);
-    while (flash_read_status(fd) & FLASH_WIP) {
-        usleep(1000);
+
+    while (addr < end) {
+        const struct litepcie_flash_erase_type *t = &info->erase[0];
+
+        for (i = FLASH_ERASE_TYPES - 1; i > 0; i--) {
+            const struct litepcie_flash_erase_type *big = &info->erase[i];
+            if (big->size == 0 || addr % big->size || end - addr < big->size)
+                continue;
+            if (big->time_us && t->time_us &&
+                (uint64_t)big->time_us > (uint64_t)t->time_us * (big->size / t->size))
+                continue;
+            t = big;
+            break;
+        }
+
+        if (progress_cb)
+            progress_cb(opaque, "Erasing @%08x\r", addr);
+        flash_write_enable(fd);
+        flash_spi(fd, 32, t->cmd, addr << 8);
+        flash_wait_ready(fd, t->time_us);
+        addr += t->size;
     }
-#endif
     flash_write_disable(fd);
+}
 
-    i = 0;
-    retries = 0;
-    while (i < size) {
-        if (progress_cb && (i % FLASH_SECTOR_SIZE) == 0) {
-            progress_cb(opaque, "Writing @%08x\r", base + i);
-        }
+/* program one page (or byte without software CS) and verify it, with retries */
+static int flash_program_page(file_t fd, const struct litepcie_flash_info *info,
+                              uint32_t addr, uint8_t *buf, uint16_t size)
+{
+    uint8_t cmp_buf[256];
+    uint32_t typical_us = info->page_program_us * size / info->page_size;
+    int retries;
 
+    for (retries = 0; retries <= FLASH_RETRIES; retries++) {
         /* wait flash to be ready */
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+        flash_wait_ready(fd, typical_us);
 
         /* write flash page */
         flash_write_enable(fd);
-        flash_write_buffer(fd, base + i, buf + i, flash_program_size);
+        flash_write_buffer(fd, addr, buf, size);
         flash_write_disable(fd);
 
         /* wait flash to be ready*/
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+        flash_wait_ready(fd, typical_us);
 
         /* verify flash page */
-        litepcie_flash_read_buffer(fd, base + i, cmp_buf, flash_program_size);
-        if (memcmp(buf + i, cmp_buf, flash_program_size) != 0) {
-            retries += 1;
-        } else {
-            i += flash_program_size;
-            retries = 0;
+        litepcie_flash_read_buffer(fd, addr, cmp_buf, size);
+        if (memcmp(buf, cmp_buf, size) == 0)
+            return 0;
+    }
+
+    fprintf(stderr, "Not able to write page @%08x\n", addr);
+    return 1;
+}
+
+/* 64-bit FNV-1a, continued from hash */
+static uint64_t flash_hash_continue(uint64_t hash, const uint8_t *buf, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= buf[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int litepcie_flash_hash(file_t fd, uint32_t base, uint32_t size, uint64_t *hash,
+                        void (*progress_cb)(void *opaque, const char *fmt, ...),
+                        void *opaque)
+{
+    uint8_t *buf;
+    uint32_t offset, len;
+
+    buf = (uint8_t *)malloc(LITEPCIE_FLASH_READ_MAX);
+    if (!buf) {
+        fprintf(stderr, "flash_hash: out of memory\n");
+        return 1;
+    }
+
+    *hash = FLASH_HASH_INIT;
+    for (offset = 0; offset < size; offset += len) {
+        len = (size - offset) < LITEPCIE_FLASH_READ_MAX ? (size - offset) : LITEPCIE_FLASH_READ_MAX;
+        if (progress_cb)
+            progress_cb(opaque, "Reading @%08x\r", base + offset);
+        litepcie_flash_read_buffer(fd, base + offset, buf, len);
+        *hash = flash_hash_continue(*hash, buf, len);
+    }
+    if (progress_cb)
+        progress_cb(opaque, "\n");
+
+    free(buf);
+    return 0;
+}
+
+static int flash_is_erased(const uint8_t *buf, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if (buf[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+/* programming only clears bits, so new can be written over old if it sets none */
+static int flash_is_programmable(const uint8_t *old, const uint8_t *new_buf, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if ((old[i] & new_buf[i]) != new_buf[i])
+            return 0;
+    }
+    return 1;
+}
+
+int litepcie_flash_update(file_t fd,
+                          const uint8_t *buf, uint32_t base, uint32_t size,
+                          void (*progress_cb)(void *opaque, const char *fmt, ...),
+                          void *opaque, uint32_t *bytes_written)
+{
+    struct litepcie_flash_info info;
+    uint8_t *old_buf, *new_buf, *state;
+    uint32_t unit, units, total, i, run, offset;
+    uint16_t flash_program_size;
+    int ret = 0;
+
+    *bytes_written = 0;
+    litepcie_flash_get_info(fd, &info);
+    unit = info.erase[0].size;
+    if (base % unit) {
+        fprintf(stderr, "flash_update: base 0x%08x is not aligned to the %d bytes erase size\n",
+            base, unit);
+        return 1;
+    }
+
+    flash_program_size = litepcie_flash_get_flash_program_size(fd, &info);
+    units = (size + unit - 1) / unit;
+    total = units * unit;
+    old_buf = (uint8_t *)malloc(total);
+    new_buf = (uint8_t *)malloc(total);
+    state = (uint8_t *)calloc(units, 1);
+    if (!old_buf || !new_buf || !state) {
+        fprintf(stderr, "flash_update: out of memory\n");
+        free(old_buf);
+        free(new_buf);
+        free(state);
+        return 1;
+    }
+
+    /* Current contents; bytes past the image are kept as they are. */
+    if (progress_cb)
+        progress_cb(opaque, "Reading @%08x\r", base);
+    litepcie_flash_read_buffer(fd, base, old_buf, total);
+    memcpy(new_buf, old_buf, total);
+    memcpy(new_buf, buf, size);
+
+    /* Classify each erase unit: unchanged, program only, or erase. */
+    for (i = 0; i < units; i++) {
+        uint8_t *o = old_buf + i * unit, *n = new_buf + i * unit;
+        if (memcmp(o, n, unit) == 0)
+            state[i] = FLASH_UNIT_UNCHANGED;
+        else if (flash_is_programmable(o, n, unit))
+            state[i] = FLASH_UNIT_PROGRAM;
+        else
+            state[i] = FLASH_UNIT_ERASE;
+    }
+
+    /* Erase each run of dirty units with the fewest commands. */
+    for (i = 0; i < units; i += run) {
+        for (run = 1; state[i] == FLASH_UNIT_ERASE && i + run < units &&
+                      state[i + run] == FLASH_UNIT_ERASE; run++)
+            ;
+        if (state[i] != FLASH_UNIT_ERASE)
+            continue;
+        flash_erase_range(fd, &info, base + i * unit, run * unit, progress_cb, opaque);
+        memset(old_buf + i * unit, 0xff, run * unit);
+    }
+
+    for (i = 0; i < units && ret == 0; i++) {
+        uint32_t addr = base + i * unit;
+
+        if (state[i] == FLASH_UNIT_UNCHANGED) {
+            if (progress_cb)
+                progress_cb(opaque, "Unchanged @%08x\r", addr);
+            continue;
         }
 
-        if (retries > FLASH_RETRIES) {
-            printf("Not able to write page\n");
-            return 1;
+        if (progress_cb)
+            progress_cb(opaque, "Writing @%08x\r", addr);
+        for (offset = i * unit; offset < (i + 1) * unit; offset += flash_program_size) {
+            /* Skip pages that already hold the right data (erased or unchanged). */
+            if (memcmp(old_buf + offset, new_buf + offset, flash_program_size) == 0)
+                continue;
+            if (flash_is_erased(new_buf + offset, flash_program_size))
+                continue;
+            if (flash_program_page(fd, &info, base + offset, new_buf + offset, flash_program_size)) {
+                ret = 1;
+                break;
+            }
+            *bytes_written += flash_program_size;
         }
     }
 
+    if (progress_cb)
+        progress_cb(opaque, "\n");
+
+    free(old_buf);
+    free(new_buf);
+    free(state);
+    return ret;
+}
+
+int litepcie_flash_write(file_t fd,
+                     uint8_t *buf, uint32_t base, uint32_t size,
+                     void (*progress_cb)(void *opaque, const char *fmt, ...),
+                     void *opaque)
+{
+    struct litepcie_flash_info info;
+    uint32_t unit;
+    int i;
+    uint16_t flash_program_size;
+
+    litepcie_flash_get_info(fd, &info);
+    unit = info.erase[0].size;
+    if (base % unit) {
+        fprintf(stderr, "flash_write: base 0x%08x is not aligned to the %d bytes erase size\n",
+            base, unit);
+        return 1;
+    }
+
+    flash_program_size = litepcie_flash_get_flash_program_size(fd, &info);
+    if (progress_cb) {
+        progress_cb(opaque, "Program size %d bytes\n", flash_program_size);
+    }
+
+    /* erase, as a chip erase when the image covers the whole flash */
+    flash_erase_range(fd, &info, base, ((size + unit - 1) / unit) * unit,
+        progress_cb, opaque);
+    if (progress_cb) {
+        progress_cb(opaque, "\n");
+    }
+
+    for (i = 0; i < size; i += flash_program_size) {
+        if (progress_cb && (i % unit) == 0) {
+            progress_cb(opaque, "Writing @%08x\r", base + i);
+        }
+
+        if (flash_program_page(fd, &info, base + i, buf + i, flash_program_size))
+            return 1;
+    }
+
     if (progress_cb) {
         progress_cb(opaque, "\n");
     }
@@ -26,21 +26,22 @@
 #include <litepcie_public.h>
 #include "litepcie_helpers.h"
 
+#define ICAP_TIMEOUT_US 1000
 
- //Find Devices
-static void getDeviceName(PWCHAR devName, DWORD maxLen)
+
+ //Find Devices: path of the index-th LitePCIe interface, 0 on success
+static int getDeviceName(DWORD index, PWCHAR devName, DWORD maxLen)
 {
     DWORD detailLen = 0;
     DWORD dataSize = 0;
+    int ret = -1;
     SP_DEVICE_INTERFACE_DATA devData;
     PSP_DEVICE_INTERFACE_DETAIL_DATA pDetail;
     HDEVINFO hwDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_litepciedrv, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
 
     devData.cbSize = sizeof(devData);
-    if (!SetupDiEnumDeviceInterfaces(hwDevInfo, NULL, &GUID_DEVINTERFACE_litepciedrv, 0, &devData))
+    if (!SetupDiEnumDeviceInterfaces(hwDevInfo, NULL, &GUID_DEVINTERFACE_litepciedrv, index, &devData))
     {
-        //Print Error
-        fprintf(stderr, "No Devices Found\n");
         goto cleanup;
     }
 
@@ -67,7 +68,7 @@ static void getDeviceName(PWCHAR devName, DWORD maxLen)
     if (SetupDiGetDeviceInterfaceDetail(hwDevInfo, &devData, pDetail, detailLen, NULL, NULL))
     {
         wcsncpy_s(devName, maxLen, pDetail->DevicePath, _TRUNCATE);
-        fwprintf(stdout, L"Found device: %s\n", pDetail->DevicePath);
+        ret = 0;
     }
     else
     {
@@ -78,14 +79,147 @@ static void getDeviceName(PWCHAR devName, DWORD maxLen)
 
 cleanup:
     SetupDiDestroyDeviceInfoList(hwDevInfo);
-    return;
+    return ret;
 }
 
+/* device opened by litepcie_open */
+static int litepcie_device_index;
+
+int litepcie_device_count(void)
+{
+    SP_DEVICE_INTERFACE_DATA devData;
+    HDEVINFO hwDevInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_litepciedrv, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
+    int count = 0;
+
+    devData.cbSize = sizeof(devData);
+    while (SetupDiEnumDeviceInterfaces(hwDevInfo, NULL, &GUID_DEVINTERFACE_litepciedrv, count, &devData))
+        count++;
+
+    SetupDiDestroyDeviceInfoList(hwDevInfo);
+    return count;
+}
+
+int litepcie_device_path(int index, wchar_t* path, size_t maxLen)
+{
+    return getDeviceName(index, path, (DWORD)maxLen);
+}
+
+void litepcie_select_device(int index)
+{
+    litepcie_device_index = index;
+}
+
+
+/* BAR0 user mappings by file, set up with litepcie_mmap_regs. The table is
+   shared by all threads and guarded by regs_maps_lock; unmapping a file
+   must still not race with register accesses on that same file. */
+#define LITEPCIE_REGS_MAPS_MAX 16
+
+static SRWLOCK regs_maps_lock = SRWLOCK_INIT;
+
+static struct {
+    file_t fd;
+    volatile uint8_t* base;
+    uint32_t csr_base;
+    uint64_t size;
+    uint8_t read_only;
+} regs_maps[LITEPCIE_REGS_MAPS_MAX];
+
+static volatile uint32_t* regs_map_addr(file_t fd, uint32_t addr, uint8_t write) {
+    volatile uint32_t* reg = NULL;
+
+    AcquireSRWLockShared(&regs_maps_lock);
+    for (int i = 0; i < LITEPCIE_REGS_MAPS_MAX; i++) {
+        if (regs_maps[i].base != NULL && regs_maps[i].fd == fd) {
+            if (!(write && regs_maps[i].read_only) &&
+                addr >= regs_maps[i].csr_base &&
+                (uint64_t)(addr - regs_maps[i].csr_base) + sizeof(uint32_t) <= regs_maps[i].size)
+                reg = (volatile uint32_t*)(regs_maps[i].base + (addr - regs_maps[i].csr_base));
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&regs_maps_lock);
+    return reg;
+}
+
+int litepcie_mmap_regs(file_t fd, uint8_t read_only) {
+    struct litepcie_ioctl_mmap_regs m = { 0 };
+    DWORD len = 0;
+    int slot = -1;
+
+    /* Held across the ioctl so two threads cannot map the same file. */
+    AcquireSRWLockExclusive(&regs_maps_lock);
+    for (int i = 0; i < LITEPCIE_REGS_MAPS_MAX; i++) {
+        if (regs_maps[i].base != NULL && regs_maps[i].fd == fd) {
+            ReleaseSRWLockExclusive(&regs_maps_lock);
+            return 0;
+        }
+        if (regs_maps[i].base == NULL && slot < 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        ReleaseSRWLockExclusive(&regs_maps_lock);
+        fprintf(stderr, "mmap_regs: too many mappings\n");
+        return -1;
+    }
+
+    m.flags = read_only ? LITEPCIE_MMAP_REGS_READ_ONLY : LITEPCIE_MMAP_REGS_WRITE;
+    if (!DeviceIoControl(fd, LITEPCIE_IOCTL_MMAP_REGS,
+        &m, sizeof(m),
+        &m, sizeof(m), &len, 0) || len != sizeof(m)) {
+        ReleaseSRWLockExclusive(&regs_maps_lock);
+        fprintf(stderr, "mmap_regs failed: %d\n", GetLastError());
+        return -1;
+    }
+
+    regs_maps[slot].fd = fd;
+    regs_maps[slot].csr_base = m.csr_base;
+    regs_maps[slot].size = m.size;
+    regs_maps[slot].read_only = read_only;
+    regs_maps[slot].base = (volatile uint8_t*)(uintptr_t)m.addr;
+    ReleaseSRWLockExclusive(&regs_maps_lock);
+    return 0;
+}
+
+void litepcie_munmap_regs(file_t fd) {
+    bool mapped = false;
+    DWORD len = 0;
+
+    AcquireSRWLockExclusive(&regs_maps_lock);
+    for (int i = 0; i < LITEPCIE_REGS_MAPS_MAX; i++) {
+        if (regs_maps[i].base != NULL && regs_maps[i].fd == fd) {
+            regs_maps[i].base = NULL;
+            mapped = true;
+        }
+    }
+    ReleaseSRWLockExclusive(&regs_maps_lock);
+
+    if (mapped)
+        checked_ioctl(fd, LITEPCIE_IOCTL_MUNMAP_REGS,
+            NULL, 0,
+            NULL, 0, &len, 0);
+}
+
+bool litepcie_regs_mapped(file_t fd) {
+    bool mapped = false;
+
+    AcquireSRWLockShared(&regs_maps_lock);
+    for (int i = 0; i < LITEPCIE_REGS_MAPS_MAX; i++) {
+        if (regs_maps[i].base != NULL && regs_maps[i].fd == fd)
+            mapped = true;
+    }
+    ReleaseSRWLockShared(&regs_maps_lock);
+    return mapped;
+}
 
 uint32_t litepcie_readl(file_t fd, uint32_t addr) {
     struct litepcie_ioctl_reg regData = { 0 };
     DWORD len = 0;
 
+    volatile uint32_t* reg = regs_map_addr(fd, addr, 0);
+    if (reg != NULL)
+        return *reg;
+
     regData.reg = addr;
     regData.is_write = 0;
     checked_ioctl(fd, LITEPCIE_IOCTL_REG,
@@ -102,6 +236,12 @@ void litepcie_writel(file_t fd, uint32_t addr, uint32_t val) {
     struct litepcie_ioctl_reg regData;
     DWORD len = 0;
 
+    volatile uint32_t* reg = regs_map_addr(fd, addr, 1);
+    if (reg != NULL) {
+        *reg = val;
+        return;
+    }
+
     regData.reg = addr;
     regData.val = val;
     regData.is_write = 1;
@@ -110,6 +250,74 @@ void litepcie_writel(file_t fd, uint32_t addr, uint32_t val) {
         NULL, 0, &len, 0);
 }
 
+uint32_t litepcie_reg_batch(file_t fd, struct litepcie_reg_op* ops, uint32_t count) {
+    uint32_t chunk = count < LITEPCIE_REG_BATCH_MAX ? count : LITEPCIE_REG_BATCH_MAX;
+    struct litepcie_ioctl_reg_batch* batch;
+    uint32_t done = 0;
+    DWORD len = 0;
+
+    batch = (struct litepcie_ioctl_reg_batch*)malloc(sizeof(*batch) + (size_t)chunk * sizeof(*ops));
+    if (batch == NULL) {
+        fprintf(stderr, "reg_batch: out of memory\n");
+        abort();
+    }
+
+    /* Run in chunks of LITEPCIE_REG_BATCH_MAX, stopping at a timed out poll. */
+    while (done < count) {
+        uint32_t n = (count - done) < chunk ? (count - done) : chunk;
+        DWORD size = (DWORD)(sizeof(*batch) + (size_t)n * sizeof(*ops));
+
+        batch->count = n;
+        batch->done = 0;
+        memcpy(batch + 1, &ops[done], (size_t)n * sizeof(*ops));
+        checked_ioctl(fd, LITEPCIE_IOCTL_REG_BATCH,
+            batch, size,
+            batch, size, &len, 0);
+        memcpy(&ops[done], batch + 1, (size_t)n * sizeof(*ops));
+        done += batch->done;
+        if (batch->done < n)
+            break;
+    }
+
+    free(batch);
+    return done;
+}
+
+void litepcie_readl_batch(file_t fd, const uint32_t* addrs, uint32_t* vals, uint32_t count) {
+    struct litepcie_reg_op* ops = (struct litepcie_reg_op*)calloc(count, sizeof(*ops));
+    if (ops == NULL) {
+        fprintf(stderr, "readl_batch: out of memory\n");
+        abort();
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ops[i].op = LITEPCIE_REG_OP_READ;
+        ops[i].reg = addrs[i];
+    }
+    litepcie_reg_batch(fd, ops, count);
+    for (uint32_t i = 0; i < count; i++)
+        vals[i] = ops[i].val;
+
+    free(ops);
+}
+
+void litepcie_writel_batch(file_t fd, const uint32_t* addrs, const uint32_t* vals, uint32_t count) {
+    struct litepcie_reg_op* ops = (struct litepcie_reg_op*)calloc(count, sizeof(*ops));
+    if (ops == NULL) {
+        fprintf(stderr, "writel_batch: out of memory\n");
+        abort();
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ops[i].op = LITEPCIE_REG_OP_WRITE;
+        ops[i].reg = addrs[i];
+        ops[i].val = vals[i];
+    }
+    litepcie_reg_batch(fd, ops, count);
+
+    free(ops);
+}
+
 void litepcie_reload(file_t fd) {
     struct litepcie_ioctl_icap m;
     m.addr = 0x4;
@@ -121,6 +329,64 @@ void litepcie_reload(file_t fd) {
         NULL, 0, NULL, 0);
 }
 
+uint32_t litepcie_icap_stream(file_t fd, const struct litepcie_ioctl_icap* writes, uint32_t count, uint64_t* elapsed_us) {
+    uint32_t chunk = count < LITEPCIE_ICAP_STREAM_MAX ? count : LITEPCIE_ICAP_STREAM_MAX;
+    struct litepcie_ioctl_icap_stream* stream;
+    uint32_t done = 0;
+    DWORD len = 0;
+
+    stream = (struct litepcie_ioctl_icap_stream*)malloc(sizeof(*stream) + (size_t)chunk * sizeof(*writes));
+    if (stream == NULL) {
+        fprintf(stderr, "icap_stream: out of memory\n");
+        abort();
+    }
+
+    if (elapsed_us)
+        *elapsed_us = 0;
+
+    /* Run in chunks of LITEPCIE_ICAP_STREAM_MAX, resuming where the driver's
+       time budget cut a chunk short and stopping at a timed out write. */
+    while (done < count) {
+        uint32_t n = (count - done) < chunk ? (count - done) : chunk;
+
+        stream->count = n;
+        stream->timeout = ICAP_TIMEOUT_US;
+        stream->done = 0;
+        stream->timed_out = 0;
+        stream->elapsed_us = 0;
+        memcpy(stream + 1, &writes[done], (size_t)n * sizeof(*writes));
+        checked_ioctl(fd, LITEPCIE_IOCTL_ICAP_STREAM,
+            stream, (DWORD)(sizeof(*stream) + (size_t)n * sizeof(*writes)),
+            stream, sizeof(*stream), &len, 0);
+        done += stream->done;
+        if (elapsed_us)
+            *elapsed_us += stream->elapsed_us;
+        if (stream->timed_out || stream->done == 0)
+            break;
+    }
+
+    free(stream);
+    return done;
+}
+
+void litepcie_get_info(file_t fd, struct litepcie_ioctl_info* info) {
+    DWORD len = 0;
+
+    checked_ioctl(fd, LITEPCIE_IOCTL_INFO,
+        NULL, 0,
+        info, sizeof(struct litepcie_ioctl_info), &len, 0);
+}
+
+void litepcie_stats(file_t fd, struct litepcie_ioctl_stats* stats, uint8_t reset) {
+    DWORD len = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->reset = reset;
+    checked_ioctl(fd, LITEPCIE_IOCTL_STATS,
+        stats, sizeof(struct litepcie_ioctl_stats),
+        stats, sizeof(struct litepcie_ioctl_stats), &len, 0);
+}
+
 void _check_ioctl(bool status, const char* file, int line)
 {
     if (status)
@@ -135,11 +401,22 @@ void _check_ioctl(bool status, const char* file, int line)
 }
 
 file_t litepcie_open(const char* name, int32_t flags)
+{
+    return litepcie_open_device(litepcie_device_index, name, flags);
+}
+
+file_t litepcie_open_device(int index, const char* name, int32_t flags)
 {
     file_t fd;
     /* Open LitePCIe device. */
     WCHAR devName[1024] = { 0 };
-    getDeviceName(devName, 1024);
+    if (getDeviceName(index, devName, 1024))
+    {
+        fprintf(stderr, "Device %d not found\n", index);
+        return INVALID_HANDLE_VALUE;
+    }
+    /* stderr, so parallel opens do not break up a tool's status output */
+    fwprintf(stderr, L"Found device: %s\n", devName);
     UINT32 devLen = lstrlenW(devName);
     mbstowcs(&devName[devLen], name, 1024-devLen);
     fd = CreateFile(devName, (GENERIC_READ | GENERIC_WRITE), 0, NULL,
@@ -149,5 +426,11 @@ file_t litepcie_open(const char* name, int32_t flags)
 
 void litepcie_close(file_t fd)
 {
+    AcquireSRWLockExclusive(&regs_maps_lock);
+    for (int i = 0; i < LITEPCIE_REGS_MAPS_MAX; i++) {
+        if (regs_maps[i].base != NULL && regs_maps[i].fd == fd)
+            regs_maps[i].base = NULL; /* the driver unmaps on close */
+    }
+    ReleaseSRWLockExclusive(&regs_maps_lock);
     CloseHandle(fd);
 }
\ No newline at end of file
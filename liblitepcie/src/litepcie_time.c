@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <ioapiset.h>
+#else
+#include <sys/ioctl.h>
+#include <time.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <litepcie_public.h>
+
+#include "litepcie_time.h"
+#include "litepcie_helpers.h"
+
+#ifdef CSR_TIMER0_BASE
+
+#define TIME_NOMINAL_NS_PER_TICK (1e9 / CONFIG_CLOCK_FREQUENCY)
+#define TIME_WRAP_TICKS          (1ULL << 32)
+
+/* the drift is only fitted once the window has this many samples */
+#define TIME_FIT_MIN_SAMPLES 3
+
+#if defined(_WIN32)
+static int64_t qpc_freq;
+
+int64_t litepcie_time_qpc_ns(int64_t qpc)
+{
+    if (qpc_freq == 0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        qpc_freq = f.QuadPart;
+    }
+    return (qpc / qpc_freq) * 1000000000LL + (qpc % qpc_freq) * 1000000000LL / qpc_freq;
+}
+
+int64_t litepcie_time_host_ns(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return litepcie_time_qpc_ns(now.QuadPart);
+}
+#else
+int64_t litepcie_time_host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#endif
+
+/* Latch and read TIMER0 between two host clock reads. Through the BAR0
+   mapping this is a posted write and a read, which cannot pass it; otherwise
+   both run in a single batch ioctl. */
+static int time_read(file_t fd, uint32_t *raw, int64_t *t0, int64_t *t1)
+{
+    struct {
+        struct litepcie_ioctl_reg_batch batch;
+        struct litepcie_reg_op ops[2];
+    } m;
+    DWORD len = 0;
+
+    if (litepcie_regs_mapped(fd)) {
+        *t0 = litepcie_time_host_ns();
+        litepcie_writel(fd, CSR_TIMER0_UPDATE_VALUE_ADDR, 1);
+        *raw = litepcie_readl(fd, CSR_TIMER0_VALUE_ADDR);
+        *t1 = litepcie_time_host_ns();
+        return 0;
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.batch.count = 2;
+    m.ops[0].op = LITEPCIE_REG_OP_WRITE;
+    m.ops[0].reg = CSR_TIMER0_UPDATE_VALUE_ADDR;
+    m.ops[0].val = 1;
+    m.ops[1].op = LITEPCIE_REG_OP_READ;
+    m.ops[1].reg = CSR_TIMER0_VALUE_ADDR;
+
+    *t0 = litepcie_time_host_ns();
+    if (!DeviceIoControl(fd, LITEPCIE_IOCTL_REG_BATCH,
+        &m, sizeof(m),
+        &m, sizeof(m), &len, 0) || m.batch.done != 2) {
+        fprintf(stderr, "time: TIMER0 read failed: %d\n", GetLastError());
+        return -1;
+    }
+    *t1 = litepcie_time_host_ns();
+    *raw = m.ops[1].val;
+    return 0;
+}
+
+static void time_fit(struct litepcie_time *t)
+{
+    const struct litepcie_time_sample *ref = &t->samples[(t->head + LITEPCIE_TIME_WINDOW - 1) % LITEPCIE_TIME_WINDOW];
+    double sw = 0, xm = 0, ym = 0, sxx = 0, sxy = 0;
+    double slope = TIME_NOMINAL_NS_PER_TICK;
+    double error = 0;
+    uint32_t i;
+
+    /* Weighted least squares around the newest sample, a read that took
+       longer says less about when TIMER0 was latched. */
+    for (i = 0; i < t->count; i++) {
+        const struct litepcie_time_sample *s = &t->samples[i];
+        double w = 1.0 / (((double)s->bracket + 1) * ((double)s->bracket + 1));
+        sw += w;
+        xm += w * (double)(int64_t)(s->dev - ref->dev);
+        ym += w * (double)(s->host - ref->host);
+    }
+    xm /= sw;
+    ym /= sw;
+    for (i = 0; i < t->count; i++) {
+        const struct litepcie_time_sample *s = &t->samples[i];
+        double w = 1.0 / (((double)s->bracket + 1) * ((double)s->bracket + 1));
+        double dx = (double)(int64_t)(s->dev - ref->dev) - xm;
+        double dy = (double)(s->host - ref->host) - ym;
+        sxx += w * dx * dx;
+        sxy += w * dx * dy;
+    }
+    if (t->count >= TIME_FIT_MIN_SAMPLES && sxx > 0)
+        slope = sxy / sxx;
+
+    /* The bound holds over the sampled span: every sample lies within its
+       bracket of the line once the residual is added. */
+    for (i = 0; i < t->count; i++) {
+        const struct litepcie_time_sample *s = &t->samples[i];
+        double x = (double)(int64_t)(s->dev - ref->dev);
+        double r = fabs((double)(s->host - ref->host) - (ym + slope * (x - xm)));
+        if (r + s->bracket > error)
+            error = r + s->bracket;
+    }
+
+    t->dev0 = ref->dev;
+    t->host0 = ref->host + llround(ym - slope * xm);
+    t->ns_per_tick = slope;
+    t->drift_ppm = (slope / TIME_NOMINAL_NS_PER_TICK - 1.0) * 1e6;
+    t->error_ns = error > UINT32_MAX ? UINT32_MAX : (uint32_t)ceil(error);
+}
+
+int litepcie_time_update(struct litepcie_time *t)
+{
+    struct litepcie_time_sample *s = &t->samples[t->head];
+    uint32_t best_raw = 0;
+    int64_t best_t0 = 0, best_t1 = -1;
+    uint32_t up;
+    uint64_t dev;
+
+    for (int i = 0; i < LITEPCIE_TIME_PROBES; i++) {
+        uint32_t raw;
+        int64_t t0, t1;
+        if (time_read(t->fd, &raw, &t0, &t1) < 0)
+            return -1;
+        if (best_t1 < 0 || t1 - t0 < best_t1 - best_t0) {
+            best_raw = raw;
+            best_t0 = t0;
+            best_t1 = t1;
+        }
+    }
+
+    /* TIMER0 counts down, unwrap it as an up count */
+    up = ~best_raw;
+    dev = t->dev_now + (uint32_t)(up - t->last_up);
+    s->host = best_t0 + (best_t1 - best_t0) / 2;
+    s->bracket = (uint32_t)((best_t1 - best_t0 + 1) / 2);
+
+    /* Across a gap of more than one wrap the fit tells how many were missed */
+    if (t->count > 0) {
+        uint64_t expected = litepcie_time_to_device(t, s->host);
+        while (expected > dev && expected - dev > TIME_WRAP_TICKS / 2)
+            dev += TIME_WRAP_TICKS;
+    }
+
+    s->dev = dev;
+    t->dev_now = dev;
+    t->last_up = up;
+    t->bracket_ns = s->bracket;
+    t->head = (t->head + 1) % LITEPCIE_TIME_WINDOW;
+    if (t->count < LITEPCIE_TIME_WINDOW)
+        t->count++;
+
+    time_fit(t);
+    return 0;
+}
+
+int litepcie_time_init(struct litepcie_time *t, file_t fd)
+{
+    uint32_t raw;
+    int64_t t0, t1;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = fd;
+    t->ns_per_tick = TIME_NOMINAL_NS_PER_TICK;
+
+    /* Leave a free running timer alone so several processes can share it,
+       reprogramming restarts the count under the others. */
+    if (litepcie_readl(fd, CSR_TIMER0_EN_ADDR) == 0 ||
+        litepcie_readl(fd, CSR_TIMER0_RELOAD_ADDR) != 0xffffffff) {
+        litepcie_writel(fd, CSR_TIMER0_EN_ADDR, 0);
+        litepcie_writel(fd, CSR_TIMER0_LOAD_ADDR, 0xffffffff);
+        litepcie_writel(fd, CSR_TIMER0_RELOAD_ADDR, 0xffffffff);
+        litepcie_writel(fd, CSR_TIMER0_EN_ADDR, 1);
+    }
+
+    /* ticks count from here */
+    if (time_read(fd, &raw, &t0, &t1) < 0)
+        return -1;
+    t->last_up = ~raw;
+
+    return litepcie_time_update(t);
+}
+
+uint64_t litepcie_time_extend(const struct litepcie_time *t, uint32_t raw)
+{
+    return t->dev_now + (int32_t)(~raw - t->last_up);
+}
+
+int64_t litepcie_time_to_host(const struct litepcie_time *t, uint64_t dev)
+{
+    return t->host0 + llround((double)(int64_t)(dev - t->dev0) * t->ns_per_tick);
+}
+
+uint64_t litepcie_time_to_device(const struct litepcie_time *t, int64_t host)
+{
+    return t->dev0 + (uint64_t)llround((double)(host - t->host0) / t->ns_per_tick);
+}
+
+#endif
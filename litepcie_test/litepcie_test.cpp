@@ -11,6 +11,10 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -20,6 +24,7 @@
 #endif
 
 #include "liblitepcie.h"
+#include "litepcie_copy.h"
 //#include "litepcie_public.h"
 #include <csr.h>
 #include <soc.h>
@@ -54,44 +59,63 @@ static int64_t get_time_ms(void)
     return timeMS;
 }
 
+/* Devices */
+/*---------*/
+static void devices(void)
+{
+    WCHAR path[1024];
+    int i, count;
+
+    count = litepcie_device_count();
+    for (i = 0; i < count; i++) {
+        if (litepcie_device_path(i, path, 1024) == 0)
+            wprintf(L"%d: %s\n", i, path);
+    }
+    printf("%d device(s).\n", count);
+}
+
 /* Info */
 /*------*/
 static void info(void)
 {
     HANDLE fd;
-    int i;
-    unsigned char fpga_identifier[256];
+    struct litepcie_ioctl_info info;
+    uint32_t i;
     fd = litepcie_open("\\CTRL", GENERIC_READ | GENERIC_WRITE);
     if (fd == INVALID_HANDLE_VALUE) {
         fprintf(stderr, "Could not init driver\n");
         exit(1);
     }
 
+    /* Everything in one call, identity is cached by the driver. */
+    litepcie_get_info(fd, &info);
 
     printf("\x1b[1m[> FPGA/SoC Information:\x1b[0m\n");
     printf("------------------------\n");
 
-    for (i = 0; i < 256; i++)
-    {
-        fpga_identifier[i] = litepcie_readl(fd, CSR_IDENTIFIER_MEM_BASE + 4 * i);
+    printf("FPGA Identifier:  %s.\n", info.identifier);
+    if (info.flags & LITEPCIE_INFO_DNA)
+        printf("FPGA DNA:         0x%016" PRIx64 "\n", (uint64_t)info.dna);
+    if (info.flags & LITEPCIE_INFO_XADC) {
+        printf("FPGA Temperature: %0.1f C\n",
+            (double)info.xadc_temperature * 503.975 / 4096 - 273.15);
+        printf("FPGA VCC-INT:     %0.2f V\n", (double)info.xadc_vccint / 4096 * 3);
+        printf("FPGA VCC-AUX:     %0.2f V\n", (double)info.xadc_vccaux / 4096 * 3);
+        printf("FPGA VCC-BRAM:    %0.2f V\n", (double)info.xadc_vccbram / 4096 * 3);
     }
-    printf("FPGA Identifier:  %s.\n", fpga_identifier);
-
-#ifdef CSR_DNA_BASE
-    printf("FPGA DNA:         0x%08x%08x\n",
-        litepcie_readl(fd, CSR_DNA_ID_ADDR + 4 * 0),
-        litepcie_readl(fd, CSR_DNA_ID_ADDR + 4 * 1));
-#endif
-#ifdef CSR_XADC_BASE
-    printf("FPGA Temperature: %0.1f C\n",
-        (double)litepcie_readl(fd, CSR_XADC_TEMPERATURE_ADDR) * 503.975 / 4096 - 273.15);
-    printf("FPGA VCC-INT:     %0.2f V\n",
-        (double)litepcie_readl(fd, CSR_XADC_VCCINT_ADDR) / 4096 * 3);
-    printf("FPGA VCC-AUX:     %0.2f V\n",
-        (double)litepcie_readl(fd, CSR_XADC_VCCAUX_ADDR) / 4096 * 3);
-    printf("FPGA VCC-BRAM:    %0.2f V\n",
-        (double)litepcie_readl(fd, CSR_XADC_VCCBRAM_ADDR) / 4096 * 3);
-#endif
+    if (info.flags & LITEPCIE_INFO_LINK) {
+        printf("PCIe Link:        %s, Gen%u x%u, LTSSM 0x%02x\n",
+            (info.link_status & 0x1) ? "up" : "down",
+            ((info.link_status >> 2) & 0x1) + 1, 1u << ((info.link_status >> 3) & 0x3),
+            (info.link_status >> 5) & 0x3f);
+        printf("PCIe MPS/MRRS:    %u/%u\n", info.max_payload_size, info.max_request_size);
+    }
+    printf("MSI Messages:     %u\n", info.irqs);
+    for (i = 0; i < info.channels && i < LITEPCIE_INFO_CHANNELS_MAX; i++)
+        printf("DMA%u:             %s, writer %ux%u (irq/%u), reader %ux%u (irq/%u)\n", i,
+            info.channel[i].mode == DMA_MODE_DIRECT ? "direct" : "ring",
+            info.channel[i].writer_buf_count, info.channel[i].writer_buf_size, info.channel[i].writer_buf_per_irq,
+            info.channel[i].reader_buf_count, info.channel[i].reader_buf_size, info.channel[i].reader_buf_per_irq);
     litepcie_close(fd);
 }
 /* Scratch */
@@ -217,14 +241,231 @@ static void flash_write(const char* filename, uint32_t offset)
     free(data);
 }
 
-static void flash_read(const char* filename, uint32_t size, uint32_t offset)
+static void flash_update(const char* filename, uint32_t offset)
 {
     file_t fd;
+    uint8_t* data;
+    uint32_t written;
+    int size;
     FILE* f;
+
+    /* Open data source file. */
+    fopen_s(&f, filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+
+    /* Get size, alloc buffer and copy data to it. */
+    fseek(f, 0L, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    data = (uint8_t*)malloc(size);
+    if (!data) {
+        fprintf(stderr, "%d: malloc failed\n", __LINE__);
+        exit(1);
+    }
+    size_t ret = fread(data, size, 1, f);
+    fclose(f);
+    if (ret != 1) {
+        perror(filename);
+        exit(1);
+    }
+
+    /* Open LitePCIe device. */
+    fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Only erase/program the sectors that changed. */
+    printf("Updating (%d bytes at 0x%08x)...\n", size, offset);
+    if (litepcie_flash_update(fd, data, offset, size, flash_progress, NULL, &written)) {
+        printf("Failed after writing %u bytes.\n", written);
+        exit(1);
+    }
+    printf("Success, %u of %d bytes written.\n", written, size);
+
+    /* Free buffer and close LitePCIe device. */
+    free(data);
+    litepcie_close(fd);
+}
+
+/* One board of flash_write_all: progress is kept for the status line. */
+struct flash_job {
+    int index;
+    const uint8_t* data;
     uint32_t base;
-    uint32_t sector_size;
-    uint8_t byte;
-    int i;
+    int size;
+    char status[64];
+    int result;
+    int64_t time_ms;
+};
+
+static std::mutex flash_jobs_lock;
+
+static void flash_job_progress(void* opaque, const char* fmt, ...)
+{
+    struct flash_job* job = (struct flash_job*)opaque;
+    char line[64];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+        return;
+
+    std::lock_guard<std::mutex> lock(flash_jobs_lock);
+    strcpy_s(job->status, sizeof(job->status), line);
+}
+
+static void flash_job_run(struct flash_job* job)
+{
+    file_t fd;
+    uint8_t* buf;
+    uint32_t size;
+    int sector_size;
+    int64_t start = get_time_ms();
+
+    fd = litepcie_open_device(job->index, "\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        flash_job_progress(job, "Could not open device");
+        job->result = 1;
+        return;
+    }
+
+    /* Pad to this board's erase size. */
+    sector_size = litepcie_flash_get_erase_block_size(fd);
+    size = ((job->size + sector_size - 1) / sector_size) * sector_size;
+    buf = (uint8_t*)calloc(1, size);
+    if (!buf) {
+        flash_job_progress(job, "Alloc failed");
+        job->result = 1;
+    } else {
+        memcpy(buf, job->data, job->size);
+        job->result = litepcie_flash_write(fd, buf, job->base, size, flash_job_progress, job);
+        flash_job_progress(job, job->result ? "Failed" : "Done");
+        free(buf);
+    }
+    job->time_ms = get_time_ms() - start;
+    litepcie_close(fd);
+}
+
+static void flash_write_all(const char* filename, uint32_t offset, unsigned workers)
+{
+    std::vector<struct flash_job> jobs;
+    std::vector<std::thread> pool;
+    std::atomic<int> next(0), finished(0);
+    uint8_t* data;
+    int size, count, failed = 0;
+    FILE* f;
+
+    /* Open data source file. */
+    fopen_s(&f, filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+
+    /* Get size, alloc buffer and copy data to it. */
+    fseek(f, 0L, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    data = (uint8_t*)malloc(size);
+    if (!data) {
+        fprintf(stderr, "%d: malloc failed\n", __LINE__);
+        exit(1);
+    }
+    size_t ret = fread(data, size, 1, f);
+    fclose(f);
+    if (ret != 1) {
+        perror(filename);
+        exit(1);
+    }
+
+    count = litepcie_device_count();
+    if (count == 0) {
+        fprintf(stderr, "No Devices Found\n");
+        exit(1);
+    }
+    jobs.resize(count);
+    for (int i = 0; i < count; i++) {
+        jobs[i].index = i;
+        jobs[i].data = data;
+        jobs[i].base = offset;
+        jobs[i].size = size;
+        jobs[i].result = -1;
+        jobs[i].time_ms = 0;
+        strcpy_s(jobs[i].status, sizeof(jobs[i].status), "Waiting");
+    }
+
+    /* Boards are independent, run them on a pool of workers. */
+    if (workers == 0 || workers > (unsigned)count)
+        workers = count;
+    printf("Programming %d bytes at 0x%08x on %d device(s), %u at a time...\n",
+        size, offset, count, workers);
+    for (unsigned w = 0; w < workers; w++) {
+        pool.emplace_back([&]() {
+            int i;
+            while ((i = next++) < count) {
+                flash_job_run(&jobs[i]);
+                finished++;
+            }
+        });
+    }
+
+    /* Status line until every board is done. */
+    while (finished < count) {
+        Sleep(500);
+        std::lock_guard<std::mutex> lock(flash_jobs_lock);
+        for (int i = 0; i < count; i++)
+            printf("[%d] %-22s", i, jobs[i].status);
+        printf("\r");
+        fflush(stdout);
+    }
+    for (auto& t : pool)
+        t.join();
+    printf("\n");
+
+    for (int i = 0; i < count; i++) {
+        printf("Device %d: %s (%.1f s)\n", i, jobs[i].result ? "Failed" : "Success",
+            jobs[i].time_ms / 1000.0);
+        failed += jobs[i].result != 0;
+    }
+    free(data);
+    if (failed)
+        exit(1);
+}
+
+/* Read size bytes of flash in chunks, with progress. */
+static uint8_t* flash_read_all(file_t fd, uint32_t base, uint32_t size)
+{
+    uint8_t* buf;
+    uint32_t i, len;
+
+    buf = (uint8_t*)malloc(size ? size : 1);
+    if (!buf) {
+        fprintf(stderr, "%d: alloc failed\n", __LINE__);
+        exit(1);
+    }
+    for (i = 0; i < size; i += len) {
+        len = (size - i) < LITEPCIE_FLASH_READ_MAX ? (size - i) : LITEPCIE_FLASH_READ_MAX;
+        printf("Reading 0x%08x\r", base + i);
+        fflush(stdout);
+        litepcie_flash_read_buffer(fd, base + i, buf + i, len);
+    }
+    printf("\n");
+    return buf;
+}
+
+static void flash_read(const char* filename, uint32_t size, uint32_t offset)
+{
+    file_t fd;
+    FILE* f;
+    uint8_t* buf;
 
     /* Open data destination file. */
     fopen_s(&f, filename, "wb");
@@ -240,23 +481,123 @@ static void flash_read(const char* filename, uint32_t size, uint32_t offset)
         exit(1);
     }
 
-    /* Get flash sector size. */
-    sector_size = litepcie_flash_get_erase_block_size(fd);
+    /* Read flash and write to destination file in one go. */
+    buf = flash_read_all(fd, offset, size);
+    if (fwrite(buf, 1, size, f) != size)
+        perror(filename);
+
+    /* Close destination file and LitePCIe device. */
+    free(buf);
+    fclose(f);
+    litepcie_close(fd);
+}
+
+static void flash_verify(const char* filename, uint32_t offset)
+{
+    file_t fd;
+    FILE* f;
+    uint8_t *data, *buf;
+    uint32_t size, i;
+
+    /* Load data from file. */
+    fopen_s(&f, filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0L, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    data = (uint8_t*)malloc(size ? size : 1);
+    if (!data) {
+        fprintf(stderr, "%d: alloc failed\n", __LINE__);
+        exit(1);
+    }
+    if (fread(data, 1, size, f) != size) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
 
-    /* Read flash and write to destination file. */
-    base = offset;
-    for (i = 0; i < size; i++) {
-        if ((i % sector_size) == 0) {
-            printf("Reading 0x%08x\r", base + i);
-            fflush(stdout);
+    /* Open LitePCIe device. */
+    fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Read back and compare. */
+    buf = flash_read_all(fd, offset, size);
+    for (i = 0; i < size && buf[i] == data[i]; i++);
+    if (i == size)
+        printf("Verified %u bytes at 0x%08x.\n", size, offset);
+    else
+        printf("Mismatch at 0x%08x: flash %02x, file %02x.\n", offset + i, buf[i], data[i]);
+
+    free(buf);
+    free(data);
+    litepcie_close(fd);
+    if (i != size)
+        exit(1);
+}
+
+static void flash_hash(uint32_t size, uint32_t offset)
+{
+    file_t fd;
+    struct litepcie_flash_info info;
+    uint64_t hash;
+
+    /* Open LitePCIe device. */
+    fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Default to the rest of the device. */
+    if (size == 0) {
+        litepcie_flash_get_info(fd, &info);
+        if (info.size <= offset) {
+            fprintf(stderr, "Flash size unknown, give a size.\n");
+            exit(1);
         }
-        byte = litepcie_flash_read(fd, base + i);
-        fwrite(&byte, 1, 1, f);
+        size = info.size - offset;
     }
 
-    /* Close destination file and LitePCIe device. */
-    fclose(f);
-    CloseHandle(fd);
+    if (litepcie_flash_hash(fd, offset, size, &hash, flash_progress, NULL))
+        exit(1);
+    printf("FNV-1a 64 of %u bytes at 0x%08x: %016llx\n", size, offset, (unsigned long long)hash);
+
+    litepcie_close(fd);
+}
+
+static void flash_info(void)
+{
+    file_t fd;
+    struct litepcie_flash_info info;
+    int i;
+
+    /* Open LitePCIe device. */
+    fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Read flash ID and SFDP geometry. */
+    litepcie_flash_get_info(fd, &info);
+    printf("JEDEC ID:     %06x\n", info.id);
+    printf("Geometry:     %s\n", info.sfdp ? "SFDP" : "defaults (no SFDP)");
+    if (info.size)
+        printf("Size:         %u bytes\n", info.size);
+    printf("Page:         %u bytes, %u us\n", info.page_size, info.page_program_us);
+    for (i = 0; i < FLASH_ERASE_TYPES && info.erase[i].size; i++)
+        printf("Erase:        %u bytes, cmd 0x%02x, %u us\n",
+            info.erase[i].size, info.erase[i].cmd, info.erase[i].time_us);
+    if (info.size)
+        printf("Chip erase:   cmd 0x%02x, %u us\n", info.chip_erase_cmd, info.chip_erase_us);
+
+    litepcie_close(fd);
 }
 
 static void flash_reload(void)
@@ -328,7 +669,7 @@ static uint32_t get_data_mask(int data_width)
     return mask;
 }
 
-static void write_pn_data(uint32_t* buf, int count, uint32_t* pseed, int data_width)
+static void write_pn_data(uint32_t* buf, int count, uint32_t* pseed, uint32_t period, int data_width)
 {
     int i;
     uint32_t seed;
@@ -337,12 +678,12 @@ static void write_pn_data(uint32_t* buf, int count, uint32_t* pseed, int data_wi
     seed = *pseed;
     for (i = 0; i < count; i++) {
         buf[i] = (seed_to_data(seed) & mask);
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, period);
     }
     *pseed = seed;
 }
 
-static int check_pn_data(const uint32_t* buf, int count, uint32_t* pseed, int data_width)
+static int check_pn_data(const uint32_t* buf, int count, uint32_t* pseed, uint32_t period, int data_width)
 {
     int i, errors;
     uint32_t seed;
@@ -354,17 +695,23 @@ static int check_pn_data(const uint32_t* buf, int count, uint32_t* pseed, int da
         if (buf[i] != (seed_to_data(seed) & mask)) {
             errors++;
         }
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, period);
     }
     *pseed = seed;
     return errors;
 }
 #endif
 
-static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay)
+static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay,
+    unsigned queue_depth, unsigned buf_size, unsigned buf_count, unsigned buf_per_irq)
 {
     static struct litepcie_dma_ctrl dma = { .use_reader = 1, .use_writer = 1 };
     dma.loopback = external_loopback ? 0 : 1;
+    dma.queue_depth = queue_depth;
+    /* same geometry in both directions so the loopback data lines up */
+    dma.dma_config.writer_buf_size = dma.dma_config.reader_buf_size = buf_size;
+    dma.dma_config.writer_buf_count = dma.dma_config.reader_buf_count = buf_count;
+    dma.dma_config.writer_buf_per_irq = dma.dma_config.reader_buf_per_irq = buf_per_irq;
 
     if (data_width > 32 || data_width < 1) {
         fprintf(stderr, "Invalid data width %d\n", data_width);
@@ -378,6 +725,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
     int64_t writer_hw_count_last = 0;
     int64_t last_time;
     uint32_t errors = 0;
+    int64_t rx_latency_total = 0, rx_latency_max = 0, rx_latency_count = 0;
 
 #ifdef DMA_CHECK_DATA
     uint32_t seed_wr = 0;
@@ -395,7 +743,18 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
     if (litepcie_dma_init(&dma, "\\DMA0", zero_copy))
         exit(1);
 
+    printf("Ring: %u x %u bytes, IRQ every %u buffers\n", dma.buf_rd_count, dma.buf_rd_size, dma.buf_rd_per_irq);
+    if (!zero_copy)
+        printf("Queue depth: %u x %u buffers\n", dma.queue_depth, dma.rd_slot_buffers);
+
+    /* Measure the driver's DPC and copy time over this run only. */
+    struct litepcie_ioctl_stats stats;
+    litepcie_stats(dma.dma_fd, &stats, 1);
+
 #ifdef DMA_CHECK_DATA
+    /* The pattern repeats every RX buffer, so RX_DELAY is searched within one. */
+    uint32_t pn_period = dma.buf_rd_size / sizeof(uint32_t);
+
     /* DMA-TX Write. */
     while (1) {
         char* buf_wr;
@@ -405,7 +764,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
         if (!buf_wr)
             break;
         /* Write data to buffer. */
-        write_pn_data((uint32_t*)buf_wr, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_wr, data_width);
+        write_pn_data((uint32_t*)buf_wr, dma.buf_wr_size / sizeof(uint32_t), &seed_wr, pn_period, data_width);
     }
 #endif
 
@@ -429,38 +788,48 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
             if (!buf_wr)
                 break;
             /* Write data to buffer. */
-            write_pn_data((uint32_t*)buf_wr, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_wr, data_width);
+            write_pn_data((uint32_t*)buf_wr, dma.buf_wr_size / sizeof(uint32_t), &seed_wr, pn_period, data_width);
         }
 
         /* DMA-RX Read/Check */
         while (1) {
             char* buf_rd;
+            int64_t ts;
+            LARGE_INTEGER now;
             /* Get Read buffer. */
-            buf_rd = litepcie_dma_next_read_buffer(&dma);
+            buf_rd = litepcie_dma_next_read_buffer_ts(&dma, &ts);
             /* Break when no buffer available for Read. */
             if (!buf_rd)
                 break;
+            /* Time from completion to consumption (zero-copy only). */
+            QueryPerformanceCounter(&now);
+            if (ts != 0 && now.QuadPart > ts) {
+                rx_latency_total += now.QuadPart - ts;
+                if (now.QuadPart - ts > rx_latency_max)
+                    rx_latency_max = now.QuadPart - ts;
+                rx_latency_count++;
+            }
             /* Skip the first 128 DMA loops. */
-            if (dma.writer_hw_count < 128 * DMA_BUFFER_COUNT)
+            if (dma.writer_hw_count < 128 * dma.buf_rd_count)
                 break;
             /* When running... */
             if (run) {
                 /* Check data in Read buffer. */
-                errors += check_pn_data((uint32_t*)buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                errors += check_pn_data((uint32_t*)buf_rd, dma.buf_rd_size / sizeof(uint32_t), &seed_rd, pn_period, data_width);
                 /* Clear Read buffer */
-                memset(buf_rd, 0, DMA_BUFFER_SIZE);
+                memset(buf_rd, 0, dma.buf_rd_size);
             }
             else {
                 /* Find initial Delay/Seed (Useful when loopback is introducing delay). */
                 uint32_t errors_min = 0xffffffff;
-                for (int delay = 0; delay < DMA_BUFFER_SIZE / sizeof(uint32_t); delay++) {
+                for (uint32_t delay = 0; delay < pn_period; delay++) {
                     seed_rd = delay;
-                    errors = check_pn_data((uint32_t*)buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                    errors = check_pn_data((uint32_t*)buf_rd, dma.buf_rd_size / sizeof(uint32_t), &seed_rd, pn_period, data_width);
                     //printf("delay: %d / errors: %d\n", delay, errors);
                     if (errors < errors_min)
                         errors_min = errors;
-                    if (errors < (DMA_BUFFER_SIZE / sizeof(uint32_t)) / 2) {
-                        printf("RX_DELAY: %d (errors: %d)\n", delay, errors);
+                    if (errors < (dma.buf_rd_size / sizeof(uint32_t)) / 2) {
+                        printf("RX_DELAY: %u (errors: %d)\n", delay, errors);
                         run = 1;
                         break;
                     }
@@ -468,7 +837,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
                 if (!run) {
                     printf("Unable to find DMA RX_DELAY (min errors: %d/%lld), exiting.\n",
                         errors_min,
-                        DMA_BUFFER_SIZE / sizeof(uint32_t));
+                        dma.buf_rd_size / sizeof(uint32_t));
                     goto end;
                 }
             }
@@ -481,15 +850,23 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
         if (run && (duration > 200)) {
             /* Print banner every 10 lines. */
             if (i % 10 == 0)
-                printf("\x1b[1mDMA_SPEED(Gbps)\tTX_BUFFERS\tRX_BUFFERS\tDIFF\tERRORS\x1b[0m\n");
+                printf("\x1b[1mDMA_SPEED(Gbps)\tTX_BUFFERS\tRX_BUFFERS\tDIFF\tERRORS\tRX_LAT_AVG/MAX(us)\x1b[0m\n");
             i++;
             /* Print statistics. */
-            printf("%14.2f\t%10" PRIu64 "\t%10" PRIu64 "\t%4" PRIi64 "\t%6u\n",
-                (double)(dma.reader_sw_count - reader_sw_count_last) * DMA_BUFFER_SIZE * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
+            double lat_us = stats.qpc_frequency ? 1e6 / (double)stats.qpc_frequency : 0.0;
+            printf("%14.2f\t%10" PRIu64 "\t%10" PRIu64 "\t%4" PRIi64 "\t%6u\t",
+                (double)(dma.reader_sw_count - reader_sw_count_last) * dma.buf_wr_size * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
                 dma.reader_sw_count,
                 dma.writer_sw_count,
                 dma.reader_sw_count - dma.writer_sw_count,
                 errors);
+            /* Copy mode has no driver stamps, see litepcie_dma_next_read_buffer_ts. */
+            if (zero_copy)
+                printf("%8.1f/%.1f\n",
+                    rx_latency_count ? rx_latency_total * lat_us / rx_latency_count : 0.0,
+                    rx_latency_max * lat_us);
+            else
+                printf("%8s\n", "-");
 //            printf("\t\t%10.2f\t%10.2f\n",
 //                (double)(dma.reader_hw_count - reader_hw_count_last) * DMA_BUFFER_SIZE * 8 / ((double)duration * 1e6),
 //                (double)(dma.writer_hw_count - writer_hw_count_last) * DMA_BUFFER_SIZE * 8 / ((double)duration * 1e6));
@@ -498,6 +875,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
 //                (dma.writer_hw_count - dma.writer_sw_count));
             /* Update errors/time/count. */
             errors = 0;
+            rx_latency_total = rx_latency_max = rx_latency_count = 0;
             last_time = get_time_ms();
             reader_sw_count_last = dma.reader_sw_count;
             reader_hw_count_last = dma.reader_hw_count;
@@ -510,10 +888,167 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
 #ifdef DMA_CHECK_DATA
     end :
 #endif
+    litepcie_stats(dma.dma_fd, &stats, 0);
+    if (stats.qpc_frequency != 0) {
+        double us = 1e6 / (double)stats.qpc_frequency;
+        printf("DPC:  %" PRIu64 " runs, avg %.2f us, max %.2f us\n", stats.dpc_count,
+            stats.dpc_count ? stats.dpc_ticks_total * us / stats.dpc_count : 0.0, stats.dpc_ticks_max * us);
+        printf("Copy: %" PRIu64 " runs, avg %.2f us, max %.2f us\n", stats.copy_count,
+            stats.copy_count ? stats.copy_ticks_total * us / stats.copy_count : 0.0, stats.copy_ticks_max * us);
+        if (stats.channels > 0)
+            printf("Mode: %.0f us MSI, %.0f us polling (%" PRIu64 " switches, %" PRIu64 " polls)\n",
+                stats.chan[0].irq_ticks * us, stats.chan[0].poll_ticks * us,
+                stats.chan[0].poll_entries, stats.chan[0].polls);
+    }
     litepcie_dma_cleanup(&dma);
 }
+
+static void dma_irq(unsigned writer_per_irq, unsigned reader_per_irq)
+{
+    struct litepcie_ioctl_dma_irq_interval m;
+    file_t fd;
+
+    fd = litepcie_open("\\DMA0", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* applies to a running ring too, 0 only reports the current value */
+    memset(&m, 0, sizeof(m));
+    m.writer_buf_per_irq = writer_per_irq;
+    m.reader_buf_per_irq = reader_per_irq;
+    if (litepcie_dma_irq_interval(fd, &m) == 0) {
+        printf("DMA0 IRQ every %u buffers (writer), %u buffers (reader)\n",
+            m.writer_buf_per_irq, m.reader_buf_per_irq);
+        if (m.restarted)
+            printf("Running %s%s%s restarted, the buffer in flight was cut\n",
+                m.restarted & DMA_RESTARTED_WRITER ? "writer" : "",
+                m.restarted == (DMA_RESTARTED_WRITER | DMA_RESTARTED_READER) ? " and " : "",
+                m.restarted & DMA_RESTARTED_READER ? "reader" : "");
+    }
+
+    litepcie_close(fd);
+}
+
+static void dma_poll(unsigned mode, unsigned period_us, unsigned enter_buffers, unsigned exit_buffers)
+{
+    struct litepcie_ioctl_dma_poll m;
+    file_t fd;
+
+    fd = litepcie_open("\\DMA0", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    m.mode = mode;
+    m.period_us = period_us;
+    m.enter_buffers = enter_buffers;
+    m.exit_buffers = exit_buffers;
+    if (litepcie_dma_poll(fd, &m) == 0)
+        printf("DMA0 %s, poll every %u us, enter at %u buffers, exit below %u\n",
+            m.mode == DMA_POLL_ADAPTIVE ? "adaptive" : "MSI only",
+            m.period_us, m.enter_buffers, m.exit_buffers);
+
+    litepcie_close(fd);
+}
 #endif
 
+#ifdef CSR_TIMER0_BASE
+/* TIMER0 / host clock correlation */
+/*----------------------------------*/
+
+static void timesync(unsigned seconds)
+{
+    struct litepcie_time t;
+    int64_t origin;
+    file_t fd;
+
+    fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Mapped reads bracket TIMER0 much tighter than ioctls. */
+    if (litepcie_mmap_regs(fd, 0))
+        printf("Reading TIMER0 through ioctls.\n");
+
+    if (litepcie_time_init(&t, fd)) {
+        litepcie_close(fd);
+        exit(1);
+    }
+    origin = litepcie_time_to_host(&t, 0);
+
+    for (unsigned i = 1; i <= seconds; i++) {
+        Sleep(1000);
+        if (litepcie_time_update(&t))
+            break;
+        printf("%4u s: samples %2u, bracket %5u ns, drift %+9.3f ppm, origin %+8" PRId64 " ns, error %6u ns\n",
+            i, t.count, t.bracket_ns, t.drift_ppm,
+            litepcie_time_to_host(&t, 0) - origin, t.error_ns);
+    }
+
+    litepcie_munmap_regs(fd);
+    litepcie_close(fd);
+}
+#endif
+
+/* Copy benchmark */
+/*----------------*/
+
+static int64_t get_time_us(void)
+{
+    struct timespec timeNow;
+    timespec_get(&timeNow, TIME_UTC);
+
+    return (timeNow.tv_sec * 1000000) + (timeNow.tv_nsec / 1000);
+}
+
+static void copy_bench(size_t max_size, unsigned iterations)
+{
+    /* Destination offset by 8 bytes, as an arbitrary user buffer would be. */
+    char* src = (char*)malloc(max_size);
+    char* dst = (char*)malloc(max_size + 64);
+    if (!src || !dst) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", max_size);
+        exit(1);
+    }
+    for (size_t i = 0; i < max_size; i++)
+        src[i] = (char)(i * 7);
+
+    printf("\x1b[1m[> Copy benchmark (%u iterations):\x1b[0m\n", iterations);
+    printf("---------------------------------\n");
+    printf("\x1b[1m%10s\t%12s\t%12s\x1b[0m\n", "SIZE", "MEMCPY(GB/s)", "RING(GB/s)");
+    for (size_t size = DMA_BUFFER_SIZE; size <= max_size; size *= 2) {
+        int64_t start;
+        double memcpy_us, ring_us;
+
+        start = get_time_us();
+        for (unsigned i = 0; i < iterations; i++)
+            memcpy(dst + 8, src, size);
+        memcpy_us = (double)(get_time_us() - start);
+
+        memset(dst, 0, max_size + 64);
+        start = get_time_us();
+        for (unsigned i = 0; i < iterations; i++)
+            litepcie_copy(dst + 8, src, size);
+        ring_us = (double)(get_time_us() - start);
+
+        if (memcmp(dst + 8, src, size) != 0) {
+            fprintf(stderr, "litepcie_copy mismatch at size %zu\n", size);
+            exit(1);
+        }
+        printf("%10zu\t%12.2f\t%12.2f\n", size,
+            memcpy_us > 0 ? (double)size * iterations / (memcpy_us * 1e3) : 0.0,
+            ring_us > 0 ? (double)size * iterations / (ring_us * 1e3) : 0.0);
+    }
+
+    free(src);
+    free(dst);
+}
+
 /* Help */
 /*------*/
 
@@ -531,14 +1066,31 @@ static void help(void)
         "-a                                Automatic DMA RX-Delay calibration.\n"
         "\n"
         "available commands:\n"
+        "devices                           List LitePCIe devices.\n"
         "info                              Get Board information.\n"
         "\n"
-        "dma_test                          Test DMA.\n"
+        "dma_test [queue_depth [buf_size buf_count buf_per_irq]]\n"
+        "                                  Test DMA (0 = driver default).\n"
+        "dma_irq [writer_per_irq [reader_per_irq]]\n"
+        "                                  Set DMA0 interrupt coalescing (0 = keep).\n"
+        "dma_poll [mode [period_us enter exit]]\n"
+        "                                  Set DMA0 progress mode, 1 = MSI, 2 = adaptive (0 = keep).\n"
         "scratch_test                      Test Scratch register.\n"
+        "copy_bench [max_size [iterations]]\n"
+        "                                  Benchmark the ring copy routine (no device needed).\n"
+#ifdef CSR_TIMER0_BASE
+        "timesync [seconds]                Correlate TIMER0 with the host clock (default = 10).\n"
+#endif
         "\n"
 #ifdef CSR_FLASH_BASE
         "flash_write filename [offset]     Write file contents to SPI Flash.\n"
+        "flash_update filename [offset]    Write only the changed sectors of file to SPI Flash.\n"
+        "flash_write_all filename [offset [jobs]]\n"
+        "                                  Write file to the SPI Flash of every device in parallel.\n"
         "flash_read filename size [offset] Read from SPI Flash and write contents to file.\n"
+        "flash_verify filename [offset]    Compare SPI Flash contents with file.\n"
+        "flash_hash [size [offset]]        Hash SPI Flash contents (whole device by default).\n"
+        "flash_info                        Show SPI Flash ID, geometry and timings.\n"
         "flash_reload                      Reload FPGA Image.\n"
 #endif
     );
@@ -597,16 +1149,42 @@ int main(int argc, char** argv)
         help();
 
     /* Select device. */
-    //getDeviceName(litepcie_device, 1024);
+    if (argIdx + 1 < argc && !strcmp(argv[argIdx], "-c")) {
+        litepcie_device_num = atoi(argv[argIdx + 1]);
+        argIdx += 2;
+    }
+    if (argIdx >= argc)
+        help();
+    litepcie_select_device(litepcie_device_num);
 
-    cmd = argv[argIdx];
+    cmd = argv[argIdx++];
 
     /* Info cmds. */
-    if (!strcmp(cmd, "info"))
+    if (!strcmp(cmd, "devices"))
+        devices();
+    else if (!strcmp(cmd, "info"))
         info();
     /* Scratch cmds. */
     else if (!strcmp(cmd, "scratch_test"))
         scratch_test();
+    /* Copy benchmark. */
+    else if (!strcmp(cmd, "copy_bench")) {
+        size_t max_size = (size_t)DMA_BUFFER_SIZE * DMA_BUFFER_COUNT_MAX;
+        unsigned iterations = 1000;
+        if (argIdx < argc)
+            max_size = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx < argc)
+            iterations = strtoul(argv[argIdx++], NULL, 0);
+        copy_bench(max_size, iterations);
+    }
+#ifdef CSR_TIMER0_BASE
+    else if (!strcmp(cmd, "timesync")) {
+        unsigned seconds = 10;
+        if (argIdx < argc)
+            seconds = strtoul(argv[argIdx++], NULL, 0);
+        timesync(seconds);
+    }
+#endif
     /* SPI Flash cmds. */
 #ifdef FLASH_EN
 #if CSR_FLASH_BASE
@@ -620,6 +1198,29 @@ int main(int argc, char** argv)
             offset = strtoul(argv[argIdx++], NULL, 0);
         flash_write(filename, offset);
     }
+    else if (!strcmp(cmd, "flash_update")) {
+        const char* filename;
+        uint32_t offset = 0;
+        if (argIdx + 1 > argc)
+            goto show_help;
+        filename = argv[argIdx++];
+        if (argIdx < argc)
+            offset = strtoul(argv[argIdx++], NULL, 0);
+        flash_update(filename, offset);
+    }
+    else if (!strcmp(cmd, "flash_write_all")) {
+        const char* filename;
+        uint32_t offset = 0;
+        unsigned jobs = 0;
+        if (argIdx + 1 > argc)
+            goto show_help;
+        filename = argv[argIdx++];
+        if (argIdx < argc)
+            offset = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx < argc)
+            jobs = strtoul(argv[argIdx++], NULL, 0);
+        flash_write_all(filename, offset, jobs);
+    }
     else if (!strcmp(cmd, "flash_read")) {
         const char* filename;
         uint32_t size = 0;
@@ -632,18 +1233,72 @@ int main(int argc, char** argv)
             offset = strtoul(argv[argIdx++], NULL, 0);
         flash_read(filename, size, offset);
     }
+    else if (!strcmp(cmd, "flash_verify")) {
+        const char* filename;
+        uint32_t offset = 0;
+        if (argIdx + 1 > argc)
+            goto show_help;
+        filename = argv[argIdx++];
+        if (argIdx < argc)
+            offset = strtoul(argv[argIdx++], NULL, 0);
+        flash_verify(filename, offset);
+    }
+    else if (!strcmp(cmd, "flash_hash")) {
+        uint32_t size = 0;
+        uint32_t offset = 0;
+        if (argIdx < argc)
+            size = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx < argc)
+            offset = strtoul(argv[argIdx++], NULL, 0);
+        flash_hash(size, offset);
+    }
+    else if (!strcmp(cmd, "flash_info"))
+        flash_info();
     else if (!strcmp(cmd, "flash_reload"))
         flash_reload();
 #endif
 #endif
 #ifdef DMA_EN
     /* DMA cmds. */
-    else if (!strcmp(cmd, "dma_test"))
+    else if (!strcmp(cmd, "dma_test")) {
+        unsigned queue_depth = 0;
+        unsigned buf_size = 0, buf_count = 0, buf_per_irq = 0;
+        if (argIdx < argc)
+            queue_depth = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx + 3 <= argc) {
+            buf_size = strtoul(argv[argIdx++], NULL, 0);
+            buf_count = strtoul(argv[argIdx++], NULL, 0);
+            buf_per_irq = strtoul(argv[argIdx++], NULL, 0);
+        }
         dma_test(
             litepcie_device_zero_copy,
             litepcie_device_external_loopback,
             litepcie_data_width,
-            litepcie_auto_rx_delay);
+            litepcie_auto_rx_delay,
+            queue_depth,
+            buf_size,
+            buf_count,
+            buf_per_irq);
+    }
+    else if (!strcmp(cmd, "dma_irq")) {
+        unsigned writer_per_irq = 0, reader_per_irq = 0;
+        if (argIdx < argc)
+            writer_per_irq = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx < argc)
+            reader_per_irq = strtoul(argv[argIdx++], NULL, 0);
+        dma_irq(writer_per_irq, reader_per_irq);
+    }
+    else if (!strcmp(cmd, "dma_poll")) {
+        unsigned mode = 0, period_us = 0, enter_buffers = 0, exit_buffers = 0;
+        if (argIdx < argc)
+            mode = strtoul(argv[argIdx++], NULL, 0);
+        if (argIdx + 3 <= argc) {
+            period_us = strtoul(argv[argIdx++], NULL, 0);
+            enter_buffers = strtoul(argv[argIdx++], NULL, 0);
+            exit_buffers = strtoul(argv[argIdx++], NULL, 0);
+        }
+        dma_poll(mode, period_us, enter_buffers, exit_buffers);
+    }
 #endif
     /* Show help otherwise. */
     else
@@ -12,39 +12,100 @@
 #include "litepcie_public.h"
 
 #include "litepcie_dmadrv.h"
+#include "litepcie_copy.h"
 #include "csr.h"
 
 
 EXTERN_C_START
 
+/* Direct mode: largest transfer the descriptor table can describe, one page per entry */
+#define DMA_DIRECT_MAX_LENGTH ((DMA_BUFFER_COUNT_MAX - 1) * PAGE_SIZE)
+
+/* Shared counter pages: read-only status followed by the user doorbell */
+#define DMA_SHM_STATUS_SIZE   ROUND_TO_PAGES(sizeof(struct litepcie_dma_shm_status))
+#define DMA_SHM_DOORBELL_SIZE ROUND_TO_PAGES(sizeof(struct litepcie_dma_shm_doorbell))
+
 struct litepcie_dma_chan {
     UINT32 base;
     UINT32 reader_interrupt;
     UINT32 writer_interrupt;
-    WDFSPINLOCK readerLock;
-    WDFSPINLOCK writerLock;
-    WDFREQUEST readRequest;
-    SIZE_T readRemainingBytes;
-    WDFREQUEST writeRequest;
-    SIZE_T writeRemainingBytes;
+    WDFQUEUE readQueue;  /* deferred ReadFile (C2H) requests, completed in order */
+    WDFQUEUE writeQueue; /* deferred WriteFile (H2C) requests, completed in order */
+    WDFSPINLOCK readQueueLock;
+    WDFSPINLOCK writeQueueLock;
+    WDFSPINLOCK foldLock; /* one fold, stamp and publish of the hw_counts at a time */
     WDFCOMMONBUFFER readBuffer;
     WDFCOMMONBUFFER writeBuffer;
-    PVOID reader_handle[DMA_BUFFER_COUNT];
-    PVOID writer_handle[DMA_BUFFER_COUNT];
-    PHYSICAL_ADDRESS reader_addr[DMA_BUFFER_COUNT];
-    PHYSICAL_ADDRESS writer_addr[DMA_BUFFER_COUNT];
-    volatile INT64 reader_hw_count;
-    volatile INT64 reader_hw_count_last;
-    INT64 reader_sw_count;
-    volatile INT64 writer_hw_count;
-    volatile INT64 writer_hw_count_last;
-    INT64 writer_sw_count;
-    UINT8 writer_enable;
+    WDFCOMMONBUFFER shmBuffer;
+    struct litepcie_dma_shm_status* shm_status;
+    struct litepcie_dma_shm_doorbell* shm_doorbell;
+    PVOID reader_handle[DMA_BUFFER_COUNT_MAX];
+    PVOID writer_handle[DMA_BUFFER_COUNT_MAX];
+    PHYSICAL_ADDRESS reader_addr[DMA_BUFFER_COUNT_MAX];
+    PHYSICAL_ADDRESS writer_addr[DMA_BUFFER_COUNT_MAX];
+    UINT32 reader_buf_size;
+    UINT32 reader_buf_count;
+    UINT32 reader_buf_per_irq;
+    UINT32 writer_buf_size;
+    UINT32 writer_buf_count;
+    UINT32 writer_buf_per_irq;
+    volatile LONG map_count; /* user mappings of the ring buffers */
+    volatile LONG doorbell_count; /* user mappings of the doorbell page, sw_counts follow it */
+    UINT32 mode; /* DMA_MODE_RING or DMA_MODE_DIRECT */
+    WDFDMATRANSACTION readTransaction;  /* direct mode C2H transfer */
+    WDFDMATRANSACTION writeTransaction; /* direct mode H2C transfer */
+    WDFREQUEST readActive;  /* request owning readTransaction, under readQueueLock */
+    WDFREQUEST writeActive; /* request owning writeTransaction, under writeQueueLock */
+    /* Hot path counters, lock free. Each sits on its own cache line so the
+       DPC (hw_count) and the consumer (sw_count) never share one. */
+    INT64 reader_hw_base; /* hw_count at the head of the loaded table */
+    INT64 writer_hw_base;
+    DECLSPEC_CACHEALIGN volatile INT64 reader_hw_count; /* written by the DPC */
+    DECLSPEC_CACHEALIGN volatile INT64 reader_sw_count; /* written by WriteFile */
+    DECLSPEC_CACHEALIGN volatile INT64 writer_hw_count; /* written by the DPC */
+    DECLSPEC_CACHEALIGN volatile INT64 writer_sw_count; /* written by ReadFile */
+    DECLSPEC_CACHEALIGN UINT8 writer_enable;
     UINT8 reader_enable;
     UINT8 reader_lock;
     UINT8 writer_lock; 
+    /* Progress reporting, DMA_POLL_* */
+    WDFTIMER pollTimer; /* polls LOOP_STATUS while the MSIs are masked */
+    UINT32 poll_mode;
+    UINT32 poll_period_us;
+    UINT32 poll_enter;
+    UINT32 poll_exit;
+    volatile LONG poll_active; /* MSIs masked, pollTimer running */
+    volatile LONG poll_stop;   /* pollTimer must not re-arm */
+    INT64 poll_last_count;     /* writer + reader hw_count at the last rate check */
+    LONG64 poll_last_time;
+    volatile LONG64 mode_since; /* QPC ticks of the last switch */
+    volatile LONG64 irq_ticks;
+    volatile LONG64 poll_ticks;
+    volatile LONG64 poll_entries;
+    volatile LONG64 polls;
 };
 
+/* MSI messages the driver can service, one interrupt object each */
+#define LITEPCIE_IRQ_MAX 32
+
+//
+// Per interrupt object: irq sources (bit % irqs) serviced by its DPC
+//
+typedef struct _INTERRUPT_CONTEXT
+{
+    UINT32 message;        /* MSI message number */
+    UINT32 mask;           /* irq sources owned by this interrupt */
+    volatile LONG pending; /* sources signaled by the ISR, consumed by the DPC */
+} INTERRUPT_CONTEXT, *PINTERRUPT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(INTERRUPT_CONTEXT, InterruptGetContext)
+
+typedef struct litepcie_user_map {
+    PMDL mdl;
+    PVOID userAddr;
+    PEPROCESS process; /* owner of userAddr, referenced while mapped */
+} LITEPCIE_USER_MAP, *PLITEPCIE_USER_MAP;
+
 typedef struct litepcie_chan {
     struct _DEVICE_CONTEXT* litepcie_dev;
     struct litepcie_dma_chan dma;
@@ -52,6 +113,44 @@ typedef struct litepcie_chan {
     UINT32 index;
 }LITEPCIE_CHAN, *PLITEPCIE_CHAN;
 
+//
+// Poll timer of a channel
+//
+typedef struct _POLL_TIMER_CONTEXT
+{
+    PLITEPCIE_CHAN channel;
+} POLL_TIMER_CONTEXT, *PPOLL_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(POLL_TIMER_CONTEXT, PollTimerGetContext)
+
+/* Flash engine: SPI work done per timer tick, and the tick period. The
+   slice spins at DISPATCH_LEVEL, so it stays a few SPI transfers long and
+   longer waits (erase, program) pass between ticks. */
+#define LITEPCIE_FLASH_SLICE_US 20
+#define LITEPCIE_FLASH_TICK_US  250
+
+//
+// Flash request at the head of flashQueue, run as a sequence of SPI transfers
+//
+typedef struct _LITEPCIE_FLASH_XFER
+{
+    WDFREQUEST request;
+    ULONG code;                     /* LITEPCIE_IOCTL_FLASH, _FLASH_PROGRAM or _FLASH_READ */
+    UINT32 step;                    /* SPI transfer in flight or next to start */
+    UINT32 steps;
+    BOOLEAN started;                /* transfer at step was started */
+    LONGLONG deadline;              /* QPC ticks, SPI_TIMEOUT after the start */
+    UINT32 tx_len;                  /* LITEPCIE_IOCTL_FLASH: the raw transfer */
+    UINT64 tx_data;
+    struct litepcie_ioctl_flash* spi; /* LITEPCIE_IOCTL_FLASH result */
+    UINT8 cmd;                      /* program/read: opcode, address and dummy bytes */
+    UINT32 addr;
+    UINT32 dummy;
+    UINT32 len;                     /* data bytes, clocked 4 per transfer */
+    PUINT8 data;                    /* program source or read destination */
+    SIZE_T information;
+} LITEPCIE_FLASH_XFER, *PLITEPCIE_FLASH_XFER;
+
 //
 // The device context performs the same job as
 // a WDM device extension in the driver frameworks
@@ -62,15 +161,31 @@ typedef struct _DEVICE_CONTEXT
     ULONG bar0_size;
     PVOID bar0_phys_addr;
     PVOID bar0_addr; /* virtual address of BAR0 */
+    CHAR identifier[256]; /* read once at start for LITEPCIE_IOCTL_INFO */
+    UINT64 dna;
     struct litepcie_chan chan[DMA_CHANNEL_COUNT];
-    WDFSPINLOCK dmaLock;
+    WDFSPINLOCK dmaLock; /* serializes MSI enable register updates */
+    WDFWAITLOCK configLock;
+    WDFWAITLOCK icapLock; /* one ICAP write or stream at a time */
+    WDFQUEUE flashQueue; /* sequential, one flash request at a time */
+    WDFTIMER flashTimer; /* polls SPI status while a flash request is pending */
+    LITEPCIE_FLASH_XFER flashXfer;
     WDFDMAENABLER dmaEnabler;
-    WDFDMATRANSACTION dmaTransaction;
     UINT32 irqs;
-    WDFINTERRUPT intr;
-    UINT32 irqs_requested;
-    UINT32 irqs_pending;
+    WDFINTERRUPT intr[LITEPCIE_IRQ_MAX];
+    volatile LONG irqs_requested; /* MSI enable mask, read by the ISR */
     UINT32 channels;
+    PKTHREAD copyThread; /* passive level worker copying ring buffers for ReadFile/WriteFile */
+    KEVENT copyEvent;
+    volatile LONG copyPending; /* per channel: bit 2n read drain, bit 2n+1 write drain */
+    volatile LONG copyStop;
+    KAFFINITY copyAffinity; /* CopyWorkerAffinity registry value, 0 for any processor */
+    volatile LONG64 dpc_count;
+    volatile LONG64 dpc_ticks_total;
+    volatile LONG64 dpc_ticks_max;
+    volatile LONG64 copy_count;
+    volatile LONG64 copy_ticks_total;
+    volatile LONG64 copy_ticks_max;
 
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
@@ -100,10 +215,44 @@ UINT32 litepciedrv_RegReadl(PDEVICE_CONTEXT dev, UINT32 reg);
 
 VOID litepciedrv_RegWritel(PDEVICE_CONTEXT dev, UINT32 reg, UINT32 val);
 
+NTSTATUS litepciedrv_RegBatch(PDEVICE_CONTEXT dev, struct litepcie_reg_op* ops, UINT32 count, UINT32* done);
+
+VOID litepciedrv_GetInfo(PDEVICE_CONTEXT dev, struct litepcie_ioctl_info* info);
+
+NTSTATUS litepciedrv_IcapStream(PDEVICE_CONTEXT dev, struct litepcie_ioctl_icap_stream* stream);
+
+#ifdef CSR_FLASH_BASE
+VOID litepciedrv_FlashStart(PDEVICE_CONTEXT dev, WDFREQUEST request);
+#endif
+
+NTSTATUS litepciedrv_MapUser(PVOID addr, SIZE_T length, MEMORY_CACHING_TYPE cacheType, BOOLEAN readOnly, PLITEPCIE_USER_MAP map);
+
+VOID litepciedrv_UnmapUser(PLITEPCIE_USER_MAP map);
+
+NTSTATUS litepciedrv_ChannelConfigure(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_config* config);
+
+NTSTATUS litepciedrv_ChannelIrqInterval(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_irq_interval* interval);
+
+NTSTATUS litepciedrv_ChannelPoll(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_poll* poll);
+
 VOID litepciedrv_ChannelRead(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length);
 
 VOID litepciedrv_ChannelWrite(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length);
 
+VOID litepciedrv_ChannelReadDrain(PLITEPCIE_CHAN channel);
+
+VOID litepciedrv_ChannelWriteDrain(PLITEPCIE_CHAN channel);
+
+VOID litepciedrv_ChannelReadRefresh(PLITEPCIE_CHAN channel);
+
+VOID litepciedrv_ChannelWriteRefresh(PLITEPCIE_CHAN channel);
+
+VOID litepciedrv_ChannelDoorbell(PLITEPCIE_CHAN channel);
+
+VOID litepciedrv_ChannelFlush(WDFQUEUE queue, WDFFILEOBJECT fileObject);
+
+VOID litepciedrv_GetStats(PDEVICE_CONTEXT dev, struct litepcie_ioctl_stats* stats);
+
 VOID litepcie_dma_writer_start(PDEVICE_CONTEXT dev, UINT32 index);
 
 VOID litepcie_dma_writer_stop(PDEVICE_CONTEXT dev, UINT32 index);
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <ntifs.h>
 #include <ntddk.h>
 #include <wdf.h>
 #include <initguid.h>
@@ -22,6 +22,11 @@ typedef struct FILE_CONTEXT_S {
     PLITEPCIE_CHAN dmaChan;
     UINT8 reader;
     UINT8 writer;
+    LITEPCIE_USER_MAP dmaTxMap;
+    LITEPCIE_USER_MAP dmaRxMap;
+    LITEPCIE_USER_MAP dmaStatusMap;
+    LITEPCIE_USER_MAP dmaDoorbellMap;
+    LITEPCIE_USER_MAP regsMap;
 }FILE_CONTEXT, *PFILE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, GetFileContext)
@@ -44,6 +49,7 @@ litepciedrvQueueInitialize(
 
 
 // File IO Event Handlers
+EVT_WDF_IO_IN_CALLER_CONTEXT        litepciedrvEvtIoInCallerContext;
 EVT_WDF_DEVICE_FILE_CREATE          litepciedrvEvtDeviceFileCreate;
 EVT_WDF_FILE_CLOSE                  litepciedrvEvtFileClose;
 EVT_WDF_FILE_CLEANUP                litepciedrvEvtFileCleanup;
@@ -55,5 +61,6 @@ EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL litepciedrvEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP litepciedrvEvtIoStop;
 EVT_WDF_IO_QUEUE_IO_READ litepciedrvEvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE litepciedrvEvtIoWrite;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL litepciedrvEvtFlashIoDeviceControl;
 
 EXTERN_C_END
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe Windows Driver
+ *
+ * Copyright (C) 2023 / Nate Meyer / Nate.Devel@gmail.com
+ *
+ */
+#pragma once
+
+#include <string.h>
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LITEPCIE_COPY_SSE2
+#endif
+
+/* Spans of at least this size bypass the cache, smaller ones use memcpy */
+#define LITEPCIE_COPY_NT_THRESHOLD (64 * 1024)
+
+/*
+ * Copy between a DMA ring and a request buffer. Large copies use non-temporal
+ * stores so streaming data does not evict the working set of the consumer;
+ * the data is read once by whoever receives the buffer, not by the copier.
+ * Usable from the driver (SSE2 needs no state save on x64) and user space.
+ */
+static __inline void litepcie_copy(void* dst, const void* src, size_t len)
+{
+#ifdef LITEPCIE_COPY_SSE2
+    if (len >= LITEPCIE_COPY_NT_THRESHOLD)
+    {
+        unsigned char* d = (unsigned char*)dst;
+        const unsigned char* s = (const unsigned char*)src;
+        size_t head = (16 - ((size_t)d & 15)) & 15;
+
+        /* Align the destination, streaming stores need 16 bytes */
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        len -= head;
+
+        for (; len >= 64; len -= 64, d += 64, s += 64)
+        {
+            __m128i x0 = _mm_loadu_si128((const __m128i*)(s + 0));
+            __m128i x1 = _mm_loadu_si128((const __m128i*)(s + 16));
+            __m128i x2 = _mm_loadu_si128((const __m128i*)(s + 32));
+            __m128i x3 = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_stream_si128((__m128i*)(d + 0), x0);
+            _mm_stream_si128((__m128i*)(d + 16), x1);
+            _mm_stream_si128((__m128i*)(d + 32), x2);
+            _mm_stream_si128((__m128i*)(d + 48), x3);
+        }
+        /* Order the streaming stores before the caller publishes the copy */
+        _mm_sfence();
+        memcpy(d, s, len);
+        return;
+    }
+#endif
+    memcpy(dst, src, len);
+}
@@ -14,12 +14,25 @@
 #define DMA_LAST_DISABLE (1<<25)
 
 #define DMA_CHANNEL_COUNT      DMA_CHANNELS
+/* Default ring geometry, can be changed per channel with LITEPCIE_IOCTL_DMA_CONFIG */
 #define DMA_BUFFER_PER_IRQ     32
 #define DMA_BUFFER_COUNT       256
 #define DMA_BUFFER_SIZE        2048
 #define DMA_BUFFER_TOTAL_SIZE (DMA_BUFFER_COUNT*DMA_BUFFER_SIZE)
 //#define DMA_BUFFER_ALIGNED
 
+/* Default adaptive polling, can be changed per channel with LITEPCIE_IOCTL_DMA_POLL */
+#define DMA_POLL_PERIOD_US     100
+#define DMA_POLL_ENTER         8   /* buffers per period that switch to polling */
+#define DMA_POLL_EXIT          2   /* buffers per period that switch back to interrupts */
+#define DMA_POLL_PERIOD_MIN_US 20
+#define DMA_POLL_PERIOD_MAX_US 100000
+
+/* Ring geometry limits */
+#define DMA_BUFFER_COUNT_MAX   256             /* descriptor table depth */
+#define DMA_BUFFER_SIZE_MAX    (DMA_IRQ_DISABLE - DMA_BUFFER_SIZE_ALIGN) /* 24-bit length field */
+#define DMA_BUFFER_SIZE_ALIGN  64
+
 /* DMA Offsets */
 #define PCIE_DMA_WRITER_ENABLE_OFFSET             0x0000
 #define PCIE_DMA_WRITER_TABLE_VALUE_OFFSET        0x0004
@@ -28,29 +28,101 @@ struct litepcie_ioctl_reg {
 	UINT8 is_write;
 };
 
+/* register batch operations */
+#define LITEPCIE_REG_OP_READ  0 /* val = reg */
+#define LITEPCIE_REG_OP_WRITE 1 /* reg = val */
+#define LITEPCIE_REG_OP_RMW   2 /* reg = (reg & ~mask) | (val & mask), val = previous reg */
+#define LITEPCIE_REG_OP_POLL  3 /* wait up to timeout us for (reg & mask) == val, val = last reg */
+
+#define LITEPCIE_REG_BATCH_MAX   1024    /* operations per ioctl */
+#define LITEPCIE_REG_POLL_MAX_US 1000000 /* longest poll timeout */
+#define LITEPCIE_REG_WAIT_MAX_US 1000000 /* longest total poll time per ioctl, later polls time out */
+
+struct litepcie_reg_op {
+	UINT32 op;
+	UINT32 reg;
+	UINT32 val;
+	UINT32 mask;
+	UINT32 timeout;
+};
+
+/* followed by count struct litepcie_reg_op, run in order, results written in place */
+struct litepcie_ioctl_reg_batch {
+	UINT32 count;
+	UINT32 done; /* out: operations completed, less than count if a poll timed out */
+};
+
+/* BAR0 user mapping, \CTRL only, read-only unless LITEPCIE_MMAP_REGS_WRITE */
+#define LITEPCIE_MMAP_REGS_READ_ONLY (1 << 0) /* map for polling, stores fault (default) */
+#define LITEPCIE_MMAP_REGS_WRITE     (1 << 1) /* allow stores, elevated caller and a writable handle only */
+
+struct litepcie_ioctl_mmap_regs {
+	UINT32 flags; /* in: LITEPCIE_MMAP_REGS_* */
+	UINT32 csr_base; /* out: CSR address of the first mapped byte */
+	UINT64 addr; /* out: user address of BAR0 */
+	UINT64 size; /* out: mapped length */
+};
+
 struct litepcie_ioctl_flash {
 	int tx_len; /* 8 to 40 */
 	UINT64 tx_data; /* 8 to 40 bits */
 	UINT64 rx_data; /* 40 bits */
 };
 
+/* bulk flash transfers, run under one chip select by the driver (needs software CS) */
+#define LITEPCIE_FLASH_PAGE_SIZE 256
+#define LITEPCIE_FLASH_READ_MAX  (64 * 1024)
+
+struct litepcie_ioctl_flash_program {
+	UINT8 cmd; /* page program opcode */
+	UINT32 addr; /* 24-bit address */
+	UINT32 len; /* 1 to LITEPCIE_FLASH_PAGE_SIZE, within one page */
+	UINT8 data[LITEPCIE_FLASH_PAGE_SIZE];
+};
+
+/* output buffer receives len bytes */
+struct litepcie_ioctl_flash_read {
+	UINT8 cmd; /* read opcode */
+	UINT8 dummy; /* dummy bytes between address and data */
+	UINT32 addr; /* 24-bit address */
+	UINT32 len; /* 1 to LITEPCIE_FLASH_READ_MAX */
+};
+
 struct litepcie_ioctl_icap {
 	UINT8 addr;
 	UINT32 data;
 };
 
+/* ICAP stream: register writes, each one waits for ICAP done before the next.
+   The core wraps every write in its own sync/desync, so frame data (FDRI)
+   cannot be loaded this way, only command and register writes. */
+#define LITEPCIE_ICAP_STREAM_MAX     4096    /* writes per ioctl */
+#define LITEPCIE_ICAP_TIMEOUT_MAX_US 100000  /* longest wait for done */
+#define LITEPCIE_ICAP_WAIT_MAX_US    1000000 /* longest total wait per ioctl, no write starts past it */
+
+/* followed by count struct litepcie_ioctl_icap, results written in place */
+struct litepcie_ioctl_icap_stream {
+	UINT32 count;
+	UINT32 timeout; /* us to wait for done after each write */
+	UINT32 done; /* out: writes completed */
+	UINT32 timed_out; /* out: 1 if done timed out, 0 if less than count because the ioctl ran out of time */
+	UINT32 elapsed_us; /* out: time spent on the writes */
+};
+
 struct litepcie_ioctl_dma {
 	UINT8 loopback_enable;
 };
 
 struct litepcie_ioctl_dma_writer {
 	UINT8 enable;
+	UINT8 refresh; /* read LOOP_STATUS now rather than report the last MSI */
 	INT64 hw_count;
 	INT64 sw_count;
 };
 
 struct litepcie_ioctl_dma_reader {
 	UINT8 enable;
+	UINT8 refresh; /* read LOOP_STATUS now rather than report the last MSI */
 	INT64 hw_count;
 	INT64 sw_count;
 };
@@ -72,17 +144,139 @@ struct litepcie_ioctl_mmap_dma_info {
 	UINT64 dma_rx_buf_offset;
 	UINT64 dma_rx_buf_size;
 	UINT64 dma_rx_buf_count;
+
+	UINT64 dma_tx_buf_per_irq;
+	UINT64 dma_rx_buf_per_irq;
+};
+
+/* dma modes */
+#define DMA_MODE_RING   1 /* loop over the driver's ring buffers (default) */
+#define DMA_MODE_DIRECT 2 /* one-shot scatter/gather into the ReadFile/WriteFile buffer */
+
+/* ring geometry per direction, 0 keeps the current value */
+struct litepcie_ioctl_dma_config {
+	UINT32 writer_buf_size; /* device to host, multiple of DMA_BUFFER_SIZE_ALIGN */
+	UINT32 writer_buf_count; /* power of 2, up to DMA_BUFFER_COUNT_MAX */
+	UINT32 writer_buf_per_irq; /* 1 to writer_buf_count */
+	UINT32 reader_buf_size; /* host to device */
+	UINT32 reader_buf_count;
+	UINT32 reader_buf_per_irq;
+	UINT32 mode; /* DMA_MODE_* for both directions */
+};
+
+/* interrupt coalescing per direction, 0 keeps the current value.
+   Applied to a running ring by reloading its descriptor table, which breaks
+   the stream at the buffer in flight: the C2H data already written to it is
+   lost, an H2C buffer is sent again from its start. */
+#define DMA_RESTARTED_WRITER 1
+#define DMA_RESTARTED_READER 2
+
+struct litepcie_ioctl_dma_irq_interval {
+	UINT32 writer_buf_per_irq; /* 1 to writer_buf_count */
+	UINT32 reader_buf_per_irq; /* 1 to reader_buf_count */
+	UINT32 restarted; /* out: DMA_RESTARTED_* for the running rings that were reloaded */
+};
+
+/* progress reporting modes */
+#define DMA_POLL_IRQ      1 /* MSI every buf_per_irq buffers (default) */
+#define DMA_POLL_ADAPTIVE 2 /* mask the MSIs and poll LOOP_STATUS while traffic is heavy */
+
+/* progress reporting per channel, 0 keeps the current value */
+struct litepcie_ioctl_dma_poll {
+	UINT32 mode; /* DMA_POLL_* */
+	UINT32 period_us; /* poll timer period, DMA_POLL_PERIOD_MIN_US to DMA_POLL_PERIOD_MAX_US */
+	UINT32 enter_buffers; /* both directions, per period: start polling at or above */
+	UINT32 exit_buffers; /* stop polling below, less than enter_buffers */
+};
+
+#define LITEPCIE_STATS_CHANNELS_MAX 8
+
+struct litepcie_ioctl_stats_chan {
+	UINT64 irq_ticks; /* time spent reporting progress by MSI */
+	UINT64 poll_ticks; /* time spent polling */
+	UINT64 poll_entries; /* switches from MSI to polling */
+	UINT64 polls; /* poll timer runs */
+};
+
+/* driver timing, in KeQueryPerformanceCounter ticks of qpc_frequency */
+struct litepcie_ioctl_stats {
+	UINT8 reset; /* clear the counters after reading them */
+	UINT64 qpc_frequency;
+	UINT64 dpc_count;
+	UINT64 dpc_ticks_total;
+	UINT64 dpc_ticks_max;
+	UINT64 copy_count; /* copy worker passes */
+	UINT64 copy_ticks_total;
+	UINT64 copy_ticks_max;
+	UINT32 channels;
+	struct litepcie_ioctl_stats_chan chan[LITEPCIE_STATS_CHANNELS_MAX];
+};
+
+/* device snapshot: identity cached when the device starts, link and XADC read live */
+#define LITEPCIE_INFO_CHANNELS_MAX 8
+
+#define LITEPCIE_INFO_DNA  (1 << 0) /* dna is valid */
+#define LITEPCIE_INFO_LINK (1 << 1) /* link_status, max_payload_size and max_request_size are valid */
+#define LITEPCIE_INFO_XADC (1 << 2) /* xadc_* are valid */
+
+struct litepcie_ioctl_info {
+	char identifier[256]; /* NUL terminated */
+	UINT64 dna;
+	UINT32 flags; /* LITEPCIE_INFO_* */
+	UINT32 channels;
+	UINT32 irqs; /* MSI messages serviced, 1 on single vector gateware */
+	UINT32 link_status; /* status bit 0, rate bit 2 (0: 2.5 GT/s, 1: 5 GT/s), width bits 4:3 (x1 << n), LTSSM bits 10:5 */
+	UINT32 max_payload_size;
+	UINT32 max_request_size;
+	UINT32 xadc_temperature; /* raw 12-bit codes */
+	UINT32 xadc_vccint;
+	UINT32 xadc_vccaux;
+	UINT32 xadc_vccbram;
+	struct litepcie_ioctl_dma_config channel[LITEPCIE_INFO_CHANNELS_MAX]; /* ring geometry and mode */
 };
 
 struct litepcie_ioctl_mmap_dma_update {
 	INT64 sw_count;
 };
 
+struct litepcie_ioctl_mmap_dma {
+	UINT64 dma_tx_buf_addr; /* user address of the DMA reader (host to device) buffers */
+	UINT64 dma_tx_buf_size;
+	UINT64 dma_rx_buf_addr; /* user address of the DMA writer (device to host) buffers */
+	UINT64 dma_rx_buf_size;
+	UINT64 dma_status_addr; /* user address of struct litepcie_dma_shm_status (read-only) */
+	UINT64 dma_doorbell_addr; /* user address of struct litepcie_dma_shm_doorbell */
+};
+
+/* shared counters, updated by the driver on every DMA interrupt */
+struct litepcie_dma_shm_status {
+	volatile INT64 reader_hw_count;
+	volatile INT64 writer_hw_count;
+	/* KeQueryPerformanceCounter (the QueryPerformanceCounter clock) when the
+	   driver saw each buffer complete, indexed like the ring buffers. Written
+	   before the hw_count that covers the buffer. */
+	volatile INT64 reader_ts[DMA_BUFFER_COUNT_MAX];
+	volatile INT64 writer_ts[DMA_BUFFER_COUNT_MAX];
+};
+
+/* shared counters, published by the application in zero-copy mode */
+struct litepcie_dma_shm_doorbell {
+	volatile INT64 reader_sw_count;
+	volatile INT64 writer_sw_count;
+};
+
 #define LITEPCIE_IOCTL(id)		CTL_CODE(FILE_DEVICE_UNKNOWN, id, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 #define LITEPCIE_IOCTL_REG               LITEPCIE_IOCTL(0) // struct litepcie_ioctl_reg
 #define LITEPCIE_IOCTL_FLASH             LITEPCIE_IOCTL(1) // struct litepcie_ioctl_flash
 #define LITEPCIE_IOCTL_ICAP              LITEPCIE_IOCTL(2) // struct litepcie_ioctl_icap
+#define LITEPCIE_IOCTL_REG_BATCH         LITEPCIE_IOCTL(3) // struct litepcie_ioctl_reg_batch + ops
+#define LITEPCIE_IOCTL_MMAP_REGS         LITEPCIE_IOCTL(4) // struct litepcie_ioctl_mmap_regs
+#define LITEPCIE_IOCTL_MUNMAP_REGS       LITEPCIE_IOCTL(5)
+#define LITEPCIE_IOCTL_FLASH_PROGRAM     LITEPCIE_IOCTL(6) // struct litepcie_ioctl_flash_program
+#define LITEPCIE_IOCTL_FLASH_READ        LITEPCIE_IOCTL(7) // struct litepcie_ioctl_flash_read, data out
+#define LITEPCIE_IOCTL_ICAP_STREAM       LITEPCIE_IOCTL(8) // struct litepcie_ioctl_icap_stream + writes
+#define LITEPCIE_IOCTL_INFO              LITEPCIE_IOCTL(9) // struct litepcie_ioctl_info, out
 
 #define LITEPCIE_IOCTL_DMA                       LITEPCIE_IOCTL(20) // struct litepcie_ioctl_dma
 #define LITEPCIE_IOCTL_DMA_WRITER                LITEPCIE_IOCTL(21) // struct litepcie_ioctl_dma_writer
@@ -91,6 +285,12 @@ struct litepcie_ioctl_mmap_dma_update {
 #define LITEPCIE_IOCTL_LOCK                      LITEPCIE_IOCTL(25) // struct litepcie_ioctl_lock
 #define LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE    LITEPCIE_IOCTL(26) // struct litepcie_ioctl_mmap_dma_update
 #define LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE    LITEPCIE_IOCTL(27) // struct litepcie_ioctl_mmap_dma_update
+#define LITEPCIE_IOCTL_MMAP_DMA                  LITEPCIE_IOCTL(28) // struct litepcie_ioctl_mmap_dma
+#define LITEPCIE_IOCTL_MUNMAP_DMA                LITEPCIE_IOCTL(29)
+#define LITEPCIE_IOCTL_DMA_CONFIG                LITEPCIE_IOCTL(30) // struct litepcie_ioctl_dma_config
+#define LITEPCIE_IOCTL_STATS                     LITEPCIE_IOCTL(31) // struct litepcie_ioctl_stats
+#define LITEPCIE_IOCTL_DMA_IRQ_INTERVAL          LITEPCIE_IOCTL(32) // struct litepcie_ioctl_dma_irq_interval
+#define LITEPCIE_IOCTL_DMA_POLL                  LITEPCIE_IOCTL(33) // struct litepcie_ioctl_dma_poll
 
 //
 // Define an Interface Guid so that apps can find the device and talk to it.
@@ -28,10 +28,48 @@ static UINT32 leftmost_bit(UINT32 x)
     return i;
 }
 
+//Fold a LOOP_STATUS snapshot (loop count << 16 | buffer index) into the 64-bit
+//monotonic buffer count. base is the count the loaded table started from.
+//Lock free: a snapshot older than the published count leaves it untouched,
+//so concurrent folders can never move it backwards.
+static INT64 litepciedrv_FoldHwCount(volatile INT64* hw_count, INT64 base, UINT32 buf_count, UINT32 loop_status)
+{
+    INT64 wrap = (INT64)(1ULL << (leftmost_bit(buf_count) + 16));
+    INT64 old, count;
+
+    do {
+        old = ReadAcquire64(hw_count) - base;
+        count = old & ((~((INT64)buf_count - 1) << 16) & 0xffffffffffff0000);
+        count |= (loop_status >> 16) * buf_count + (loop_status & 0xffff);
+        if (count < old)
+        {
+            if (old - count < wrap / 2)
+                return old + base;
+            count += wrap;
+        }
+        else if (count == old)
+        {
+            return old + base;
+        }
+    } while (InterlockedCompareExchange64(hw_count, count + base, old + base) != old + base);
+
+    return count + base;
+}
+
 static NTSTATUS litepciedrv_SetupInterrupts(PDEVICE_CONTEXT dev,
                                             WDFCMRESLIST ResourcesRaw,
                                             WDFCMRESLIST ResourcesTranslated);
 
+static NTSTATUS litepciedrv_PollInitialize(WDFDEVICE wdfDevice, PLITEPCIE_CHAN channel);
+
+static VOID litepciedrv_PollPause(PLITEPCIE_CHAN channel);
+
+static VOID litepciedrv_DirectComplete(WDFSPINLOCK lock, WDFDMATRANSACTION transaction, WDFREQUEST* active, BOOLEAN abort);
+
+static NTSTATUS litepciedrv_CopyWorkerStart(PDEVICE_CONTEXT dev);
+
+static VOID litepciedrv_CopyWorkerStop(PDEVICE_CONTEXT dev);
+
 
 UINT32 litepciedrv_RegReadl(PDEVICE_CONTEXT dev, UINT32 reg)
 {
@@ -44,6 +82,341 @@ VOID litepciedrv_RegWritel(PDEVICE_CONTEXT dev, UINT32 reg, UINT32 val)
     *(PUINT32)((PUINT8)dev->bar0_addr + reg - CSR_BASE) = val;
 }
 
+static UINT32 litepciedrv_ElapsedUs(LARGE_INTEGER start, LARGE_INTEGER frequency)
+{
+    LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+    return (UINT32)min((now.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart, MAXUINT32);
+}
+
+//Wait up to timeout us, the caller's cut of op->timeout and what is left
+//of the ioctl's total. Runs at PASSIVE_LEVEL from the default queue.
+static BOOLEAN litepciedrv_RegPoll(PDEVICE_CONTEXT dev, struct litepcie_reg_op* op, UINT32 timeout)
+{
+    LARGE_INTEGER frequency, start;
+    LARGE_INTEGER interval;
+    UINT32 elapsed_us;
+
+    start = KeQueryPerformanceCounter(&frequency);
+    for (;;)
+    {
+        UINT32 val = litepciedrv_RegReadl(dev, op->reg);
+        elapsed_us = litepciedrv_ElapsedUs(start, frequency);
+        if ((val & op->mask) == op->val)
+        {
+            op->val = val;
+            return TRUE;
+        }
+        if (elapsed_us >= timeout)
+        {
+            op->val = val;
+            return FALSE;
+        }
+        //Spin for short waits, sleep once the device is clearly slow
+        if (elapsed_us < 100)
+        {
+            KeStallExecutionProcessor(1);
+        }
+        else
+        {
+            interval.QuadPart = -10 * 100; /* 100us, relative */
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+}
+
+NTSTATUS litepciedrv_RegBatch(PDEVICE_CONTEXT dev, struct litepcie_reg_op* ops, UINT32 count, UINT32* done)
+{
+    LARGE_INTEGER frequency, start;
+    UINT32 spent_us;
+
+    //Validate the whole batch before touching the device
+    for (UINT32 i = 0; i < count; i++)
+    {
+        if (ops[i].op > LITEPCIE_REG_OP_POLL ||
+            ops[i].reg < CSR_BASE || (ops[i].reg & 3) != 0 ||
+            ops[i].reg - CSR_BASE > dev->bar0_size - sizeof(UINT32) ||
+            ops[i].timeout > LITEPCIE_REG_POLL_MAX_US)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Invalid register operation %u: op %u reg 0x%X\n",
+                i, ops[i].op, ops[i].reg);
+            *done = 0;
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    //All polls of the batch share LITEPCIE_REG_WAIT_MAX_US, so the ioctl
+    //cannot hold the thread for count times the longest poll
+    start = KeQueryPerformanceCounter(&frequency);
+    for (*done = 0; *done < count; (*done)++)
+    {
+        struct litepcie_reg_op* op = &ops[*done];
+        UINT32 val;
+
+        switch (op->op) {
+        case LITEPCIE_REG_OP_READ:
+            op->val = litepciedrv_RegReadl(dev, op->reg);
+            break;
+        case LITEPCIE_REG_OP_WRITE:
+            litepciedrv_RegWritel(dev, op->reg, op->val);
+            break;
+        case LITEPCIE_REG_OP_RMW:
+            val = litepciedrv_RegReadl(dev, op->reg);
+            litepciedrv_RegWritel(dev, op->reg, (val & ~op->mask) | (op->val & op->mask));
+            op->val = val;
+            break;
+        case LITEPCIE_REG_OP_POLL:
+            spent_us = min(litepciedrv_ElapsedUs(start, frequency), LITEPCIE_REG_WAIT_MAX_US);
+            if (!litepciedrv_RegPoll(dev, op, min(op->timeout, LITEPCIE_REG_WAIT_MAX_US - spent_us)))
+                return STATUS_SUCCESS;
+            break;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+//Runs at PASSIVE_LEVEL from the default queue, icapLock is a wait lock
+NTSTATUS litepciedrv_IcapStream(PDEVICE_CONTEXT dev, struct litepcie_ioctl_icap_stream* stream)
+{
+#ifdef CSR_ICAP_DONE_ADDR
+    struct litepcie_ioctl_icap* writes = (struct litepcie_ioctl_icap*)(stream + 1);
+    struct litepcie_reg_op poll = { LITEPCIE_REG_OP_POLL, CSR_ICAP_DONE_ADDR, 1, 1, stream->timeout };
+    LARGE_INTEGER frequency, start;
+
+    stream->done = 0;
+    stream->timed_out = 0;
+    stream->elapsed_us = 0;
+    if (stream->timeout > LITEPCIE_ICAP_TIMEOUT_MAX_US)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfWaitLockAcquire(dev->icapLock, NULL);
+    start = KeQueryPerformanceCounter(&frequency);
+    for (; stream->done < stream->count; stream->done++)
+    {
+        //Only start a write that still has its whole timeout, so a short
+        //count without timed_out is safe to resume from done
+        if (litepciedrv_ElapsedUs(start, frequency) + stream->timeout > LITEPCIE_ICAP_WAIT_MAX_US)
+        {
+            break;
+        }
+        litepciedrv_RegWritel(dev, CSR_ICAP_ADDR_ADDR, writes[stream->done].addr);
+        litepciedrv_RegWritel(dev, CSR_ICAP_DATA_ADDR, writes[stream->done].data);
+        litepciedrv_RegWritel(dev, CSR_ICAP_WRITE_ADDR, 1);
+        //Handshake: the next write only starts once this one is done
+        poll.val = 1;
+        if (!litepciedrv_RegPoll(dev, &poll, stream->timeout))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "ICAP write %u timed out\n", stream->done);
+            stream->timed_out = 1;
+            break;
+        }
+    }
+    stream->elapsed_us = litepciedrv_ElapsedUs(start, frequency);
+    WdfWaitLockRelease(dev->icapLock);
+    return STATUS_SUCCESS;
+#else
+    UNREFERENCED_PARAMETER(dev);
+    stream->done = 0;
+    return STATUS_NOT_SUPPORTED;
+#endif
+}
+
+#ifdef CSR_FLASH_BASE
+//Start one SPI transfer of tx_len bits, data left aligned on bit 39
+static VOID litepciedrv_FlashSpiStart(PDEVICE_CONTEXT dev, UINT32 tx_len, UINT64 tx_data)
+{
+    litepciedrv_RegWritel(dev, CSR_FLASH_SPI_MOSI_ADDR, (UINT32)(tx_data >> 32));
+    litepciedrv_RegWritel(dev, CSR_FLASH_SPI_MOSI_ADDR + 4, (UINT32)tx_data);
+    litepciedrv_RegWritel(dev, CSR_FLASH_SPI_CONTROL_ADDR,
+        SPI_CTRL_START | (tx_len * SPI_CTRL_LENGTH));
+}
+
+static UINT64 litepciedrv_FlashSpiResult(PDEVICE_CONTEXT dev)
+{
+    return ((UINT64)litepciedrv_RegReadl(dev, CSR_FLASH_SPI_MISO_ADDR) << 32) |
+        litepciedrv_RegReadl(dev, CSR_FLASH_SPI_MISO_ADDR + 4);
+}
+
+//Data bytes carried by a data step, up to 4 per 32-bit transfer
+static UINT32 litepciedrv_FlashStepBytes(PLITEPCIE_FLASH_XFER xfer, UINT32 offset)
+{
+    return xfer->len - offset < 4 ? xfer->len - offset : 4;
+}
+
+//Transfer for the current step: raw transfer, or opcode/address, dummy and data words
+static VOID litepciedrv_FlashStepStart(PDEVICE_CONTEXT dev, PLITEPCIE_FLASH_XFER xfer)
+{
+    UINT32 step = xfer->step;
+
+    if (xfer->code == LITEPCIE_IOCTL_FLASH)
+    {
+        litepciedrv_FlashSpiStart(dev, xfer->tx_len, xfer->tx_data);
+    }
+    else if (step == 0)
+    {
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+        //Select the chip for the whole request
+        litepciedrv_RegWritel(dev, CSR_FLASH_CS_N_OUT_ADDR, 0);
+#endif
+        litepciedrv_FlashSpiStart(dev, 32, ((UINT64)xfer->cmd << 32) | ((UINT64)(xfer->addr & 0xffffff) << 8));
+    }
+    else if (step <= xfer->dummy)
+    {
+        litepciedrv_FlashSpiStart(dev, 8, 0);
+    }
+    else
+    {
+        UINT32 offset = (step - 1 - xfer->dummy) * 4;
+        UINT32 bytes = litepciedrv_FlashStepBytes(xfer, offset);
+        UINT64 tx_data = 0;
+
+        //Program data is left aligned on bit 39, first byte out first
+        if (xfer->code == LITEPCIE_IOCTL_FLASH_PROGRAM)
+        {
+            for (UINT32 i = 0; i < bytes; i++)
+            {
+                tx_data |= (UINT64)xfer->data[offset + i] << (32 - 8 * i);
+            }
+        }
+        litepciedrv_FlashSpiStart(dev, 8 * bytes, tx_data);
+    }
+}
+
+static VOID litepciedrv_FlashStepEnd(PDEVICE_CONTEXT dev, PLITEPCIE_FLASH_XFER xfer)
+{
+    UINT32 step = xfer->step;
+
+    if (xfer->code == LITEPCIE_IOCTL_FLASH)
+    {
+        xfer->spi->rx_data = litepciedrv_FlashSpiResult(dev);
+    }
+    else if (xfer->code == LITEPCIE_IOCTL_FLASH_READ && step > xfer->dummy)
+    {
+        UINT32 offset = (step - 1 - xfer->dummy) * 4;
+        UINT32 bytes = litepciedrv_FlashStepBytes(xfer, offset);
+        UINT64 rx_data = litepciedrv_FlashSpiResult(dev);
+
+        //Received bits are right aligned, first byte in highest position
+        for (UINT32 i = 0; i < bytes; i++)
+        {
+            xfer->data[offset + i] = (UINT8)(rx_data >> (8 * (bytes - 1 - i)));
+        }
+    }
+}
+
+//Run the current flash request for at most one slice, STATUS_PENDING while transfers remain
+static NTSTATUS litepciedrv_FlashRun(PDEVICE_CONTEXT dev)
+{
+    PLITEPCIE_FLASH_XFER xfer = &dev->flashXfer;
+    LARGE_INTEGER freq;
+    LONGLONG now = KeQueryPerformanceCounter(&freq).QuadPart;
+    LONGLONG sliceEnd = now + freq.QuadPart * LITEPCIE_FLASH_SLICE_US / 1000000;
+
+    while (xfer->step < xfer->steps)
+    {
+        if (!xfer->started)
+        {
+            litepciedrv_FlashStepStart(dev, xfer);
+            xfer->started = TRUE;
+            xfer->deadline = now + freq.QuadPart * SPI_TIMEOUT / 1000000;
+        }
+
+        if (litepciedrv_RegReadl(dev, CSR_FLASH_SPI_STATUS_ADDR) & SPI_STATUS_DONE)
+        {
+            litepciedrv_FlashStepEnd(dev, xfer);
+            xfer->started = FALSE;
+            xfer->step++;
+        }
+
+        now = KeQueryPerformanceCounter(NULL).QuadPart;
+        if (xfer->started && now > xfer->deadline)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "SPI flash transfer %u timed out\n", xfer->step);
+            return STATUS_IO_TIMEOUT;
+        }
+        if (now > sliceEnd && xfer->step < xfer->steps)
+        {
+            return STATUS_PENDING;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+static VOID litepciedrv_FlashComplete(PDEVICE_CONTEXT dev, NTSTATUS status)
+{
+    PLITEPCIE_FLASH_XFER xfer = &dev->flashXfer;
+    WDFREQUEST request = xfer->request;
+
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+    if (xfer->code != LITEPCIE_IOCTL_FLASH)
+    {
+        litepciedrv_RegWritel(dev, CSR_FLASH_CS_N_OUT_ADDR, 1);
+    }
+#endif
+    if (xfer->code == LITEPCIE_IOCTL_FLASH && NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
+            "litepciedrv FLASH TX 0x%llX RX 0x%llX", xfer->tx_data, xfer->spi->rx_data);
+    }
+
+    //Completing lets flashQueue deliver the next request
+    xfer->request = NULL;
+    WdfRequestCompleteWithInformation(request, status, NT_SUCCESS(status) ? xfer->information : 0);
+}
+
+static VOID litepciedrv_EvtFlashTimer(WDFTIMER timer)
+{
+    PDEVICE_CONTEXT dev = DeviceGetContext(WdfTimerGetParentObject(timer));
+    NTSTATUS status = litepciedrv_FlashRun(dev);
+
+    if (status == STATUS_PENDING)
+    {
+        WdfTimerStart(timer, WDF_REL_TIMEOUT_IN_US(LITEPCIE_FLASH_TICK_US));
+        return;
+    }
+    litepciedrv_FlashComplete(dev, status);
+}
+
+//Run the first slice of a request set up in dev->flashXfer, the timer does the rest
+VOID litepciedrv_FlashStart(PDEVICE_CONTEXT dev, WDFREQUEST request)
+{
+    NTSTATUS status;
+
+    dev->flashXfer.request = request;
+    status = litepciedrv_FlashRun(dev);
+    if (status == STATUS_PENDING)
+    {
+        WdfTimerStart(dev->flashTimer, WDF_REL_TIMEOUT_IN_US(LITEPCIE_FLASH_TICK_US));
+        return;
+    }
+    litepciedrv_FlashComplete(dev, status);
+}
+
+static NTSTATUS litepciedrv_FlashInitialize(WDFDEVICE wdfDevice, PDEVICE_CONTEXT dev)
+{
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    //Sequential: the framework delivers the next request once the current one completes
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    queueConfig.EvtIoDeviceControl = litepciedrvEvtFlashIoDeviceControl;
+    status = WdfIoQueueCreate(wdfDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &dev->flashQueue);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, litepciedrv_EvtFlashTimer);
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = wdfDevice;
+    return WdfTimerCreate(&timerConfig, &attributes, &dev->flashTimer);
+}
+#endif
+
 VOID litepciedrvCleanupDevice(
     _In_ WDFOBJECT Object
 )
@@ -139,6 +512,8 @@ NTSTATUS litepciedrv_DeviceOpen(WDFDEVICE wdfDevice,
     litepcie->deviceDrv = wdfDevice;
 
     WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->dmaLock);
+    WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->configLock);
+    WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->icapLock);
 
     //Check Device Version
     //TODO
@@ -172,13 +547,16 @@ NTSTATUS litepciedrv_DeviceOpen(WDFDEVICE wdfDevice,
     //Reset LitePCIe Core
     litepciedrv_RegWritel(litepcie, CSR_CTRL_RESET_ADDR, 1);
 
-    //Show Identifier
-    CHAR versionStr[256] = { 0 };
-    for (UINT32 i = 0; i < 256; i++)
+    //Show Identifier, kept with the DNA for LITEPCIE_IOCTL_INFO
+    for (UINT32 i = 0; i < sizeof(litepcie->identifier) - 1; i++)
     {
-        versionStr[i] = (CHAR)litepciedrv_RegReadl(litepcie, CSR_IDENTIFIER_MEM_BASE + i * 4);
+        litepcie->identifier[i] = (CHAR)litepciedrv_RegReadl(litepcie, CSR_IDENTIFIER_MEM_BASE + i * 4);
     }
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Version %s", versionStr);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Version %s", litepcie->identifier);
+#ifdef CSR_DNA_BASE
+    litepcie->dna = ((UINT64)litepciedrv_RegReadl(litepcie, CSR_DNA_ID_ADDR) << 32) |
+        litepciedrv_RegReadl(litepcie, CSR_DNA_ID_ADDR + 4);
+#endif
 
     //TODO: MSI(X) Configuration
     // Only MSI supported for now
@@ -199,8 +577,23 @@ NTSTATUS litepciedrv_DeviceOpen(WDFDEVICE wdfDevice,
         litepcie->chan[i].dma.writer_lock = 0;
         litepcie->chan[i].dma.reader_lock = 0;
 
-        WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.readerLock);
-        WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.writerLock);
+        WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.readQueueLock);
+        WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.writeQueueLock);
+        WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.foldLock);
+
+        //Manual queues hold deferred read/write requests until buffers are ready
+        WDF_IO_QUEUE_CONFIG queueConfig;
+        WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+        status = WdfIoQueueCreate(wdfDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.readQueue);
+        if (NT_SUCCESS(status))
+        {
+            status = WdfIoQueueCreate(wdfDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &litepcie->chan[i].dma.writeQueue);
+        }
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create request queues for channel %d: %!STATUS!", i, status);
+            return status;
+        }
 
 
         switch (i) {
@@ -273,65 +666,89 @@ NTSTATUS litepciedrv_DeviceOpen(WDFDEVICE wdfDevice,
     //Create DMA Enabler
     WdfDeviceSetAlignmentRequirement(litepcie->deviceDrv, FILE_LONG_ALIGNMENT);
 
+    //Direct mode transfers are split by the framework to fit the descriptor table
     WDF_DMA_ENABLER_CONFIG dmaConfig;
-    WDF_DMA_ENABLER_CONFIG_INIT(&dmaConfig, WdfDmaProfileScatterGather64Duplex, DMA_BUFFER_SIZE);
+    WDF_DMA_ENABLER_CONFIG_INIT(&dmaConfig, WdfDmaProfileScatterGather64Duplex, DMA_DIRECT_MAX_LENGTH);
     status = WdfDmaEnablerCreate(litepcie->deviceDrv, &dmaConfig, WDF_NO_OBJECT_ATTRIBUTES, &litepcie->dmaEnabler);
     if (!NT_SUCCESS(status)) {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create dmaEnabler: %!STATUS!", status);
         return status;
     }
-
-    status = WdfDmaTransactionCreate(litepcie->dmaEnabler, WDF_NO_OBJECT_ATTRIBUTES, &litepcie->dmaTransaction);
-    if (!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create dmaTransaction: %!STATUS!", status);
-        return status;
-    }
+    WdfDmaEnablerSetMaximumScatterGatherElements(litepcie->dmaEnabler, DMA_BUFFER_COUNT_MAX);
 
     //Allocate DMA Buffers
     /* for each dma channel */
     for (UINT32 i = 0; i < litepcie->channels; i++) {
         struct litepcie_dma_chan* dmachan = &litepcie->chan[i].dma;
-        //Allocate Common buffer for the channel read transactions
-        status = WdfCommonBufferCreate(litepcie->dmaEnabler,
-                                        DMA_BUFFER_TOTAL_SIZE,
-                                        WDF_NO_OBJECT_ATTRIBUTES,
-                                        &dmachan->readBuffer);
+        struct litepcie_ioctl_dma_config config = {
+            .writer_buf_size = DMA_BUFFER_SIZE,
+            .writer_buf_count = DMA_BUFFER_COUNT,
+            .writer_buf_per_irq = DMA_BUFFER_PER_IRQ,
+            .reader_buf_size = DMA_BUFFER_SIZE,
+            .reader_buf_count = DMA_BUFFER_COUNT,
+            .reader_buf_per_irq = DMA_BUFFER_PER_IRQ,
+            .mode = DMA_MODE_RING,
+        };
+
+        //Create the direct mode transactions, one per direction
+        status = WdfDmaTransactionCreate(litepcie->dmaEnabler, WDF_NO_OBJECT_ATTRIBUTES, &dmachan->readTransaction);
+        if (NT_SUCCESS(status)) {
+            status = WdfDmaTransactionCreate(litepcie->dmaEnabler, WDF_NO_OBJECT_ATTRIBUTES, &dmachan->writeTransaction);
+        }
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create dmaTransaction for channel %d: %!STATUS!", i, status);
+            return status;
+        }
+
+        status = litepciedrv_PollInitialize(wdfDevice, &litepcie->chan[i]);
         if (!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create Read Buffer for channel %d: %!STATUS!", i, status);
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create the poll timer for channel %d: %!STATUS!", i, status);
             return status;
         }
 
-        //Allocate a Common buffer for the channel write transactions
+        //Allocate Common buffers with the default geometry
+        status = litepciedrv_ChannelConfigure(&litepcie->chan[i], &config);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create DMA Buffers for channel %d: %!STATUS!", i, status);
+            return status;
+        }
+
+        //Allocate the shared counter pages, page aligned so they can be mapped to user space separately
         status = WdfCommonBufferCreate(litepcie->dmaEnabler,
-                                        DMA_BUFFER_TOTAL_SIZE,
+                                        DMA_SHM_STATUS_SIZE + DMA_SHM_DOORBELL_SIZE,
                                         WDF_NO_OBJECT_ATTRIBUTES,
-                                        &dmachan->writeBuffer);
+                                        &dmachan->shmBuffer);
         if (!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create Write Buffer for channel %d: %!STATUS!", i, status);
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create Shared Counters for channel %d: %!STATUS!", i, status);
             return status;
         }
-        
-        PVOID rdVirtAddr = WdfCommonBufferGetAlignedVirtualAddress(dmachan->readBuffer);
-        PHYSICAL_ADDRESS rdPhysAddr = WdfCommonBufferGetAlignedLogicalAddress(dmachan->readBuffer);
-        PVOID wrVirtAddr = WdfCommonBufferGetAlignedVirtualAddress(dmachan->writeBuffer);
-        PHYSICAL_ADDRESS wrPhysAddr = WdfCommonBufferGetAlignedLogicalAddress(dmachan->writeBuffer);
-
-        /* for each dma buffer */
-        for (UINT32 j = 0; j < DMA_BUFFER_COUNT; j++) {
-            /* assign reader buffers */
-            dmachan->reader_handle[j] = (PVOID)((PUINT8)rdVirtAddr + (j * DMA_BUFFER_SIZE));
-            dmachan->reader_addr[j].QuadPart = rdPhysAddr.QuadPart + (j * DMA_BUFFER_SIZE);
-            /* assign writer buffers */
-            dmachan->writer_handle[j] = (PVOID)((PUINT8)wrVirtAddr + (j * DMA_BUFFER_SIZE));
-            dmachan->writer_addr[j].QuadPart = wrPhysAddr.QuadPart + (j * DMA_BUFFER_SIZE);
-
-            /* check */
-            if ((dmachan->reader_addr[j].QuadPart == 0)
-                || (dmachan->writer_addr[j].QuadPart == 0)) {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to allocate dma buffer for index %d\n", i);
-                return STATUS_NO_MEMORY;
-            }
-        }
+        dmachan->shm_status = WdfCommonBufferGetAlignedVirtualAddress(dmachan->shmBuffer);
+        dmachan->shm_doorbell = (struct litepcie_dma_shm_doorbell*)((PUINT8)dmachan->shm_status + DMA_SHM_STATUS_SIZE);
+        RtlZeroMemory(dmachan->shm_status, DMA_SHM_STATUS_SIZE + DMA_SHM_DOORBELL_SIZE);
+    }
+
+#ifdef CSR_FLASH_BASE
+    status = litepciedrv_FlashInitialize(wdfDevice, litepcie);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create the flash queue: %!STATUS!", status);
+        return status;
+    }
+#endif
+
+    //Start the ring copy worker, optionally pinned by the CopyWorkerAffinity device value
+    WDFKEY key;
+    ULONG affinity = 0;
+    if (NT_SUCCESS(WdfDeviceOpenRegistryKey(wdfDevice, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key)))
+    {
+        DECLARE_CONST_UNICODE_STRING(affinityName, L"CopyWorkerAffinity");
+        WdfRegistryQueryULong(key, &affinityName, &affinity);
+        WdfRegistryClose(key);
+    }
+    litepcie->copyAffinity = (KAFFINITY)affinity & KeQueryActiveProcessors();
+    status = litepciedrv_CopyWorkerStart(litepcie);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to start the copy worker: %!STATUS!", status);
+        return status;
     }
 
     return status;
@@ -343,11 +760,29 @@ NTSTATUS litepciedrv_DeviceClose(WDFDEVICE wdfDevice)
     UNREFERENCED_PARAMETER(wdfDevice);
     PDEVICE_CONTEXT litepcie = DeviceGetContext(wdfDevice);
 
+    /* Stop the copy worker before failing the requests it serves */
+    litepciedrv_CopyWorkerStop(litepcie);
+
+#ifdef CSR_FLASH_BASE
+    /* Stop the flash engine, failing a request it still holds */
+    if (litepcie->flashTimer != NULL) {
+        WdfTimerStop(litepcie->flashTimer, TRUE);
+        if (litepcie->flashXfer.request != NULL)
+            litepciedrv_FlashComplete(litepcie, STATUS_CANCELLED);
+    }
+#endif
+
     /* Stop the DMAs */
     for (UINT32 i = 0; i < litepcie->channels; i++) {
         struct litepcie_dma_chan *dmachan = &litepcie->chan[i].dma;
+        if (dmachan->pollTimer != NULL)
+            litepciedrv_PollPause(&litepcie->chan[i]);
         litepciedrv_RegWritel(litepcie, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 0);
         litepciedrv_RegWritel(litepcie, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 0);
+        litepciedrv_DirectComplete(dmachan->readQueueLock, dmachan->readTransaction, &dmachan->readActive, TRUE);
+        litepciedrv_DirectComplete(dmachan->writeQueueLock, dmachan->writeTransaction, &dmachan->writeActive, TRUE);
+        litepciedrv_ChannelFlush(dmachan->readQueue, NULL);
+        litepciedrv_ChannelFlush(dmachan->writeQueue, NULL);
     }
 
     /* Disable all interrupts */
@@ -361,175 +796,844 @@ NTSTATUS litepciedrv_DeviceClose(WDFDEVICE wdfDevice)
 }
 
 
-VOID litepciedrv_ChannelRead(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length)
+NTSTATUS litepciedrv_MapUser(PVOID addr, SIZE_T length, MEMORY_CACHING_TYPE cacheType, BOOLEAN readOnly, PLITEPCIE_USER_MAP map)
 {
-    SIZE_T bytesRead = 0;
-    UINT32 overflows = 0;
-    WDFMEMORY outBuf;
-    NTSTATUS status;
+    // Must be called in the context of the process receiving the mapping
+    map->userAddr = NULL;
+    map->mdl = IoAllocateMdl(addr, (ULONG)length, FALSE, FALSE, NULL);
+    if (map->mdl == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "IoAllocateMdl failed for %llu bytes\n", (UINT64)length);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(map->mdl);
 
-    status = WdfRequestRetrieveOutputMemory(request, &outBuf);
-    if (!NT_SUCCESS(status))
+    __try
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-            "WdfRequestRetrieveOutputMemory failed %x\n", status);
-        WdfRequestCompleteWithInformation(request, status, 0);
-        return;
+        map->userAddr = MmMapLockedPagesSpecifyCache(map->mdl, UserMode, cacheType,
+            NULL, FALSE, NormalPagePriority | (readOnly ? MdlMappingNoWrite : 0));
     }
-    
-    while (bytesRead < length)
+    __except (EXCEPTION_EXECUTE_HANDLER)
     {
-        if ((length - bytesRead) < DMA_BUFFER_SIZE)
-        {
-            //Only allow reading in increments of DMA_BUFFER_SIZE
-            break;
-        }
+        map->userAddr = NULL;
+    }
 
-        // Get available buffers
-        // LITEPCIE DMA calls C2H channel the "writer"
-        WdfSpinLockAcquire(channel->dma.writerLock);
-        INT64 available_count = channel->dma.writer_hw_count - channel->dma.writer_sw_count;
-        WdfSpinLockRelease(channel->dma.writerLock);
+    if (map->userAddr == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "MmMapLockedPagesSpecifyCache failed\n");
+        IoFreeMdl(map->mdl);
+        map->mdl = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        if ((available_count) > 0)
-        {
-            if ((available_count) > (DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ))
-            {
-                overflows++;
-            }
+    //Handles can be duplicated or inherited, remember whose address space this is
+    map->process = PsGetCurrentProcess();
+    ObReferenceObject(map->process);
+
+    return STATUS_SUCCESS;
+}
+
+VOID litepciedrv_UnmapUser(PLITEPCIE_USER_MAP map)
+{
+    KAPC_STATE apcState;
+
+    if (map->mdl == NULL)
+        return;
 
-            WdfMemoryCopyFromBuffer(outBuf, bytesRead,
-                channel->dma.writer_handle[channel->dma.writer_sw_count % DMA_BUFFER_COUNT],
-                DMA_BUFFER_SIZE);
-            channel->dma.writer_sw_count += 1;
-            bytesRead += DMA_BUFFER_SIZE;
+    if (map->userAddr != NULL)
+    {
+        if (map->process == PsGetCurrentProcess())
+        {
+            MmUnmapLockedPages(map->userAddr, map->mdl);
         }
         else
         {
-            //Defer for more data
-            break;
+            //Cleanup or munmap from another process sharing the handle, the
+            //mapping lives in the owner's address space so unmap it there
+            KeStackAttachProcess(map->process, &apcState);
+            MmUnmapLockedPages(map->userAddr, map->mdl);
+            KeUnstackDetachProcess(&apcState);
         }
     }
+    IoFreeMdl(map->mdl);
+    ObDereferenceObject(map->process);
+    map->mdl = NULL;
+    map->userAddr = NULL;
+    map->process = NULL;
+}
 
-    if (overflows > 0)
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Overflow Error in ChannelRead: %d\n", overflows);
-    }
-
-    //if ((length - bytesRead) < DMA_BUFFER_SIZE)
-    if (bytesRead > 0)
-    {
-        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, bytesRead);
-        channel->dma.readRequest = NULL;
-        channel->dma.readRemainingBytes = 0;
-    }
-    else
-    {
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE, "ChannelRead deferred\n");
-        channel->dma.readRequest = request;
-        channel->dma.readRemainingBytes = length - bytesRead;
-    }
+static BOOLEAN litepciedrv_CheckGeometry(UINT32 size, UINT32 count, UINT32 perIrq)
+{
+    if (size == 0 || size > DMA_BUFFER_SIZE_MAX || (size % DMA_BUFFER_SIZE_ALIGN) != 0)
+        return FALSE;
+    // Power of 2 so the LOOP_STATUS fold in the DPC stays a mask
+    if (count < 2 || count > DMA_BUFFER_COUNT_MAX || (count & (count - 1)) != 0)
+        return FALSE;
+    if (perIrq == 0 || perIrq > count)
+        return FALSE;
+    return TRUE;
 }
 
-VOID litepciedrv_ChannelWrite(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length)
+static NTSTATUS litepciedrv_AllocRing(PDEVICE_CONTEXT dev, WDFCOMMONBUFFER* buffer,
+                                      UINT32 size, UINT32 count,
+                                      PVOID* handles, PHYSICAL_ADDRESS* addrs)
 {
-    SIZE_T bytesWritten = 0;
-    UINT32 overflows = 0;
-    WDFMEMORY inBuf;
+    WDFCOMMONBUFFER newBuffer;
     NTSTATUS status;
 
-    status = WdfRequestRetrieveInputMemory(request, &inBuf);
+    // Allocate first so a failure leaves the current ring untouched
+    status = WdfCommonBufferCreate(dev->dmaEnabler, (size_t)size * count,
+                                    WDF_NO_OBJECT_ATTRIBUTES, &newBuffer);
     if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-            "WdfRequestRetrieveInputMemory failed %x\n", status);
-        WdfRequestCompleteWithInformation(request, status, 0);
-        return;
+        return status;
+
+    PVOID virtAddr = WdfCommonBufferGetAlignedVirtualAddress(newBuffer);
+    PHYSICAL_ADDRESS physAddr = WdfCommonBufferGetAlignedLogicalAddress(newBuffer);
+    if (physAddr.QuadPart == 0) {
+        WdfObjectDelete(newBuffer);
+        return STATUS_NO_MEMORY;
+    }
+
+    if (*buffer != NULL)
+        WdfObjectDelete(*buffer);
+    *buffer = newBuffer;
+
+    /* for each dma buffer */
+    for (UINT32 j = 0; j < count; j++) {
+        handles[j] = (PVOID)((PUINT8)virtAddr + ((SIZE_T)j * size));
+        addrs[j].QuadPart = physAddr.QuadPart + ((LONGLONG)j * size);
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS litepciedrv_ChannelConfigure(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_config* config)
+{
+    PDEVICE_CONTEXT dev = channel->litepcie_dev;
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    WdfWaitLockAcquire(dev->configLock, NULL);
+
+    /* 0 keeps the current value */
+    if (config->writer_buf_size == 0) config->writer_buf_size = dmachan->writer_buf_size;
+    if (config->writer_buf_count == 0) config->writer_buf_count = dmachan->writer_buf_count;
+    if (config->writer_buf_per_irq == 0) config->writer_buf_per_irq = dmachan->writer_buf_per_irq;
+    if (config->reader_buf_size == 0) config->reader_buf_size = dmachan->reader_buf_size;
+    if (config->reader_buf_count == 0) config->reader_buf_count = dmachan->reader_buf_count;
+    if (config->reader_buf_per_irq == 0) config->reader_buf_per_irq = dmachan->reader_buf_per_irq;
+    if (config->mode == 0) config->mode = dmachan->mode;
+
+    if (config->mode != DMA_MODE_RING && config->mode != DMA_MODE_DIRECT)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
     }
-    while (bytesWritten < length)
+    if (!litepciedrv_CheckGeometry(config->writer_buf_size, config->writer_buf_count, config->writer_buf_per_irq) ||
+        !litepciedrv_CheckGeometry(config->reader_buf_size, config->reader_buf_count, config->reader_buf_per_irq))
     {
-        if ((length - bytesWritten) < DMA_BUFFER_SIZE)
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    /* rings can only change while idle and not mapped to user space */
+    if (dmachan->writer_enable || dmachan->reader_enable || dmachan->map_count > 0)
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    // LITEPCIE DMA calls C2H channel the "writer" and H2C channel the "reader"
+    if (dmachan->writeBuffer == NULL ||
+        config->writer_buf_size != dmachan->writer_buf_size ||
+        config->writer_buf_count != dmachan->writer_buf_count)
+    {
+        status = litepciedrv_AllocRing(dev, &dmachan->writeBuffer,
+            config->writer_buf_size, config->writer_buf_count,
+            dmachan->writer_handle, dmachan->writer_addr);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create Write Buffer for channel %d: %!STATUS!", channel->index, status);
+            goto Exit;
+        }
+        dmachan->writer_buf_size = config->writer_buf_size;
+        dmachan->writer_buf_count = config->writer_buf_count;
+    }
+    dmachan->writer_buf_per_irq = config->writer_buf_per_irq;
+
+    if (dmachan->readBuffer == NULL ||
+        config->reader_buf_size != dmachan->reader_buf_size ||
+        config->reader_buf_count != dmachan->reader_buf_count)
+    {
+        status = litepciedrv_AllocRing(dev, &dmachan->readBuffer,
+            config->reader_buf_size, config->reader_buf_count,
+            dmachan->reader_handle, dmachan->reader_addr);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Failed to create Read Buffer for channel %d: %!STATUS!", channel->index, status);
+            goto Exit;
+        }
+        dmachan->reader_buf_size = config->reader_buf_size;
+        dmachan->reader_buf_count = config->reader_buf_count;
+    }
+    dmachan->reader_buf_per_irq = config->reader_buf_per_irq;
+
+    dmachan->mode = config->mode;
+    channel->block_size = dmachan->writer_buf_size;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        "DMA%d mode %u writer %u x %u (irq/%u) reader %u x %u (irq/%u)", channel->index, dmachan->mode,
+        dmachan->writer_buf_count, dmachan->writer_buf_size, dmachan->writer_buf_per_irq,
+        dmachan->reader_buf_count, dmachan->reader_buf_size, dmachan->reader_buf_per_irq);
+
+Exit:
+    /* report the geometry in effect */
+    config->writer_buf_size = dmachan->writer_buf_size;
+    config->writer_buf_count = dmachan->writer_buf_count;
+    config->writer_buf_per_irq = dmachan->writer_buf_per_irq;
+    config->reader_buf_size = dmachan->reader_buf_size;
+    config->reader_buf_count = dmachan->reader_buf_count;
+    config->reader_buf_per_irq = dmachan->reader_buf_per_irq;
+    config->mode = dmachan->mode;
+
+    WdfWaitLockRelease(dev->configLock);
+    return status;
+}
+
+static SIZE_T litepciedrv_ChannelReadRequest(PLITEPCIE_CHAN channel, WDFREQUEST request)
+{
+    SIZE_T bytesRead = 0;
+    SIZE_T length;
+    UINT32 overflows = 0;
+    WDFMEMORY outBuf;
+    NTSTATUS status;
+
+    status = WdfRequestRetrieveOutputMemory(request, &outBuf);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            "WdfRequestRetrieveOutputMemory failed %x\n", status);
+        WdfRequestCompleteWithInformation(request, status, 0);
+        return 0;
+    }
+    PUINT8 dst = WdfMemoryGetBuffer(outBuf, &length);
+
+    while ((length - bytesRead) >= channel->dma.writer_buf_size)
+    {
+        // Get available buffers
+        // LITEPCIE DMA calls C2H channel the "writer"
+        INT64 available_count = ReadAcquire64(&channel->dma.writer_hw_count) -
+            ReadNoFence64(&channel->dma.writer_sw_count);
+
+        if ((available_count) <= 0)
         {
-            //Only allow writing in increments of DMA_BUFFER_SIZE
             break;
         }
+        if ((available_count) > (channel->dma.writer_buf_count - channel->dma.writer_buf_per_irq))
+        {
+            overflows++;
+        }
+
+        // Buffers are contiguous in the ring, copy at most two spans around the wrap
+        UINT32 count = (UINT32)min((UINT64)available_count, (length - bytesRead) / channel->dma.writer_buf_size);
+        UINT32 index = (UINT32)(channel->dma.writer_sw_count % channel->dma.writer_buf_count);
+        UINT32 first = min(count, channel->dma.writer_buf_count - index);
+
+        litepcie_copy(dst + bytesRead, channel->dma.writer_handle[index],
+            (SIZE_T)first * channel->dma.writer_buf_size);
+        if (count > first)
+        {
+            litepcie_copy(dst + bytesRead + (SIZE_T)first * channel->dma.writer_buf_size,
+                channel->dma.writer_handle[0], (SIZE_T)(count - first) * channel->dma.writer_buf_size);
+        }
+        WriteRelease64(&channel->dma.writer_sw_count, channel->dma.writer_sw_count + count);
+        bytesRead += (SIZE_T)count * channel->dma.writer_buf_size;
+    }
+
+    if (overflows > 0)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Overflow Error in ChannelRead: %d\n", overflows);
+    }
 
+    WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, bytesRead);
+    return bytesRead;
+}
+
+static SIZE_T litepciedrv_ChannelWriteRequest(PLITEPCIE_CHAN channel, WDFREQUEST request)
+{
+    SIZE_T bytesWritten = 0;
+    SIZE_T length;
+    UINT32 overflows = 0;
+    WDFMEMORY inBuf;
+    NTSTATUS status;
+
+    status = WdfRequestRetrieveInputMemory(request, &inBuf);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            "WdfRequestRetrieveInputMemory failed %x\n", status);
+        WdfRequestCompleteWithInformation(request, status, 0);
+        return 0;
+    }
+    PUINT8 src = WdfMemoryGetBuffer(inBuf, &length);
+
+    while ((length - bytesWritten) >= channel->dma.reader_buf_size)
+    {
         // Get available buffers
         // LITEPCIE DMA calls H2C channel the "reader"
-        WdfSpinLockAcquire(channel->dma.readerLock);
-        INT64 available_count = channel->dma.reader_hw_count - channel->dma.reader_sw_count;
-        WdfSpinLockRelease(channel->dma.readerLock);
+        INT64 available_count = ReadAcquire64(&channel->dma.reader_hw_count) -
+            ReadNoFence64(&channel->dma.reader_sw_count);
+
+        if ((available_count) <= 0)
+        {
+            break;
+        }
+        if ((available_count) > channel->dma.reader_buf_count)
+        {
+            overflows++;
+        }
+
+        // Buffers are contiguous in the ring, copy at most two spans around the wrap
+        UINT32 count = (UINT32)min((UINT64)available_count, (length - bytesWritten) / channel->dma.reader_buf_size);
+        UINT32 index = (UINT32)(channel->dma.reader_sw_count % channel->dma.reader_buf_count);
+        UINT32 first = min(count, channel->dma.reader_buf_count - index);
 
-        if ((available_count) > 0)
+        litepcie_copy(channel->dma.reader_handle[index], src + bytesWritten,
+            (SIZE_T)first * channel->dma.reader_buf_size);
+        if (count > first)
         {
-            if ((available_count) > DMA_BUFFER_COUNT)
+            litepcie_copy(channel->dma.reader_handle[0], src + bytesWritten + (SIZE_T)first * channel->dma.reader_buf_size,
+                (SIZE_T)(count - first) * channel->dma.reader_buf_size);
+        }
+        WriteRelease64(&channel->dma.reader_sw_count, channel->dma.reader_sw_count + count);
+        bytesWritten += (SIZE_T)count * channel->dma.reader_buf_size;
+    }
+
+    if (overflows > 0)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Overflow Error in ChannelWrite: %d\n", overflows);
+    }
+
+    WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, bytesWritten);
+    return bytesWritten;
+}
+
+static BOOLEAN litepcie_EvtProgramDma(
+    IN WDFDMATRANSACTION Transaction,
+    IN WDFDEVICE Device,
+    IN WDFCONTEXT Context,
+    IN WDF_DMA_DIRECTION Direction,
+    IN PSCATTER_GATHER_LIST SgList)
+{
+    UNREFERENCED_PARAMETER(Transaction);
+    PDEVICE_CONTEXT dev = DeviceGetContext(Device);
+    PLITEPCIE_CHAN channel = (PLITEPCIE_CHAN)Context;
+    UINT32 base = channel->dma.base;
+    UINT32 enableOffset, flushOffset, loopProgOffset, valueOffset, weOffset;
+    UINT32 i;
+
+    // LITEPCIE DMA calls C2H channel the "writer" and H2C channel the "reader"
+    if (Direction == WdfDmaDirectionReadFromDevice) {
+        enableOffset = PCIE_DMA_WRITER_ENABLE_OFFSET;
+        flushOffset = PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET;
+        loopProgOffset = PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET;
+        valueOffset = PCIE_DMA_WRITER_TABLE_VALUE_OFFSET;
+        weOffset = PCIE_DMA_WRITER_TABLE_WE_OFFSET;
+    }
+    else {
+        enableOffset = PCIE_DMA_READER_ENABLE_OFFSET;
+        flushOffset = PCIE_DMA_READER_TABLE_FLUSH_OFFSET;
+        loopProgOffset = PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET;
+        valueOffset = PCIE_DMA_READER_TABLE_VALUE_OFFSET;
+        weOffset = PCIE_DMA_READER_TABLE_WE_OFFSET;
+    }
+
+    if (SgList->NumberOfElements > DMA_BUFFER_COUNT_MAX) {
+        // Cannot happen with the enabler limits set in DeviceOpen
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "DMA%d SG list too long: %u\n",
+            channel->index, SgList->NumberOfElements);
+        return FALSE;
+    }
+
+    /* One-shot table: each element once, irq on the last one only. */
+    litepciedrv_RegWritel(dev, base + enableOffset, 0);
+    litepciedrv_RegWritel(dev, base + flushOffset, 1);
+    litepciedrv_RegWritel(dev, base + loopProgOffset, 0);
+    for (i = 0; i < SgList->NumberOfElements; i++)
+    {
+        BOOLEAN last = (i == SgList->NumberOfElements - 1);
+        /* Fill buffer size + parameters. */
+        litepciedrv_RegWritel(dev, base + valueOffset,
+#ifndef DMA_BUFFER_ALIGNED
+            (!last) * DMA_LAST_DISABLE |
+#endif
+            (!last) * DMA_IRQ_DISABLE |
+            SgList->Elements[i].Length);
+        /* Fill 32-bit Address LSB. */
+        litepciedrv_RegWritel(dev, base + valueOffset + 4, SgList->Elements[i].Address.LowPart);
+        /* Write descriptor (and fill 32-bit Address MSB for 64-bit mode). */
+        litepciedrv_RegWritel(dev, base + weOffset, SgList->Elements[i].Address.HighPart);
+    }
+    litepciedrv_RegWritel(dev, base + enableOffset, 1);
+
+    return TRUE;
+}
+
+//Called with the queue lock held, one transfer in flight per direction. A
+//request that cannot start is handed back in *failed, for the caller to
+//complete once the lock is released.
+static NTSTATUS litepciedrv_DirectStart(PLITEPCIE_CHAN channel, WDFQUEUE queue, WDFDMATRANSACTION transaction,
+                                        WDFREQUEST* active, WDF_DMA_DIRECTION direction, WDFREQUEST* failed)
+{
+    WDFREQUEST request;
+    NTSTATUS status;
+
+    *failed = NULL;
+    while (*active == NULL)
+    {
+        if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(queue, &request)))
+            break;
+
+        status = WdfDmaTransactionInitializeUsingRequest(transaction, request, litepcie_EvtProgramDma, direction);
+        if (NT_SUCCESS(status))
+        {
+            *active = request;
+            status = WdfDmaTransactionExecute(transaction, channel);
+            if (!NT_SUCCESS(status))
             {
-                overflows++;
+                WdfDmaTransactionRelease(transaction);
+                *active = NULL;
             }
+        }
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "DMA%d direct transfer failed %!STATUS!\n",
+                channel->index, status);
+            *failed = request;
+            return status;
+        }
+    }
+    return STATUS_SUCCESS;
+}
 
-            WdfMemoryCopyToBuffer(inBuf, bytesWritten,
-                channel->dma.reader_handle[channel->dma.reader_sw_count % DMA_BUFFER_COUNT],
-                DMA_BUFFER_SIZE);
-            channel->dma.reader_sw_count += 1;
-            bytesWritten += DMA_BUFFER_SIZE;
+static VOID litepciedrv_DirectComplete(WDFSPINLOCK lock, WDFDMATRANSACTION transaction, WDFREQUEST* active, BOOLEAN abort)
+{
+    WDFREQUEST request = NULL;
+    SIZE_T bytes = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    WdfSpinLockAcquire(lock);
+    if (*active != NULL)
+    {
+        BOOLEAN done;
+        if (abort)
+        {
+            done = WdfDmaTransactionDmaCompletedFinal(transaction, 0, &status);
+            status = STATUS_CANCELLED;
         }
         else
         {
+            // FALSE means the framework programmed the next part of the transfer
+            done = WdfDmaTransactionDmaCompleted(transaction, &status);
+        }
+        if (done)
+        {
+            request = *active;
+            bytes = abort ? 0 : WdfDmaTransactionGetBytesTransferred(transaction);
+            WdfDmaTransactionRelease(transaction);
+            *active = NULL;
+        }
+    }
+    WdfSpinLockRelease(lock);
+
+    if (request != NULL)
+    {
+        WdfRequestCompleteWithInformation(request, status, bytes);
+    }
+}
+
+static VOID litepciedrv_StatAdd(volatile LONG64* count, volatile LONG64* total, volatile LONG64* max, LONG64 ticks)
+{
+    LONG64 old;
+
+    InterlockedIncrement64(count);
+    InterlockedAdd64(total, ticks);
+    do {
+        old = ReadNoFence64(max);
+        if (ticks <= old)
+            break;
+    } while (InterlockedCompareExchange64(max, ticks, old) != old);
+}
+
+static VOID litepciedrv_CopyKick(PDEVICE_CONTEXT dev, UINT32 work)
+{
+    InterlockedOr(&dev->copyPending, (LONG)(1u << work));
+    KeSetEvent(&dev->copyEvent, IO_NO_INCREMENT, FALSE);
+}
+
+//Copy worker only: complete queued reads in arrival order while buffers are ready
+static VOID litepciedrv_ChannelReadCopy(PLITEPCIE_CHAN channel)
+{
+    WDFREQUEST request;
+
+    while (ReadAcquire64(&channel->dma.writer_hw_count) - ReadNoFence64(&channel->dma.writer_sw_count) > 0)
+    {
+        if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(channel->dma.readQueue, &request)))
             break;
+        litepciedrv_ChannelReadRequest(channel, request);
+    }
+}
+
+VOID litepciedrv_ChannelReadDrain(PLITEPCIE_CHAN channel)
+{
+    if (channel->dma.mode == DMA_MODE_DIRECT)
+    {
+        WDFREQUEST failed;
+        NTSTATUS status = STATUS_SUCCESS;
+
+        do
+        {
+            failed = NULL;
+            WdfSpinLockAcquire(channel->dma.readQueueLock);
+            if (channel->dma.writer_enable)
+            {
+                status = litepciedrv_DirectStart(channel, channel->dma.readQueue, channel->dma.readTransaction,
+                    &channel->dma.readActive, WdfDmaDirectionReadFromDevice, &failed);
+            }
+            WdfSpinLockRelease(channel->dma.readQueueLock);
+            //Completion runs the caller's completion routines, never under the queue lock
+            if (failed != NULL)
+            {
+                WdfRequestCompleteWithInformation(failed, status, 0);
+            }
+        } while (failed != NULL);
+        return;
+    }
+
+    // Ring copies run on the copy worker, at passive level
+    litepciedrv_CopyKick(channel->litepcie_dev, channel->index * 2 + 0);
+}
+
+//Copy worker only: complete queued writes in arrival order while buffers are free
+static VOID litepciedrv_ChannelWriteCopy(PLITEPCIE_CHAN channel)
+{
+    WDFREQUEST request;
+
+    while (ReadAcquire64(&channel->dma.reader_hw_count) - ReadNoFence64(&channel->dma.reader_sw_count) > 0)
+    {
+        if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(channel->dma.writeQueue, &request)))
+            break;
+        litepciedrv_ChannelWriteRequest(channel, request);
+    }
+}
+
+VOID litepciedrv_ChannelWriteDrain(PLITEPCIE_CHAN channel)
+{
+    if (channel->dma.mode == DMA_MODE_DIRECT)
+    {
+        WDFREQUEST failed;
+        NTSTATUS status = STATUS_SUCCESS;
+
+        do
+        {
+            failed = NULL;
+            WdfSpinLockAcquire(channel->dma.writeQueueLock);
+            if (channel->dma.reader_enable)
+            {
+                status = litepciedrv_DirectStart(channel, channel->dma.writeQueue, channel->dma.writeTransaction,
+                    &channel->dma.writeActive, WdfDmaDirectionWriteToDevice, &failed);
+            }
+            WdfSpinLockRelease(channel->dma.writeQueueLock);
+            //Completion runs the caller's completion routines, never under the queue lock
+            if (failed != NULL)
+            {
+                WdfRequestCompleteWithInformation(failed, status, 0);
+            }
+        } while (failed != NULL);
+        return;
+    }
+
+    // Ring copies run on the copy worker, at passive level
+    litepciedrv_CopyKick(channel->litepcie_dev, channel->index * 2 + 1);
+}
+
+static VOID litepciedrv_CopyWorker(PVOID context)
+{
+    PDEVICE_CONTEXT dev = (PDEVICE_CONTEXT)context;
+    LONG pending;
+    LARGE_INTEGER start;
+
+    if (dev->copyAffinity != 0)
+    {
+        KeSetSystemAffinityThreadEx(dev->copyAffinity);
+    }
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    for (;;)
+    {
+        KeWaitForSingleObject(&dev->copyEvent, Executive, KernelMode, FALSE, NULL);
+        if (ReadAcquire(&dev->copyStop))
+            break;
+
+        start = KeQueryPerformanceCounter(NULL);
+        while ((pending = InterlockedExchange(&dev->copyPending, 0)) != 0)
+        {
+            for (UINT32 i = 0; i < dev->channels; i++)
+            {
+                if (pending & (1 << (i * 2)))
+                    litepciedrv_ChannelReadCopy(&dev->chan[i]);
+                if (pending & (1 << (i * 2 + 1)))
+                    litepciedrv_ChannelWriteCopy(&dev->chan[i]);
+            }
         }
+        litepciedrv_StatAdd(&dev->copy_count, &dev->copy_ticks_total, &dev->copy_ticks_max,
+            KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart);
     }
 
-    if (overflows > 0)
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static NTSTATUS litepciedrv_CopyWorkerStart(PDEVICE_CONTEXT dev)
+{
+    HANDLE thread;
+    NTSTATUS status;
+
+    KeInitializeEvent(&dev->copyEvent, SynchronizationEvent, FALSE);
+    dev->copyPending = 0;
+    dev->copyStop = 0;
+
+    status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL, litepciedrv_CopyWorker, dev);
+    if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Overflow Error in ChannelWrite: %d\n", overflows);
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "PsCreateSystemThread failed: %!STATUS!", status);
+        return status;
+    }
+    status = ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID*)&dev->copyThread, NULL);
+    ZwClose(thread);
+    return status;
+}
+
+static VOID litepciedrv_CopyWorkerStop(PDEVICE_CONTEXT dev)
+{
+    if (dev->copyThread == NULL)
+        return;
+
+    WriteRelease(&dev->copyStop, 1);
+    KeSetEvent(&dev->copyEvent, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(dev->copyThread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(dev->copyThread);
+    dev->copyThread = NULL;
+}
+
+VOID litepciedrv_GetStats(PDEVICE_CONTEXT dev, struct litepcie_ioctl_stats* stats)
+{
+    BOOLEAN reset = stats->reset;
+    LARGE_INTEGER frequency;
+    LONG64 now;
+
+    KeQueryPerformanceCounter(&frequency);
+    stats->qpc_frequency = frequency.QuadPart;
+    stats->dpc_count = ReadNoFence64(&dev->dpc_count);
+    stats->dpc_ticks_total = ReadNoFence64(&dev->dpc_ticks_total);
+    stats->dpc_ticks_max = ReadNoFence64(&dev->dpc_ticks_max);
+    stats->copy_count = ReadNoFence64(&dev->copy_count);
+    stats->copy_ticks_total = ReadNoFence64(&dev->copy_ticks_total);
+    stats->copy_ticks_max = ReadNoFence64(&dev->copy_ticks_max);
+
+    //Time in the current mode counts up to now
+    now = KeQueryPerformanceCounter(NULL).QuadPart;
+    stats->channels = min(dev->channels, LITEPCIE_STATS_CHANNELS_MAX);
+    for (UINT32 i = 0; i < stats->channels; i++)
+    {
+        struct litepcie_dma_chan* dmachan = &dev->chan[i].dma;
+        LONG64 current = now - ReadNoFence64(&dmachan->mode_since);
+        BOOLEAN polling = ReadNoFence(&dmachan->poll_active) != 0;
+
+        stats->chan[i].irq_ticks = ReadNoFence64(&dmachan->irq_ticks) + (polling ? 0 : current);
+        stats->chan[i].poll_ticks = ReadNoFence64(&dmachan->poll_ticks) + (polling ? current : 0);
+        stats->chan[i].poll_entries = ReadNoFence64(&dmachan->poll_entries);
+        stats->chan[i].polls = ReadNoFence64(&dmachan->polls);
     }
 
-    //if ((length - bytesWritten) < DMA_BUFFER_SIZE)
-    if (bytesWritten > 0)
+    if (reset)
     {
-        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, bytesWritten);
-        channel->dma.writeRequest = NULL;
-        channel->dma.writeRemainingBytes = 0;
+        InterlockedExchange64(&dev->dpc_count, 0);
+        InterlockedExchange64(&dev->dpc_ticks_total, 0);
+        InterlockedExchange64(&dev->dpc_ticks_max, 0);
+        InterlockedExchange64(&dev->copy_count, 0);
+        InterlockedExchange64(&dev->copy_ticks_total, 0);
+        InterlockedExchange64(&dev->copy_ticks_max, 0);
+        for (UINT32 i = 0; i < dev->channels; i++)
+        {
+            struct litepcie_dma_chan* dmachan = &dev->chan[i].dma;
+            InterlockedExchange64(&dmachan->mode_since, now);
+            InterlockedExchange64(&dmachan->irq_ticks, 0);
+            InterlockedExchange64(&dmachan->poll_ticks, 0);
+            InterlockedExchange64(&dmachan->poll_entries, 0);
+            InterlockedExchange64(&dmachan->polls, 0);
+        }
     }
-    else
+}
+
+VOID litepciedrv_GetInfo(PDEVICE_CONTEXT dev, struct litepcie_ioctl_info* info)
+{
+    RtlZeroMemory(info, sizeof(struct litepcie_ioctl_info));
+    RtlCopyMemory(info->identifier, dev->identifier, sizeof(info->identifier));
+#ifdef CSR_DNA_BASE
+    info->dna = dev->dna;
+    info->flags |= LITEPCIE_INFO_DNA;
+#endif
+    info->channels = dev->channels;
+    info->irqs = dev->irqs;
+
+    //Link and sensors can change, read them now
+#ifdef CSR_PCIE_ENDPOINT_PHY_LINK_STATUS_ADDR
+    info->link_status = litepciedrv_RegReadl(dev, CSR_PCIE_ENDPOINT_PHY_LINK_STATUS_ADDR);
+    info->max_payload_size = litepciedrv_RegReadl(dev, CSR_PCIE_ENDPOINT_PHY_MAX_PAYLOAD_SIZE_ADDR);
+    info->max_request_size = litepciedrv_RegReadl(dev, CSR_PCIE_ENDPOINT_PHY_MAX_REQUEST_SIZE_ADDR);
+    info->flags |= LITEPCIE_INFO_LINK;
+#endif
+#ifdef CSR_XADC_BASE
+    info->xadc_temperature = litepciedrv_RegReadl(dev, CSR_XADC_TEMPERATURE_ADDR);
+    info->xadc_vccint = litepciedrv_RegReadl(dev, CSR_XADC_VCCINT_ADDR);
+    info->xadc_vccaux = litepciedrv_RegReadl(dev, CSR_XADC_VCCAUX_ADDR);
+    info->xadc_vccbram = litepciedrv_RegReadl(dev, CSR_XADC_VCCBRAM_ADDR);
+    info->flags |= LITEPCIE_INFO_XADC;
+#endif
+
+    //Geometry is changed under configLock by LITEPCIE_IOCTL_DMA_CONFIG
+    WdfWaitLockAcquire(dev->configLock, NULL);
+    for (UINT32 i = 0; i < dev->channels && i < LITEPCIE_INFO_CHANNELS_MAX; i++)
     {
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE, "ChannelWrite deferred\n");
-        channel->dma.writeRequest = request;
-        channel->dma.writeRemainingBytes = length - bytesWritten;
+        struct litepcie_dma_chan* dmachan = &dev->chan[i].dma;
+        info->channel[i].writer_buf_size = dmachan->writer_buf_size;
+        info->channel[i].writer_buf_count = dmachan->writer_buf_count;
+        info->channel[i].writer_buf_per_irq = dmachan->writer_buf_per_irq;
+        info->channel[i].reader_buf_size = dmachan->reader_buf_size;
+        info->channel[i].reader_buf_count = dmachan->reader_buf_count;
+        info->channel[i].reader_buf_per_irq = dmachan->reader_buf_per_irq;
+        info->channel[i].mode = dmachan->mode;
     }
+    WdfWaitLockRelease(dev->configLock);
 }
 
-VOID litepcie_dma_writer_start(PDEVICE_CONTEXT dev, UINT32 index)
+VOID litepciedrv_ChannelFlush(WDFQUEUE queue, WDFFILEOBJECT fileObject)
 {
-    struct litepcie_dma_chan* dmachan;
-    UINT32 i;
+    WDFREQUEST request;
 
-    dmachan = &dev->chan[index].dma;
+    // Cancel deferred requests, either all of them or those of one file
+    for (;;)
+    {
+        NTSTATUS status = (fileObject != NULL) ?
+            WdfIoQueueRetrieveRequestByFileObject(queue, fileObject, &request) :
+            WdfIoQueueRetrieveNextRequest(queue, &request);
+        if (!NT_SUCCESS(status))
+            break;
+        WdfRequestCompleteWithInformation(request, STATUS_CANCELLED, 0);
+    }
+}
+
+VOID litepciedrv_ChannelRead(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length)
+{
+    NTSTATUS status;
+
+    if ((channel->dma.mode == DMA_MODE_DIRECT) ?
+        (length == 0 || (length % DMA_BUFFER_SIZE_ALIGN) != 0) :
+        (length < channel->dma.writer_buf_size))
+    {
+        //Only allow reading in increments of the buffer size (ring) or alignment (direct)
+        WdfRequestCompleteWithInformation(request, STATUS_INVALID_BUFFER_SIZE, 0);
+        return;
+    }
+
+    status = WdfRequestForwardToIoQueue(request, channel->dma.readQueue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            "WdfRequestForwardToIoQueue failed %!STATUS!\n", status);
+        WdfRequestCompleteWithInformation(request, status, 0);
+        return;
+    }
+
+    litepciedrv_ChannelReadDrain(channel);
+}
+
+VOID litepciedrv_ChannelWrite(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length)
+{
+    NTSTATUS status;
+
+    if ((channel->dma.mode == DMA_MODE_DIRECT) ?
+        (length == 0 || (length % DMA_BUFFER_SIZE_ALIGN) != 0) :
+        (length < channel->dma.reader_buf_size))
+    {
+        //Only allow writing in increments of the buffer size (ring) or alignment (direct)
+        WdfRequestCompleteWithInformation(request, STATUS_INVALID_BUFFER_SIZE, 0);
+        return;
+    }
+
+    status = WdfRequestForwardToIoQueue(request, channel->dma.writeQueue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            "WdfRequestForwardToIoQueue failed %!STATUS!\n", status);
+        WdfRequestCompleteWithInformation(request, status, 0);
+        return;
+    }
+
+    litepciedrv_ChannelWriteDrain(channel);
+}
+
+//Load the writer descriptor table, starting with ring buffer first so a
+//reload can resume where the engine stopped. Table entry i raises an MSI
+//every writer_buf_per_irq entries.
+static VOID litepcie_dma_writer_fill(PDEVICE_CONTEXT dev, struct litepcie_dma_chan* dmachan, UINT32 first)
+{
+    UINT32 i, buf;
 
-    /* Fill DMA Writer descriptors. */
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 0);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET, 1);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET, 0);
-    for (i = 0; i < DMA_BUFFER_COUNT; i++)
+    for (i = 0; i < dmachan->writer_buf_count; i++)
     {
+        buf = (first + i) % dmachan->writer_buf_count;
         /* Fill buffer size + parameters. */
         litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_VALUE_OFFSET,
 #ifndef DMA_BUFFER_ALIGNED
             DMA_LAST_DISABLE |
 #endif
-            (!(i % DMA_BUFFER_PER_IRQ == 0)) * DMA_IRQ_DISABLE | /* generate an msi */
-            DMA_BUFFER_SIZE);                                  /* every n buffers */
+            (!(i % dmachan->writer_buf_per_irq == 0)) * DMA_IRQ_DISABLE | /* generate an msi */
+            dmachan->writer_buf_size);                                  /* every n buffers */
         /* Fill 32-bit Address LSB. */
-        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_VALUE_OFFSET + 4, dmachan->writer_addr[i].LowPart);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_VALUE_OFFSET + 4, dmachan->writer_addr[buf].LowPart);
         /* Write descriptor (and fill 32-bit Address MSB for 64-bit mode). */
-        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_WE_OFFSET, dmachan->writer_addr[i].HighPart);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_WE_OFFSET, dmachan->writer_addr[buf].HighPart);
     }
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET, 1);
+}
+
+VOID litepcie_dma_writer_start(PDEVICE_CONTEXT dev, UINT32 index)
+{
+    struct litepcie_dma_chan* dmachan;
+
+    dmachan = &dev->chan[index].dma;
+
+    if (dmachan->mode == DMA_MODE_DIRECT) {
+        /* Table is programmed per transfer by litepcie_EvtProgramDma. */
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 0);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET, 1);
+        return;
+    }
+
+    /* Fill DMA Writer descriptors. */
+    litepcie_dma_writer_fill(dev, dmachan, 0);
 
     /* Clear counters. */
-    dmachan->writer_hw_count = 0;
-    dmachan->writer_hw_count_last = 0;
-    dmachan->writer_sw_count = 0;
+    WdfSpinLockAcquire(dmachan->foldLock);
+    InterlockedExchange64(&dmachan->writer_hw_count, 0);
+    dmachan->writer_hw_base = 0;
+    WriteRelease64(&dmachan->writer_sw_count, 0);
+    WriteRelease64(&dmachan->shm_status->writer_hw_count, 0);
+    WriteRelease64(&dmachan->shm_doorbell->writer_sw_count, 0);
+    WdfSpinLockRelease(dmachan->foldLock);
 
     /* Start DMA Writer. */
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 1);
@@ -548,44 +1652,71 @@ VOID litepcie_dma_writer_stop(PDEVICE_CONTEXT dev, UINT32 index)
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 0);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET, 1);
 
+    /* Cancel the direct mode transfer in flight, if any. */
+    litepciedrv_DirectComplete(dmachan->readQueueLock, dmachan->readTransaction, &dmachan->readActive, TRUE);
 
     /* Clear counters. */
-    dmachan->writer_hw_count = 0;
-    dmachan->writer_hw_count_last = 0;
-    dmachan->writer_sw_count = 0;
+    WdfSpinLockAcquire(dmachan->foldLock);
+    InterlockedExchange64(&dmachan->writer_hw_count, 0);
+    dmachan->writer_hw_base = 0;
+    WriteRelease64(&dmachan->writer_sw_count, 0);
+    WriteRelease64(&dmachan->shm_status->writer_hw_count, 0);
+    WriteRelease64(&dmachan->shm_doorbell->writer_sw_count, 0);
+    WdfSpinLockRelease(dmachan->foldLock);
 }
 
-VOID litepcie_dma_reader_start(PDEVICE_CONTEXT dev, UINT32 index)
+//Load the reader descriptor table, starting with ring buffer first so a
+//reload can resume where the engine stopped. Table entry i raises an MSI
+//every reader_buf_per_irq entries.
+static VOID litepcie_dma_reader_fill(PDEVICE_CONTEXT dev, struct litepcie_dma_chan* dmachan, UINT32 first)
 {
-    struct litepcie_dma_chan* dmachan;
-    UINT32 i;
-
-    dmachan = &dev->chan[index].dma;
+    UINT32 i, buf;
 
-    /* Fill DMA Reader descriptors. */
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 0);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_FLUSH_OFFSET, 1);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET, 0);
-    for (i = 0; i < DMA_BUFFER_COUNT; i++)
+    for (i = 0; i < dmachan->reader_buf_count; i++)
     {
+        buf = (first + i) % dmachan->reader_buf_count;
         /* Fill buffer size + parameters. */
         litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_VALUE_OFFSET,
 #ifndef DMA_BUFFER_ALIGNED
             DMA_LAST_DISABLE |
 #endif
-            (!(i % DMA_BUFFER_PER_IRQ == 0)) * DMA_IRQ_DISABLE | /* generate an msi */
-            DMA_BUFFER_SIZE);                                  /* every n buffers */
+            (!(i % dmachan->reader_buf_per_irq == 0)) * DMA_IRQ_DISABLE | /* generate an msi */
+            dmachan->reader_buf_size);                                  /* every n buffers */
         /* Fill 32-bit Address LSB. */
-        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_VALUE_OFFSET + 4, dmachan->reader_addr[i].LowPart);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_VALUE_OFFSET + 4, dmachan->reader_addr[buf].LowPart);
         /* Write descriptor (and fill 32-bit Address MSB for 64-bit mode). */
-        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_WE_OFFSET, dmachan->reader_addr[i].HighPart);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_WE_OFFSET, dmachan->reader_addr[buf].HighPart);
     }
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET, 1);
+}
+
+VOID litepcie_dma_reader_start(PDEVICE_CONTEXT dev, UINT32 index)
+{
+    struct litepcie_dma_chan* dmachan;
+
+    dmachan = &dev->chan[index].dma;
+
+    if (dmachan->mode == DMA_MODE_DIRECT) {
+        /* Table is programmed per transfer by litepcie_EvtProgramDma. */
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 0);
+        litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_FLUSH_OFFSET, 1);
+        return;
+    }
+
+    /* Fill DMA Reader descriptors. */
+    litepcie_dma_reader_fill(dev, dmachan, 0);
 
     /* clear counters */
-    dmachan->reader_hw_count = 0;
-    dmachan->reader_hw_count_last = 0;
-    dmachan->reader_sw_count = 0;
+    WdfSpinLockAcquire(dmachan->foldLock);
+    InterlockedExchange64(&dmachan->reader_hw_count, 0);
+    dmachan->reader_hw_base = 0;
+    WriteRelease64(&dmachan->reader_sw_count, 0);
+    WriteRelease64(&dmachan->shm_status->reader_hw_count, 0);
+    WriteRelease64(&dmachan->shm_doorbell->reader_sw_count, 0);
+    WdfSpinLockRelease(dmachan->foldLock);
 
     /* start dma reader */
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 1);
@@ -604,25 +1735,446 @@ VOID litepcie_dma_reader_stop(PDEVICE_CONTEXT dev, UINT32 index)
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 0);
     litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_TABLE_FLUSH_OFFSET, 1);
 
+    /* Cancel the direct mode transfer in flight, if any. */
+    litepciedrv_DirectComplete(dmachan->writeQueueLock, dmachan->writeTransaction, &dmachan->writeActive, TRUE);
+
     /* Clear counters. */
-    dmachan->reader_hw_count = 0;
-    dmachan->reader_hw_count_last = 0;
-    dmachan->reader_sw_count = 0;
+    WdfSpinLockAcquire(dmachan->foldLock);
+    InterlockedExchange64(&dmachan->reader_hw_count, 0);
+    dmachan->reader_hw_base = 0;
+    WriteRelease64(&dmachan->reader_sw_count, 0);
+    WriteRelease64(&dmachan->shm_status->reader_hw_count, 0);
+    WriteRelease64(&dmachan->shm_doorbell->reader_sw_count, 0);
+    WdfSpinLockRelease(dmachan->foldLock);
 }
 
-VOID litepcie_enable_interrupt(PDEVICE_CONTEXT dev, UINT32 interrupt)
+//Stamp the buffers a fold moved hw_count over, at most one ring's worth
+static VOID litepciedrv_Stamp(volatile INT64* ts, UINT32 buf_count, INT64 from, INT64 to)
+{
+    LONG64 now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    if (to - from > buf_count)
+        from = to - buf_count;
+    for (; from < to; from++)
+        WriteNoFence64(&ts[from % buf_count], now);
+}
+
+//Fold the current LOOP_STATUS of a ring into hw_count and publish it,
+//timestamps first so a reader of the count finds them in place. Caller
+//holds foldLock: the DPC, the poll timer, refreshes and reloads all fold,
+//and the published count must neither go back nor overtake its stamps.
+static INT64 litepciedrv_WriterFoldLocked(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    INT64 prev, count;
+
+    prev = ReadAcquire64(&dmachan->writer_hw_count);
+    count = litepciedrv_FoldHwCount(&dmachan->writer_hw_count, dmachan->writer_hw_base, dmachan->writer_buf_count,
+        litepciedrv_RegReadl(channel->litepcie_dev, dmachan->base + PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET));
+    litepciedrv_Stamp(dmachan->shm_status->writer_ts, dmachan->writer_buf_count, prev, count);
+    WriteRelease64(&dmachan->shm_status->writer_hw_count, count);
+    return count;
+}
+
+static INT64 litepciedrv_ReaderFoldLocked(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    INT64 prev, count;
+
+    prev = ReadAcquire64(&dmachan->reader_hw_count);
+    count = litepciedrv_FoldHwCount(&dmachan->reader_hw_count, dmachan->reader_hw_base, dmachan->reader_buf_count,
+        litepciedrv_RegReadl(channel->litepcie_dev, dmachan->base + PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET));
+    litepciedrv_Stamp(dmachan->shm_status->reader_ts, dmachan->reader_buf_count, prev, count);
+    WriteRelease64(&dmachan->shm_status->reader_hw_count, count);
+    return count;
+}
+
+static INT64 litepciedrv_WriterFold(PLITEPCIE_CHAN channel)
+{
+    INT64 count;
+
+    WdfSpinLockAcquire(channel->dma.foldLock);
+    count = litepciedrv_WriterFoldLocked(channel);
+    WdfSpinLockRelease(channel->dma.foldLock);
+    return count;
+}
+
+static INT64 litepciedrv_ReaderFold(PLITEPCIE_CHAN channel)
+{
+    INT64 count;
+
+    WdfSpinLockAcquire(channel->dma.foldLock);
+    count = litepciedrv_ReaderFoldLocked(channel);
+    WdfSpinLockRelease(channel->dma.foldLock);
+    return count;
+}
+
+//Zero-copy users publish their progress through the doorbell page and may
+//never call the status ioctls, so the DPC and the poll timer follow it too.
+//Under foldLock so a stale doorbell cannot land after start or stop clears.
+VOID litepciedrv_ChannelDoorbell(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+
+    if (ReadNoFence(&dmachan->doorbell_count) == 0)
+        return;
+
+    WdfSpinLockAcquire(dmachan->foldLock);
+    WriteRelease64(&dmachan->writer_sw_count, ReadAcquire64(&dmachan->shm_doorbell->writer_sw_count));
+    WriteRelease64(&dmachan->reader_sw_count, ReadAcquire64(&dmachan->shm_doorbell->reader_sw_count));
+    WdfSpinLockRelease(dmachan->foldLock);
+}
+
+//Close the time spent in the current mode
+static VOID litepciedrv_PollAccount(struct litepcie_dma_chan* dmachan, BOOLEAN polling)
+{
+    LONG64 now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    InterlockedAdd64(polling ? &dmachan->poll_ticks : &dmachan->irq_ticks,
+        now - InterlockedExchange64(&dmachan->mode_since, now));
+}
+
+//Back to MSIs, from the poll timer or a reconfiguration
+static VOID litepciedrv_PollLeave(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+
+    litepciedrv_PollAccount(dmachan, TRUE);
+    dmachan->poll_last_time = KeQueryPerformanceCounter(NULL).QuadPart;
+    InterlockedExchange(&dmachan->poll_active, 0);
+    if (dmachan->writer_enable)
+        litepcie_enable_interrupt(channel->litepcie_dev, dmachan->writer_interrupt);
+    if (dmachan->reader_enable)
+        litepcie_enable_interrupt(channel->litepcie_dev, dmachan->reader_interrupt);
+}
+
+//DPC: switch to polling once both directions together exceed poll_enter
+//buffers per poll period. Concurrent DPCs of the two directions only race
+//on the rate window, the switch itself is interlocked.
+static VOID litepciedrv_PollCheck(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    LARGE_INTEGER frequency;
+    LONG64 now, elapsed, period;
+    INT64 count, progress;
+
+    if (dmachan->poll_mode != DMA_POLL_ADAPTIVE ||
+        ReadNoFence(&dmachan->poll_active) || ReadNoFence(&dmachan->poll_stop))
+        return;
+
+    now = KeQueryPerformanceCounter(&frequency).QuadPart;
+    period = frequency.QuadPart * dmachan->poll_period_us / 1000000;
+    elapsed = now - dmachan->poll_last_time;
+    if (elapsed < period)
+        return;
+
+    count = ReadAcquire64(&dmachan->writer_hw_count) + ReadAcquire64(&dmachan->reader_hw_count);
+    progress = count - dmachan->poll_last_count;
+    dmachan->poll_last_count = count;
+    dmachan->poll_last_time = now;
+    if (progress * period < (INT64)dmachan->poll_enter * elapsed)
+        return;
+
+    if (InterlockedCompareExchange(&dmachan->poll_active, 1, 0) != 0)
+        return;
+    litepciedrv_PollAccount(dmachan, FALSE);
+    InterlockedIncrement64(&dmachan->poll_entries);
+    litepcie_disable_interrupt(channel->litepcie_dev, dmachan->writer_interrupt);
+    litepcie_disable_interrupt(channel->litepcie_dev, dmachan->reader_interrupt);
+    WdfTimerStart(dmachan->pollTimer, WDF_REL_TIMEOUT_IN_US(dmachan->poll_period_us));
+}
+
+static VOID litepciedrv_EvtPollTimer(WDFTIMER timer)
+{
+    PLITEPCIE_CHAN channel = PollTimerGetContext(timer)->channel;
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    INT64 count = 0, progress;
+
+    if (ReadAcquire(&dmachan->poll_stop))
+        return;
+
+    InterlockedIncrement64(&dmachan->polls);
+    if (dmachan->mode == DMA_MODE_RING)
+    {
+        litepciedrv_ChannelDoorbell(channel);
+        if (dmachan->writer_enable)
+        {
+            count += litepciedrv_WriterFold(channel);
+            litepciedrv_ChannelReadDrain(channel);
+        }
+        if (dmachan->reader_enable)
+        {
+            count += litepciedrv_ReaderFold(channel);
+            litepciedrv_ChannelWriteDrain(channel);
+        }
+    }
+    progress = count - dmachan->poll_last_count;
+    dmachan->poll_last_count = count;
+
+    if (progress >= dmachan->poll_exit)
+    {
+        WdfTimerStart(timer, WDF_REL_TIMEOUT_IN_US(dmachan->poll_period_us));
+        return;
+    }
+    //Light traffic, the MSIs report progress again
+    litepciedrv_PollLeave(channel);
+}
+
+//Keep the poll timer from running while the channel is reconfigured. The
+//timer is stopped twice: a callback that missed poll_stop may re-arm once.
+static VOID litepciedrv_PollPause(PLITEPCIE_CHAN channel)
+{
+    InterlockedExchange(&channel->dma.poll_stop, 1);
+    WdfTimerStop(channel->dma.pollTimer, TRUE);
+    WdfTimerStop(channel->dma.pollTimer, TRUE);
+}
+
+static VOID litepciedrv_PollResume(PLITEPCIE_CHAN channel)
+{
+    InterlockedExchange(&channel->dma.poll_stop, 0);
+    if (ReadNoFence(&channel->dma.poll_active))
+        WdfTimerStart(channel->dma.pollTimer, WDF_REL_TIMEOUT_IN_US(channel->dma.poll_period_us));
+}
+
+NTSTATUS litepciedrv_ChannelPoll(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_poll* poll)
+{
+    PDEVICE_CONTEXT dev = channel->litepcie_dev;
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    WdfWaitLockAcquire(dev->configLock, NULL);
+
+    /* 0 keeps the current value */
+    if (poll->mode == 0) poll->mode = dmachan->poll_mode;
+    if (poll->period_us == 0) poll->period_us = dmachan->poll_period_us;
+    if (poll->enter_buffers == 0) poll->enter_buffers = dmachan->poll_enter;
+    if (poll->exit_buffers == 0) poll->exit_buffers = dmachan->poll_exit;
+
+    if ((poll->mode != DMA_POLL_IRQ && poll->mode != DMA_POLL_ADAPTIVE) ||
+        poll->period_us < DMA_POLL_PERIOD_MIN_US || poll->period_us > DMA_POLL_PERIOD_MAX_US ||
+        poll->exit_buffers >= poll->enter_buffers)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    litepciedrv_PollPause(channel);
+    dmachan->poll_mode = poll->mode;
+    dmachan->poll_period_us = poll->period_us;
+    dmachan->poll_enter = poll->enter_buffers;
+    dmachan->poll_exit = poll->exit_buffers;
+    if (dmachan->poll_mode == DMA_POLL_IRQ && ReadNoFence(&dmachan->poll_active))
+    {
+        litepciedrv_PollLeave(channel);
+    }
+    litepciedrv_PollResume(channel);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "DMA%d poll mode %u every %u us, enter %u exit %u",
+        channel->index, dmachan->poll_mode, dmachan->poll_period_us, dmachan->poll_enter, dmachan->poll_exit);
+
+Exit:
+    /* report the settings in effect */
+    poll->mode = dmachan->poll_mode;
+    poll->period_us = dmachan->poll_period_us;
+    poll->enter_buffers = dmachan->poll_enter;
+    poll->exit_buffers = dmachan->poll_exit;
+
+    WdfWaitLockRelease(dev->configLock);
+    return status;
+}
+
+static NTSTATUS litepciedrv_PollInitialize(WDFDEVICE wdfDevice, PLITEPCIE_CHAN channel)
+{
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    NTSTATUS status;
+
+    dmachan->poll_mode = DMA_POLL_IRQ;
+    dmachan->poll_period_us = DMA_POLL_PERIOD_US;
+    dmachan->poll_enter = DMA_POLL_ENTER;
+    dmachan->poll_exit = DMA_POLL_EXIT;
+    dmachan->poll_active = 0;
+    dmachan->poll_stop = 0;
+    dmachan->poll_last_count = 0;
+    dmachan->poll_last_time = KeQueryPerformanceCounter(NULL).QuadPart;
+    dmachan->mode_since = dmachan->poll_last_time;
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, litepciedrv_EvtPollTimer);
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, POLL_TIMER_CONTEXT);
+    attributes.ParentObject = wdfDevice;
+    status = WdfTimerCreate(&timerConfig, &attributes, &dmachan->pollTimer);
+    if (NT_SUCCESS(status))
+    {
+        PollTimerGetContext(dmachan->pollTimer)->channel = channel;
+    }
+    return status;
+}
+
+//Reload a running ring with a new IRQ interval. The engine is parked, the
+//buffers it completed are folded in, and the table restarts at the next
+//buffer so the counters and the user's view of the ring stay continuous.
+//The engine has no way to stop at a buffer boundary, so the buffer in
+//flight is cut: it restarts from its first byte, which drops the C2H data
+//already written to it and sends part of an H2C buffer twice. The ioctl
+//reports the restart to the caller.
+static VOID litepcie_dma_writer_reload(PDEVICE_CONTEXT dev, PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    INT64 count;
+
+    //No DPC or poll may fold against the old table while it is replaced
+    litepciedrv_PollPause(channel);
+    litepcie_disable_interrupt(dev, dmachan->writer_interrupt);
+    KeFlushQueuedDpcs();
+
+    litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 0);
+    KeStallExecutionProcessor(1000);
+
+    //A fold between the new table and its base would count from the wrong head
+    WdfSpinLockAcquire(dmachan->foldLock);
+    count = litepciedrv_WriterFoldLocked(channel);
+    litepcie_dma_writer_fill(dev, dmachan, (UINT32)(count % dmachan->writer_buf_count));
+    dmachan->writer_hw_base = count;
+    WdfSpinLockRelease(dmachan->foldLock);
+
+    litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_WRITER_ENABLE_OFFSET, 1);
+    if (!ReadNoFence(&dmachan->poll_active))
+        litepcie_enable_interrupt(dev, dmachan->writer_interrupt);
+    litepciedrv_PollResume(channel);
+    litepciedrv_ChannelReadDrain(channel);
+}
+
+static VOID litepcie_dma_reader_reload(PDEVICE_CONTEXT dev, PLITEPCIE_CHAN channel)
 {
-    dev->irqs_requested |= (1 << interrupt);
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    INT64 count;
 
-    litepciedrv_RegWritel(dev, CSR_PCIE_MSI_ENABLE_ADDR, dev->irqs_requested);
+    //No DPC or poll may fold against the old table while it is replaced
+    litepciedrv_PollPause(channel);
+    litepcie_disable_interrupt(dev, dmachan->reader_interrupt);
+    KeFlushQueuedDpcs();
+
+    litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 0);
+    KeStallExecutionProcessor(1000);
+
+    //A fold between the new table and its base would count from the wrong head
+    WdfSpinLockAcquire(dmachan->foldLock);
+    count = litepciedrv_ReaderFoldLocked(channel);
+    litepcie_dma_reader_fill(dev, dmachan, (UINT32)(count % dmachan->reader_buf_count));
+    dmachan->reader_hw_base = count;
+    WdfSpinLockRelease(dmachan->foldLock);
+
+    litepciedrv_RegWritel(dev, dmachan->base + PCIE_DMA_READER_ENABLE_OFFSET, 1);
+    if (!ReadNoFence(&dmachan->poll_active))
+        litepcie_enable_interrupt(dev, dmachan->reader_interrupt);
+    litepciedrv_PollResume(channel);
+    litepciedrv_ChannelWriteDrain(channel);
+}
+
+NTSTATUS litepciedrv_ChannelIrqInterval(PLITEPCIE_CHAN channel, struct litepcie_ioctl_dma_irq_interval* interval)
+{
+    PDEVICE_CONTEXT dev = channel->litepcie_dev;
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    WdfWaitLockAcquire(dev->configLock, NULL);
+
+    interval->restarted = 0;
+    /* 0 keeps the current value */
+    if (interval->writer_buf_per_irq == 0) interval->writer_buf_per_irq = dmachan->writer_buf_per_irq;
+    if (interval->reader_buf_per_irq == 0) interval->reader_buf_per_irq = dmachan->reader_buf_per_irq;
+
+    if (interval->writer_buf_per_irq > dmachan->writer_buf_count ||
+        interval->reader_buf_per_irq > dmachan->reader_buf_count)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    // LITEPCIE DMA calls C2H channel the "writer" and H2C channel the "reader"
+    if (interval->writer_buf_per_irq != dmachan->writer_buf_per_irq)
+    {
+        dmachan->writer_buf_per_irq = interval->writer_buf_per_irq;
+        //An idle or direct mode engine picks the interval up at the next start
+        if (dmachan->writer_enable && dmachan->mode == DMA_MODE_RING)
+        {
+            litepcie_dma_writer_reload(dev, channel);
+            interval->restarted |= DMA_RESTARTED_WRITER;
+        }
+    }
+    if (interval->reader_buf_per_irq != dmachan->reader_buf_per_irq)
+    {
+        dmachan->reader_buf_per_irq = interval->reader_buf_per_irq;
+        if (dmachan->reader_enable && dmachan->mode == DMA_MODE_RING)
+        {
+            litepcie_dma_reader_reload(dev, channel);
+            interval->restarted |= DMA_RESTARTED_READER;
+        }
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "DMA%d writer irq/%u reader irq/%u",
+        channel->index, dmachan->writer_buf_per_irq, dmachan->reader_buf_per_irq);
+
+Exit:
+    /* report the intervals in effect */
+    interval->writer_buf_per_irq = dmachan->writer_buf_per_irq;
+    interval->reader_buf_per_irq = dmachan->reader_buf_per_irq;
+
+    WdfWaitLockRelease(dev->configLock);
+    return status;
+}
+
+//Fold the live LOOP_STATUS instead of waiting for the next MSI, then serve
+//the deferred requests the new buffers satisfy. foldLock orders the fold
+//against reloads and the counter clears of start and stop, so it is never
+//skipped; the enable is checked under it so a stopped ring stays at 0.
+VOID litepciedrv_ChannelReadRefresh(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+
+    if (dmachan->mode == DMA_MODE_RING)
+    {
+        WdfSpinLockAcquire(dmachan->foldLock);
+        if (dmachan->writer_enable)
+            litepciedrv_WriterFoldLocked(channel);
+        WdfSpinLockRelease(dmachan->foldLock);
+    }
+    litepciedrv_ChannelReadDrain(channel);
+}
+
+VOID litepciedrv_ChannelWriteRefresh(PLITEPCIE_CHAN channel)
+{
+    struct litepcie_dma_chan* dmachan = &channel->dma;
+
+    if (dmachan->mode == DMA_MODE_RING)
+    {
+        WdfSpinLockAcquire(dmachan->foldLock);
+        if (dmachan->reader_enable)
+            litepciedrv_ReaderFoldLocked(channel);
+        WdfSpinLockRelease(dmachan->foldLock);
+    }
+    litepciedrv_ChannelWriteDrain(channel);
+}
+
+VOID litepcie_enable_interrupt(PDEVICE_CONTEXT dev, UINT32 interrupt)
+{
+    WdfSpinLockAcquire(dev->dmaLock);
+    InterlockedOr(&dev->irqs_requested, (LONG)(1u << interrupt));
+    litepciedrv_RegWritel(dev, CSR_PCIE_MSI_ENABLE_ADDR, (UINT32)ReadNoFence(&dev->irqs_requested));
+    WdfSpinLockRelease(dev->dmaLock);
+#ifdef CSR_PCIE_MSI_CLEAR_ADDR
     litepciedrv_RegWritel(dev, CSR_PCIE_MSI_CLEAR_ADDR, (1 << interrupt));
+#endif
 }
 
 VOID litepcie_disable_interrupt(PDEVICE_CONTEXT dev, UINT32 interrupt)
 {
-    dev->irqs_requested &= ~(1 << interrupt);
-
-    litepciedrv_RegWritel(dev, CSR_PCIE_MSI_ENABLE_ADDR, dev->irqs_requested);
+    WdfSpinLockAcquire(dev->dmaLock);
+    InterlockedAnd(&dev->irqs_requested, ~(LONG)(1u << interrupt));
+    litepciedrv_RegWritel(dev, CSR_PCIE_MSI_ENABLE_ADDR, (UINT32)ReadNoFence(&dev->irqs_requested));
+    WdfSpinLockRelease(dev->dmaLock);
 }
 
 NTSTATUS litepcie_EvtIntEnable(WDFINTERRUPT Interrupt, WDFDEVICE AssociatedDevice)
@@ -630,8 +2182,10 @@ NTSTATUS litepcie_EvtIntEnable(WDFINTERRUPT Interrupt, WDFDEVICE AssociatedDevic
     PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedDevice);
     UNREFERENCED_PARAMETER(Interrupt);
     
-    litepciedrv_RegWritel(ctx, CSR_PCIE_MSI_ENABLE_ADDR, ctx->irqs_requested);
-    litepciedrv_RegWritel(ctx, CSR_PCIE_MSI_CLEAR_ADDR, ctx->irqs_requested);
+    litepciedrv_RegWritel(ctx, CSR_PCIE_MSI_ENABLE_ADDR, (UINT32)ReadNoFence(&ctx->irqs_requested));
+#ifdef CSR_PCIE_MSI_CLEAR_ADDR
+    litepciedrv_RegWritel(ctx, CSR_PCIE_MSI_CLEAR_ADDR, (UINT32)ReadNoFence(&ctx->irqs_requested));
+#endif
 
 
     return STATUS_SUCCESS;
@@ -652,80 +2206,96 @@ BOOLEAN litepcie_EvtIsr(IN WDFINTERRUPT Interrupt, IN ULONG MessageID)
 {
     UNREFERENCED_PARAMETER(MessageID);
     PDEVICE_CONTEXT dev = DeviceGetContext(WdfInterruptGetDevice(Interrupt));
-    UINT32 irqVec = litepciedrv_RegReadl(dev, CSR_PCIE_MSI_VECTOR_ADDR);
+    UINT32 irqVec;
 
-    if (irqVec != 0)
+#ifdef CSR_PCIE_MSI_VECTOR_ADDR
+    // Single vector gateware: the vector register tells which sources fired
+    irqVec = litepciedrv_RegReadl(dev, CSR_PCIE_MSI_VECTOR_ADDR);
+    if (irqVec == 0)
     {
-        dev->irqs_pending |= irqVec;
+        return FALSE;
+    }
 #ifdef CSR_PCIE_MSI_CLEAR_ADDR
-        litepciedrv_RegWritel(dev, CSR_PCIE_MSI_CLEAR_ADDR, irqVec);
+    litepciedrv_RegWritel(dev, CSR_PCIE_MSI_CLEAR_ADDR, irqVec);
 #endif
-        WdfInterruptQueueDpcForIsr(Interrupt);
-        return TRUE;
-    }
-    else
+#else
+    // Multi vector gateware: the message identifies the sources
+    irqVec = InterruptGetContext(Interrupt)->mask & (UINT32)ReadNoFence(&dev->irqs_requested);
+#endif
+
+    // Hand each source to the DPC of the interrupt owning it
+    for (UINT32 i = 0; i < dev->irqs; i++)
     {
-        return FALSE;
+        PINTERRUPT_CONTEXT intCtx = InterruptGetContext(dev->intr[i]);
+        if (irqVec & intCtx->mask)
+        {
+            InterlockedOr(&intCtx->pending, (LONG)(irqVec & intCtx->mask));
+            WdfInterruptQueueDpcForIsr(dev->intr[i]);
+        }
     }
+    return TRUE;
 }
 
 VOID litepcie_EvtDpc(IN WDFINTERRUPT Interrupt, IN WDFOBJECT device)
 {
     UNREFERENCED_PARAMETER(device);
-    UINT32 irq_vector, irq_enable, clear_mask = 0;
+    UINT32 irq_vector, irq_enable;
     PDEVICE_CONTEXT dev = DeviceGetContext(WdfInterruptGetDevice(Interrupt));
+    PINTERRUPT_CONTEXT intCtx = InterruptGetContext(Interrupt);
     PLITEPCIE_CHAN pChan;
-    UINT32 loop_status, i;
+    UINT32 i;
+    LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
 
+    // Only the sources owned by this interrupt, so DPCs of other vectors run in parallel
     irq_enable = litepciedrv_RegReadl(dev, CSR_PCIE_MSI_ENABLE_ADDR);
-    irq_vector = dev->irqs_pending & irq_enable;
+    irq_vector = (UINT32)InterlockedExchange(&intCtx->pending, 0) & irq_enable;
 
     for (i = 0; i < dev->channels; i++) {
         pChan = &dev->chan[i];
+        /* zero-copy progress, published through the doorbell page */
+        if ((irq_vector & ((1 << pChan->dma.reader_interrupt) | (1 << pChan->dma.writer_interrupt))) &&
+            pChan->dma.mode == DMA_MODE_RING) {
+            litepciedrv_ChannelDoorbell(pChan);
+        }
         /* dma reader interrupt handling */
-        if (irq_vector & (1 << pChan->dma.reader_interrupt)) {
-            loop_status = litepciedrv_RegReadl(dev, pChan->dma.base +
-                PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET);
-            WdfSpinLockAcquire(pChan->dma.readerLock);
-            pChan->dma.reader_hw_count &= ((~(DMA_BUFFER_COUNT - 1) << 16) & 0xffffffffffff0000);
-            pChan->dma.reader_hw_count |= (loop_status >> 16) * DMA_BUFFER_COUNT + (loop_status & 0xffff);
-            if (pChan->dma.reader_hw_count_last > pChan->dma.reader_hw_count)
-                pChan->dma.reader_hw_count += (INT64)(1UL << (leftmost_bit(DMA_BUFFER_COUNT) + 16));
-            pChan->dma.reader_hw_count_last = pChan->dma.reader_hw_count;
-            WdfSpinLockRelease(pChan->dma.readerLock);
+        if (irq_vector & (1 << pChan->dma.reader_interrupt) &&
+            pChan->dma.mode == DMA_MODE_DIRECT) {
+            litepciedrv_DirectComplete(pChan->dma.writeQueueLock, pChan->dma.writeTransaction,
+                &pChan->dma.writeActive, FALSE);
+            litepciedrv_ChannelWriteDrain(pChan);
+        }
+        else if (irq_vector & (1 << pChan->dma.reader_interrupt)) {
+            litepciedrv_ReaderFold(pChan);
 #ifdef DEBUG_MSI
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "MSI DMA%d Reader buf: %lld\n", i,
                 pChan->dma.reader_hw_count);
 #endif
-            if (pChan->dma.writeRequest != NULL)
-            {
-                litepciedrv_ChannelWrite(pChan, pChan->dma.writeRequest, pChan->dma.writeRemainingBytes);
-            }
-            clear_mask |= (1 << pChan->dma.reader_interrupt);
+            litepciedrv_ChannelWriteDrain(pChan);
         }
         /* dma writer interrupt handling */
-        if (irq_vector & (1 << pChan->dma.writer_interrupt)) {
-            loop_status = litepciedrv_RegReadl(dev, pChan->dma.base +
-                PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET);
-            WdfSpinLockAcquire(pChan->dma.writerLock);
-            pChan->dma.writer_hw_count &= ((~(DMA_BUFFER_COUNT - 1) << 16) & 0xffffffffffff0000);
-            pChan->dma.writer_hw_count |= (loop_status >> 16) * DMA_BUFFER_COUNT + (loop_status & 0xffff);
-            if (pChan->dma.writer_hw_count_last > pChan->dma.writer_hw_count)
-                pChan->dma.writer_hw_count += (INT64)(1UL << (leftmost_bit(DMA_BUFFER_COUNT) + 16));
-            pChan->dma.writer_hw_count_last = pChan->dma.writer_hw_count;
-            WdfSpinLockRelease(pChan->dma.writerLock);
+        if (irq_vector & (1 << pChan->dma.writer_interrupt) &&
+            pChan->dma.mode == DMA_MODE_DIRECT) {
+            litepciedrv_DirectComplete(pChan->dma.readQueueLock, pChan->dma.readTransaction,
+                &pChan->dma.readActive, FALSE);
+            litepciedrv_ChannelReadDrain(pChan);
+        }
+        else if (irq_vector & (1 << pChan->dma.writer_interrupt)) {
+            litepciedrv_WriterFold(pChan);
 #ifdef DEBUG_MSI
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "MSI DMA%d Writer buf: %lld\n", i,
                 pChan->dma.writer_hw_count);
 #endif
-            if (pChan->dma.readRequest != NULL)
-            {
-                litepciedrv_ChannelRead(pChan, pChan->dma.readRequest, pChan->dma.readRemainingBytes);
-            }
-            clear_mask |= (1 << pChan->dma.writer_interrupt);
+            litepciedrv_ChannelReadDrain(pChan);
+        }
+        /* heavy traffic moves the channel to polling */
+        if ((irq_vector & ((1 << pChan->dma.reader_interrupt) | (1 << pChan->dma.writer_interrupt))) &&
+            pChan->dma.mode == DMA_MODE_RING) {
+            litepciedrv_PollCheck(pChan);
         }
     }
-    dev->irqs_pending &= ~clear_mask;
+
+    litepciedrv_StatAdd(&dev->dpc_count, &dev->dpc_ticks_total, &dev->dpc_ticks_max,
+        KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart);
 }
 
 static NTSTATUS litepciedrv_SetupInterrupts(PDEVICE_CONTEXT dev,
@@ -734,8 +2304,10 @@ static NTSTATUS litepciedrv_SetupInterrupts(PDEVICE_CONTEXT dev,
 {
     NTSTATUS status = STATUS_SUCCESS;
     UINT32 irqs = 0;
+    UINT32 maxIrqs = 1;
+    BOOLEAN messages = TRUE;
 
-    dev->irqs_requested = 0;
+    WriteNoFence(&dev->irqs_requested, 0);
 
     for (UINT32 i = 0; i < WdfCmResourceListGetCount(ResourcesTranslated); i++)
     {
@@ -743,15 +2315,38 @@ static NTSTATUS litepciedrv_SetupInterrupts(PDEVICE_CONTEXT dev,
         if (desc->Type == CmResourceTypeInterrupt)
         {
             irqs++;
+            if (!(desc->Flags & CM_RESOURCE_INTERRUPT_MESSAGE))
+            {
+                messages = FALSE;
+            }
         }
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%d MSI IRQs allocated.\n", irqs);
+
+    // An interrupt object per message only adds parallel DPCs when the
+    // gateware raises a message per source (MSI-X or multi-message MSI) and
+    // several were granted. Single vector gateware (CSR_PCIE_MSI_VECTOR) or
+    // a line interrupt falls back to one interrupt owning every source.
+#ifndef CSR_PCIE_MSI_VECTOR_ADDR
+    if (messages && irqs > 1)
+    {
+        maxIrqs = irqs < LITEPCIE_IRQ_MAX ? irqs : LITEPCIE_IRQ_MAX;
+    }
+#else
+    UNREFERENCED_PARAMETER(messages);
+#endif
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Using %u interrupt object(s).\n", maxIrqs);
+    dev->irqs = 0;
     for (UINT32 i = 0; i < WdfCmResourceListGetCount(ResourcesTranslated); i++)
     {
         PCM_PARTIAL_RESOURCE_DESCRIPTOR desc = WdfCmResourceListGetDescriptor(ResourcesTranslated, i); 
         if (desc->Type == CmResourceTypeInterrupt)
         {
+            if (dev->irqs >= maxIrqs)
+            {
+                break;
+            }
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Creating interrupt for MSI %ul.\n", desc->u.MessageInterrupt.Translated.Vector);
 
             WDF_INTERRUPT_CONFIG config;
@@ -761,20 +2356,55 @@ static NTSTATUS litepciedrv_SetupInterrupts(PDEVICE_CONTEXT dev,
             config.EvtInterruptEnable = litepcie_EvtIntEnable;
             config.EvtInterruptDisable = litepcie_EvtIntDisable;
 
-            status = WdfInterruptCreate(dev->deviceDrv, &config, WDF_NO_OBJECT_ATTRIBUTES,
-                &(dev->intr));
+            WDF_OBJECT_ATTRIBUTES intAttributes;
+            WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&intAttributes, INTERRUPT_CONTEXT);
+
+            status = WdfInterruptCreate(dev->deviceDrv, &config, &intAttributes,
+                &(dev->intr[dev->irqs]));
+            if (!NT_SUCCESS(status))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "WdfInterruptCreate failed: %!STATUS!", status);
+                return status;
+            }
 
             //Setup Interrupt context
             WDF_INTERRUPT_INFO intInfo;
             WDF_INTERRUPT_INFO_INIT(&intInfo);
-            WdfInterruptGetInfo(dev->intr, &intInfo);
+            WdfInterruptGetInfo(dev->intr[dev->irqs], &intInfo);
+
+            PINTERRUPT_CONTEXT intCtx = InterruptGetContext(dev->intr[dev->irqs]);
+            intCtx->message = intInfo.MessageNumber;
+            intCtx->mask = 0;
+            intCtx->pending = 0;
             
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Registered Interrupt."
-                    "Vector: %u MessageSignaled: %u MessageNo: %u\n", intInfo.Vector, intInfo.MessageSignaled, intInfo.MessageNumber);
+                    "Vector: %u MessageSignaled: %u MessageNo: %u Group: %u Affinity: 0x%llx\n",
+                    intInfo.Vector, intInfo.MessageSignaled, intInfo.MessageNumber,
+                    intInfo.TargetProcessorSetAndGroup.Group, (UINT64)intInfo.TargetProcessorSetAndGroup.Mask);
 
-            break;
+            dev->irqs++;
+        }
+    }
 
+    if (dev->irqs == 0)
+    {
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    // MSI multiple message: source n raises message n modulo the messages granted
+    for (UINT32 bit = 0; bit < 32; bit++)
+    {
+        UINT32 owner = 0;
+        for (UINT32 i = 0; i < dev->irqs; i++)
+        {
+            if (InterruptGetContext(dev->intr[i])->message == bit % dev->irqs)
+            {
+                owner = i;
+                break;
+            }
         }
+        InterruptGetContext(dev->intr[owner])->mask |= (1u << bit);
     }
+
     return status;
-}
\ No newline at end of file
+}
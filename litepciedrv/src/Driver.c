@@ -168,6 +168,9 @@ Return Value:
     WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&fileAttributes, FILE_CONTEXT);
     WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &fileAttributes);
 
+    // Memory mapping requests must be handled in the context of the calling process
+    WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, litepciedrvEvtIoInCallerContext);
+
 
     //Allocate Device
     status = litepciedrvCreateDevice(DeviceInit);
@@ -45,6 +45,7 @@ Return Value:
     WDFQUEUE queue;
     NTSTATUS status;
     WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_OBJECT_ATTRIBUTES queueAttributes;
 
     PAGED_CODE();
 
@@ -63,10 +64,17 @@ Return Value:
     queueConfig.EvtIoWrite = litepciedrvEvtIoWrite;
     queueConfig.EvtIoStop = litepciedrvEvtIoStop;
 
+    //
+    // Handlers take wait locks, allocate common buffers and sleep in
+    // register polls, all of which need PASSIVE_LEVEL.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&queueAttributes);
+    queueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
     status = WdfIoQueueCreate(
                  Device,
                  &queueConfig,
-                 WDF_NO_OBJECT_ATTRIBUTES,
+                 &queueAttributes,
                  &queue
                  );
 
@@ -146,43 +154,43 @@ Return Value:
             }
         }
         break;
-#ifdef CSR_FLASH_BASE
-    case LITEPCIE_IOCTL_FLASH:
-        struct litepcie_ioctl_flash *pFlashInData, *pFlashOutData;
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_flash), (PVOID*)&pFlashInData, &length);
+    case LITEPCIE_IOCTL_REG_BATCH:
+        struct litepcie_ioctl_reg_batch* pBatchInData, * pBatchOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_reg_batch), (PVOID*)&pBatchInData, &length);
         if (status == STATUS_SUCCESS)
         {
-            if (length != sizeof(struct litepcie_ioctl_flash))
+            size_t batchLength = sizeof(struct litepcie_ioctl_reg_batch) +
+                (size_t)pBatchInData->count * sizeof(struct litepcie_reg_op);
+            if (pBatchInData->count > LITEPCIE_REG_BATCH_MAX || length != batchLength)
             {
                 status = STATUS_INVALID_BUFFER_SIZE;
-            }
-            else if (pFlashInData->tx_len < 8 || pFlashInData->tx_len > 40)
-            {
-                status = STATUS_INVALID_DEVICE_REQUEST;
+                length = 0;
             }
             else
             {
-                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_flash), (PVOID*)&pFlashOutData, &length);
+                status = WdfRequestRetrieveOutputBuffer(Request, batchLength, (PVOID*)&pBatchOutData, &length);
                 if (status == STATUS_SUCCESS)
                 {
-                    litepciedrv_RegWritel(fileCtx->ctx, CSR_FLASH_SPI_MOSI_ADDR, (UINT32)(pFlashInData->tx_data >> 32));
-                    litepciedrv_RegWritel(fileCtx->ctx, CSR_FLASH_SPI_MOSI_ADDR + 4, (UINT32)pFlashInData->tx_data);
-                    litepciedrv_RegWritel(fileCtx->ctx, CSR_FLASH_SPI_CONTROL_ADDR,
-                        SPI_CTRL_START | (pFlashInData->tx_len * SPI_CTRL_LENGTH));
-                    KeStallExecutionProcessor(16);
-                    for (UINT32 i = 0; i < SPI_TIMEOUT; i++) {
-                        if (litepciedrv_RegReadl(fileCtx->ctx, CSR_FLASH_SPI_STATUS_ADDR) & SPI_STATUS_DONE)
-                            break;
-                        KeStallExecutionProcessor(1);
-                    }
-                    pFlashOutData->rx_data = ((UINT64)litepciedrv_RegReadl(fileCtx->ctx, CSR_FLASH_SPI_MISO_ADDR) << 32) |
-                        litepciedrv_RegReadl(fileCtx->ctx, CSR_FLASH_SPI_MISO_ADDR + 4);
-                    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
-                        "litepciedrv FLASH TX 0x%llX RX 0x%llX", pFlashInData->tx_data, pFlashOutData->rx_data);
+                    //In and out share the system buffer, results are written in place
+                    status = litepciedrv_RegBatch(fileCtx->ctx, (struct litepcie_reg_op*)(pBatchInData + 1),
+                        pBatchInData->count, &pBatchInData->done);
+                    length = NT_SUCCESS(status) ? batchLength : 0;
                 }
             }
         }
         break;
+#ifdef CSR_FLASH_BASE
+    case LITEPCIE_IOCTL_FLASH:
+    case LITEPCIE_IOCTL_FLASH_PROGRAM:
+    case LITEPCIE_IOCTL_FLASH_READ:
+        //SPI transfers are polled by the flash engine, which completes the request
+        status = WdfRequestForwardToIoQueue(Request, fileCtx->ctx->flashQueue);
+        if (NT_SUCCESS(status))
+        {
+            return;
+        }
+        length = 0;
+        break;
 #endif
     case LITEPCIE_IOCTL_ICAP:
         struct litepcie_ioctl_icap* pIcapInData;
@@ -197,13 +205,39 @@ Return Value:
             {
                     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
                         "litepciedrv ICAP ADDR 0x%X DATA 0x%X", pIcapInData->addr, pIcapInData->data);
+                    WdfWaitLockAcquire(fileCtx->ctx->icapLock, NULL);
                     litepciedrv_RegWritel(fileCtx->ctx, CSR_ICAP_ADDR_ADDR, pIcapInData->addr);
                     litepciedrv_RegWritel(fileCtx->ctx, CSR_ICAP_DATA_ADDR, pIcapInData->data);
                     litepciedrv_RegWritel(fileCtx->ctx, CSR_ICAP_WRITE_ADDR, 1);
+                    WdfWaitLockRelease(fileCtx->ctx->icapLock);
                     length = 0;
             }
         }
         break;
+    case LITEPCIE_IOCTL_ICAP_STREAM:
+        struct litepcie_ioctl_icap_stream* pStreamInData, * pStreamOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_icap_stream), (PVOID*)&pStreamInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            size_t streamLength = sizeof(struct litepcie_ioctl_icap_stream) +
+                (size_t)pStreamInData->count * sizeof(struct litepcie_ioctl_icap);
+            if (pStreamInData->count > LITEPCIE_ICAP_STREAM_MAX || length != streamLength)
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+                length = 0;
+            }
+            else
+            {
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_icap_stream), (PVOID*)&pStreamOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //In and out share the system buffer, results are written in place
+                    status = litepciedrv_IcapStream(fileCtx->ctx, pStreamInData);
+                    length = NT_SUCCESS(status) ? sizeof(struct litepcie_ioctl_icap_stream) : 0;
+                }
+            }
+        }
+        break;
     case LITEPCIE_IOCTL_DMA:
         if (fileCtx->dev != LITEPCIE_DMA)
         {
@@ -254,15 +288,30 @@ Return Value:
                             litepcie_enable_interrupt(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->dma.writer_interrupt);
                         }
                         else {
+                            //Stop starting direct transfers before the engine goes down
+                            fileCtx->dmaChan->dma.writer_enable = 0;
                             litepcie_disable_interrupt(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->dma.writer_interrupt);
                             litepcie_dma_writer_stop(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->index);
+                            //No more data will arrive for deferred reads
+                            litepciedrv_ChannelFlush(fileCtx->dmaChan->dma.readQueue, NULL);
                         }
                     }
 
                     fileCtx->dmaChan->dma.writer_enable = pDmaWriterInData->enable;
+                    if (pDmaWriterInData->enable && pDmaWriterInData->refresh)
+                    {
+                        //Report the buffers completed since the last MSI too
+                        litepciedrv_ChannelReadRefresh(fileCtx->dmaChan);
+                    }
+                    else if (pDmaWriterInData->enable)
+                    {
+                        //Start requests queued before the enable
+                        litepciedrv_ChannelReadDrain(fileCtx->dmaChan);
+                    }
 
-                    pDmaWriterOutData->hw_count = fileCtx->dmaChan->dma.writer_hw_count;
-                    pDmaWriterOutData->sw_count = fileCtx->dmaChan->dma.writer_sw_count;
+                    litepciedrv_ChannelDoorbell(fileCtx->dmaChan);
+                    pDmaWriterOutData->hw_count = ReadAcquire64(&fileCtx->dmaChan->dma.writer_hw_count);
+                    pDmaWriterOutData->sw_count = ReadNoFence64(&fileCtx->dmaChan->dma.writer_sw_count);
                 }
             }
         }
@@ -296,15 +345,30 @@ Return Value:
                             litepcie_enable_interrupt(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->dma.reader_interrupt);
                         }
                         else {
+                            //Stop starting direct transfers before the engine goes down
+                            fileCtx->dmaChan->dma.reader_enable = 0;
                             litepcie_disable_interrupt(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->dma.reader_interrupt);
                             litepcie_dma_reader_stop(fileCtx->dmaChan->litepcie_dev, fileCtx->dmaChan->index);
+                            //No more buffers will free up for deferred writes
+                            litepciedrv_ChannelFlush(fileCtx->dmaChan->dma.writeQueue, NULL);
                         }
                     }
 
                     fileCtx->dmaChan->dma.reader_enable = pDmaReaderInData->enable;
+                    if (pDmaReaderInData->enable && pDmaReaderInData->refresh)
+                    {
+                        //Report the buffers completed since the last MSI too
+                        litepciedrv_ChannelWriteRefresh(fileCtx->dmaChan);
+                    }
+                    else if (pDmaReaderInData->enable)
+                    {
+                        //Start requests queued before the enable
+                        litepciedrv_ChannelWriteDrain(fileCtx->dmaChan);
+                    }
 
-                    pDmaReaderOutData->hw_count = fileCtx->dmaChan->dma.reader_hw_count;
-                    pDmaReaderOutData->sw_count = fileCtx->dmaChan->dma.reader_sw_count;
+                    litepciedrv_ChannelDoorbell(fileCtx->dmaChan);
+                    pDmaReaderOutData->hw_count = ReadAcquire64(&fileCtx->dmaChan->dma.reader_hw_count);
+                    pDmaReaderOutData->sw_count = ReadNoFence64(&fileCtx->dmaChan->dma.reader_sw_count);
                 }
             }
         }
@@ -324,15 +388,160 @@ Return Value:
             if (status == STATUS_SUCCESS)
             {
                 pDmaInfoOutData->dma_tx_buf_offset = 0;
-                pDmaInfoOutData->dma_tx_buf_size = DMA_BUFFER_SIZE;
-                pDmaInfoOutData->dma_tx_buf_count = DMA_BUFFER_COUNT;
+                pDmaInfoOutData->dma_tx_buf_size = fileCtx->dmaChan->dma.reader_buf_size;
+                pDmaInfoOutData->dma_tx_buf_count = fileCtx->dmaChan->dma.reader_buf_count;
+                pDmaInfoOutData->dma_tx_buf_per_irq = fileCtx->dmaChan->dma.reader_buf_per_irq;
 
                 pDmaInfoOutData->dma_rx_buf_offset = 0;
-                pDmaInfoOutData->dma_rx_buf_size = DMA_BUFFER_SIZE;
-                pDmaInfoOutData->dma_rx_buf_count = DMA_BUFFER_COUNT;
+                pDmaInfoOutData->dma_rx_buf_size = fileCtx->dmaChan->dma.writer_buf_size;
+                pDmaInfoOutData->dma_rx_buf_count = fileCtx->dmaChan->dma.writer_buf_count;
+                pDmaInfoOutData->dma_rx_buf_per_irq = fileCtx->dmaChan->dma.writer_buf_per_irq;
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_DMA_CONFIG:
+        if (fileCtx->dev != LITEPCIE_DMA)
+        {
+            //Wrong file type
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        struct litepcie_ioctl_dma_config* pDmaConfigInData, * pDmaConfigOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_dma_config), (PVOID*)&pDmaConfigInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_dma_config))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else if ((fileCtx->dmaChan->dma.reader_lock && !fileCtx->reader) ||
+                     (fileCtx->dmaChan->dma.writer_lock && !fileCtx->writer))
+            {
+                //Channel in use by another file
+                status = STATUS_DEVICE_BUSY;
+                length = 0;
+            }
+            else
+            {
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_dma_config), (PVOID*)&pDmaConfigOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //In and out share the system buffer
+                    status = litepciedrv_ChannelConfigure(fileCtx->dmaChan, pDmaConfigInData);
+                    if (!NT_SUCCESS(status))
+                    {
+                        length = 0;
+                    }
+                }
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_DMA_IRQ_INTERVAL:
+        if (fileCtx->dev != LITEPCIE_DMA)
+        {
+            //Wrong file type
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        struct litepcie_ioctl_dma_irq_interval* pIrqIntervalInData, * pIrqIntervalOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_dma_irq_interval), (PVOID*)&pIrqIntervalInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_dma_irq_interval))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else if ((fileCtx->dmaChan->dma.reader_lock && !fileCtx->reader) ||
+                     (fileCtx->dmaChan->dma.writer_lock && !fileCtx->writer))
+            {
+                //Channel in use by another file
+                status = STATUS_DEVICE_BUSY;
+                length = 0;
+            }
+            else
+            {
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_dma_irq_interval), (PVOID*)&pIrqIntervalOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //In and out share the system buffer
+                    status = litepciedrv_ChannelIrqInterval(fileCtx->dmaChan, pIrqIntervalInData);
+                    if (!NT_SUCCESS(status))
+                    {
+                        length = 0;
+                    }
+                }
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_DMA_POLL:
+        if (fileCtx->dev != LITEPCIE_DMA)
+        {
+            //Wrong file type
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        struct litepcie_ioctl_dma_poll* pPollInData, * pPollOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_dma_poll), (PVOID*)&pPollInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_dma_poll))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else if ((fileCtx->dmaChan->dma.reader_lock && !fileCtx->reader) ||
+                     (fileCtx->dmaChan->dma.writer_lock && !fileCtx->writer))
+            {
+                //Channel in use by another file
+                status = STATUS_DEVICE_BUSY;
+                length = 0;
+            }
+            else
+            {
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_dma_poll), (PVOID*)&pPollOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //In and out share the system buffer
+                    status = litepciedrv_ChannelPoll(fileCtx->dmaChan, pPollInData);
+                    if (!NT_SUCCESS(status))
+                    {
+                        length = 0;
+                    }
+                }
             }
         }
         break;
+    case LITEPCIE_IOCTL_STATS:
+        struct litepcie_ioctl_stats* pStatsInData, * pStatsOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_stats), (PVOID*)&pStatsInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_stats))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else
+            {
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_stats), (PVOID*)&pStatsOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //In and out share the system buffer
+                    litepciedrv_GetStats(fileCtx->ctx, pStatsInData);
+                }
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_INFO:
+        struct litepcie_ioctl_info* pInfoOutData;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_info), (PVOID*)&pInfoOutData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            litepciedrv_GetInfo(fileCtx->ctx, pInfoOutData);
+            length = sizeof(struct litepcie_ioctl_info);
+        }
+        break;
     case LITEPCIE_IOCTL_LOCK:
         if (fileCtx->dev != LITEPCIE_DMA)
         {
@@ -405,7 +614,8 @@ Return Value:
             }
             else
             {
-                fileCtx->dmaChan->dma.writer_sw_count = pDmaWriteUpdateInData->sw_count;
+                WriteRelease64(&fileCtx->dmaChan->dma.writer_sw_count, pDmaWriteUpdateInData->sw_count);
+                WriteRelease64(&fileCtx->dmaChan->dma.shm_doorbell->writer_sw_count, pDmaWriteUpdateInData->sw_count);
                 length = 0;
             }
         }
@@ -428,7 +638,8 @@ Return Value:
             }
             else
             {
-                fileCtx->dmaChan->dma.reader_sw_count = pDmaReadUpdateInData->sw_count;
+                WriteRelease64(&fileCtx->dmaChan->dma.reader_sw_count, pDmaReadUpdateInData->sw_count);
+                WriteRelease64(&fileCtx->dmaChan->dma.shm_doorbell->reader_sw_count, pDmaReadUpdateInData->sw_count);
                 length = 0;
             }
         }
@@ -446,6 +657,376 @@ Return Value:
     }
 }
 
+#ifdef CSR_FLASH_BASE
+VOID litepciedrvEvtFlashIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+    Flash requests forwarded by litepciedrvEvtIoDeviceControl. The queue is
+    sequential, so this owns the flash engine until the request completes.
+
+Arguments:
+
+    Queue -  Handle to the flash queue.
+
+    Request - Handle to a framework request object.
+
+    OutputBufferLength - Size of the output buffer in bytes
+
+    InputBufferLength - Size of the input buffer in bytes
+
+    IoControlCode - I/O control code.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+    NTSTATUS status = STATUS_INVALID_DEVICE_REQUEST;
+    size_t length = 0;
+    PDEVICE_CONTEXT dev = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+    PLITEPCIE_FLASH_XFER xfer = &dev->flashXfer;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    RtlZeroMemory(xfer, sizeof(LITEPCIE_FLASH_XFER));
+    xfer->code = IoControlCode;
+
+    switch (IoControlCode) {
+    case LITEPCIE_IOCTL_FLASH:
+        struct litepcie_ioctl_flash* pFlashInData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_flash), (PVOID*)&pFlashInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_flash))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else if (pFlashInData->tx_len < 8 || pFlashInData->tx_len > 40)
+            {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+            }
+            else
+            {
+                //Input and output share the system buffer, read the parameters first
+                xfer->tx_len = pFlashInData->tx_len;
+                xfer->tx_data = pFlashInData->tx_data;
+                status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_flash), (PVOID*)&xfer->spi, &length);
+                xfer->steps = 1;
+                xfer->information = sizeof(struct litepcie_ioctl_flash);
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_FLASH_PROGRAM:
+        struct litepcie_ioctl_flash_program* pProgramInData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_flash_program), (PVOID*)&pProgramInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_flash_program))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+            else if (pProgramInData->len == 0 || pProgramInData->len > LITEPCIE_FLASH_PAGE_SIZE ||
+                (pProgramInData->addr % LITEPCIE_FLASH_PAGE_SIZE) + pProgramInData->len > LITEPCIE_FLASH_PAGE_SIZE)
+            {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            else
+            {
+                xfer->cmd = pProgramInData->cmd;
+                xfer->addr = pProgramInData->addr;
+                xfer->len = pProgramInData->len;
+                xfer->data = pProgramInData->data;
+                xfer->steps = 1 + (xfer->len + 3) / 4;
+            }
+#else
+            else
+            {
+                //Without software chip select every transfer is framed on its own
+                status = STATUS_NOT_SUPPORTED;
+            }
+#endif
+        }
+        break;
+    case LITEPCIE_IOCTL_FLASH_READ:
+        struct litepcie_ioctl_flash_read* pFlashReadInData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_flash_read), (PVOID*)&pFlashReadInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if (length != sizeof(struct litepcie_ioctl_flash_read))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+            else if (pFlashReadInData->len == 0 || pFlashReadInData->len > LITEPCIE_FLASH_READ_MAX)
+            {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            else
+            {
+                //Input and output share the system buffer, read the parameters first
+                xfer->cmd = pFlashReadInData->cmd;
+                xfer->addr = pFlashReadInData->addr;
+                xfer->dummy = pFlashReadInData->dummy;
+                xfer->len = pFlashReadInData->len;
+                xfer->information = xfer->len;
+                xfer->steps = 1 + xfer->dummy + (xfer->len + 3) / 4;
+                status = WdfRequestRetrieveOutputBuffer(Request, xfer->information, (PVOID*)&xfer->data, &length);
+            }
+#else
+            else
+            {
+                //Without software chip select every transfer is framed on its own
+                status = STATUS_NOT_SUPPORTED;
+            }
+#endif
+        }
+        break;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+    litepciedrv_FlashStart(dev, Request);
+}
+#endif
+
+static VOID litepciedrv_MunmapDma(PFILE_CONTEXT fileCtx)
+{
+    if (fileCtx->dmaRxMap.mdl != NULL)
+    {
+        InterlockedDecrement(&fileCtx->dmaChan->dma.map_count);
+    }
+    if (fileCtx->dmaDoorbellMap.mdl != NULL)
+    {
+        InterlockedDecrement(&fileCtx->dmaChan->dma.doorbell_count);
+    }
+    litepciedrv_UnmapUser(&fileCtx->dmaRxMap);
+    litepciedrv_UnmapUser(&fileCtx->dmaTxMap);
+    litepciedrv_UnmapUser(&fileCtx->dmaStatusMap);
+    litepciedrv_UnmapUser(&fileCtx->dmaDoorbellMap);
+}
+
+static NTSTATUS litepciedrv_MmapDma(PFILE_CONTEXT fileCtx, WDFREQUEST Request, size_t* length)
+{
+    struct litepcie_ioctl_mmap_dma* pMmapOutData;
+    struct litepcie_dma_chan* dmachan;
+    SIZE_T rxSize, txSize;
+    NTSTATUS status;
+
+    *length = 0;
+    if (fileCtx->dev != LITEPCIE_DMA)
+    {
+        //Wrong file type
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    if (fileCtx->dmaRxMap.mdl != NULL || fileCtx->dmaTxMap.mdl != NULL)
+    {
+        //Already mapped by this file
+        return STATUS_DEVICE_BUSY;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_mmap_dma), (PVOID*)&pMmapOutData, length);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // LITEPCIE DMA calls C2H channel the "writer" and H2C channel the "reader"
+    dmachan = &fileCtx->dmaChan->dma;
+
+    //Hold off geometry changes while the rings are mapped, the sizes and
+    //buffers must come from the same configuration as the mapping
+    WdfWaitLockAcquire(fileCtx->ctx->configLock, NULL);
+    rxSize = (SIZE_T)dmachan->writer_buf_size * dmachan->writer_buf_count;
+    txSize = (SIZE_T)dmachan->reader_buf_size * dmachan->reader_buf_count;
+    status = litepciedrv_MapUser(WdfCommonBufferGetAlignedVirtualAddress(dmachan->writeBuffer),
+        rxSize, MmCached, FALSE, &fileCtx->dmaRxMap);
+    if (NT_SUCCESS(status))
+    {
+        InterlockedIncrement(&dmachan->map_count);
+        status = litepciedrv_MapUser(WdfCommonBufferGetAlignedVirtualAddress(dmachan->readBuffer),
+            txSize, MmCached, FALSE, &fileCtx->dmaTxMap);
+    }
+    WdfWaitLockRelease(fileCtx->ctx->configLock);
+    if (NT_SUCCESS(status))
+    {
+        status = litepciedrv_MapUser(dmachan->shm_status,
+            DMA_SHM_STATUS_SIZE, MmCached, TRUE, &fileCtx->dmaStatusMap);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = litepciedrv_MapUser(dmachan->shm_doorbell,
+            DMA_SHM_DOORBELL_SIZE, MmCached, FALSE, &fileCtx->dmaDoorbellMap);
+        if (NT_SUCCESS(status))
+        {
+            InterlockedIncrement(&dmachan->doorbell_count);
+        }
+    }
+    if (!NT_SUCCESS(status))
+    {
+        litepciedrv_MunmapDma(fileCtx);
+        *length = 0;
+        return status;
+    }
+
+    pMmapOutData->dma_tx_buf_addr = (UINT64)fileCtx->dmaTxMap.userAddr;
+    pMmapOutData->dma_tx_buf_size = txSize;
+    pMmapOutData->dma_rx_buf_addr = (UINT64)fileCtx->dmaRxMap.userAddr;
+    pMmapOutData->dma_rx_buf_size = rxSize;
+    pMmapOutData->dma_status_addr = (UINT64)fileCtx->dmaStatusMap.userAddr;
+    pMmapOutData->dma_doorbell_addr = (UINT64)fileCtx->dmaDoorbellMap.userAddr;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
+        "litepciedrv MMAP DMA%d TX 0x%p RX 0x%p", fileCtx->dmaChan->index,
+        fileCtx->dmaTxMap.userAddr, fileCtx->dmaRxMap.userAddr);
+
+    return STATUS_SUCCESS;
+}
+
+//Writable BAR0 mappings bypass every ioctl check, only elevated callers get one
+static BOOLEAN litepciedrv_CallerIsAdmin(VOID)
+{
+    SECURITY_SUBJECT_CONTEXT subject;
+    BOOLEAN admin;
+
+    SeCaptureSubjectContext(&subject);
+    SeLockSubjectContext(&subject);
+    admin = SeTokenIsAdmin(SeQuerySubjectContextToken(&subject));
+    SeUnlockSubjectContext(&subject);
+    SeReleaseSubjectContext(&subject);
+    return admin;
+}
+
+static NTSTATUS litepciedrv_MmapRegs(PFILE_CONTEXT fileCtx, WDFREQUEST Request, size_t* length)
+{
+    struct litepcie_ioctl_mmap_regs* pRegsInData, * pRegsOutData;
+    BOOLEAN readOnly;
+    NTSTATUS status;
+
+    *length = 0;
+    if (fileCtx->dev != LITEPCIE_CTRL)
+    {
+        //Wrong file type
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    if (fileCtx->regsMap.mdl != NULL)
+    {
+        //Already mapped by this file
+        return STATUS_DEVICE_BUSY;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_mmap_regs), (PVOID*)&pRegsInData, length);
+    if (NT_SUCCESS(status))
+    {
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct litepcie_ioctl_mmap_regs), (PVOID*)&pRegsOutData, length);
+    }
+    if (!NT_SUCCESS(status))
+    {
+        *length = 0;
+        return status;
+    }
+
+    //Read-only unless asked for, stores need a writable handle and an elevated caller
+    readOnly = (pRegsInData->flags & LITEPCIE_MMAP_REGS_WRITE) == 0;
+    if (!readOnly &&
+        (!WdfFileObjectWdmGetFileObject(WdfRequestGetFileObject(Request))->WriteAccess ||
+         !litepciedrv_CallerIsAdmin()))
+    {
+        *length = 0;
+        return STATUS_ACCESS_DENIED;
+    }
+
+    //Uncached, like the kernel's own mapping of the CSRs
+    status = litepciedrv_MapUser(fileCtx->ctx->bar0_addr, fileCtx->ctx->bar0_size, MmNonCached,
+        readOnly, &fileCtx->regsMap);
+    if (!NT_SUCCESS(status))
+    {
+        *length = 0;
+        return status;
+    }
+
+    //In and out share the system buffer
+    pRegsOutData->csr_base = CSR_BASE;
+    pRegsOutData->addr = (UINT64)fileCtx->regsMap.userAddr;
+    pRegsOutData->size = fileCtx->ctx->bar0_size;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
+        "litepciedrv MMAP REGS 0x%p flags 0x%X", fileCtx->regsMap.userAddr, pRegsOutData->flags);
+
+    return STATUS_SUCCESS;
+}
+
+VOID litepciedrvEvtIoInCallerContext(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+)
+// Callback function invoked in the context of the requesting thread, before queueing
+{
+    WDF_REQUEST_PARAMETERS params;
+    NTSTATUS status;
+    size_t length = 0;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeDeviceControl)
+    {
+        PFILE_CONTEXT fileCtx = GetFileContext(WdfRequestGetFileObject(Request));
+
+        switch (params.Parameters.DeviceIoControl.IoControlCode) {
+        case LITEPCIE_IOCTL_MMAP_DMA:
+            if (WdfRequestGetRequestorMode(Request) != UserMode)
+            {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+            }
+            else
+            {
+                status = litepciedrv_MmapDma(fileCtx, Request, &length);
+            }
+            WdfRequestCompleteWithInformation(Request, status, length);
+            return;
+        case LITEPCIE_IOCTL_MUNMAP_DMA:
+            litepciedrv_MunmapDma(fileCtx);
+            WdfRequestComplete(Request, STATUS_SUCCESS);
+            return;
+        case LITEPCIE_IOCTL_MMAP_REGS:
+            if (WdfRequestGetRequestorMode(Request) != UserMode)
+            {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+            }
+            else
+            {
+                status = litepciedrv_MmapRegs(fileCtx, Request, &length);
+            }
+            WdfRequestCompleteWithInformation(Request, status, length);
+            return;
+        case LITEPCIE_IOCTL_MUNMAP_REGS:
+            litepciedrv_UnmapUser(&fileCtx->regsMap);
+            WdfRequestComplete(Request, STATUS_SUCCESS);
+            return;
+        }
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfDeviceEnqueueRequest failed %!STATUS!", status);
+        WdfRequestComplete(Request, status);
+    }
+}
 
 VOID litepciedrvEvtIoRead(
     _In_ WDFQUEUE queue,
@@ -528,6 +1109,16 @@ Return Value:
                 "%!FUNC! Queue 0x%p, Request 0x%p ActionFlags %d", 
                 Queue, Request, ActionFlags);
 
+    //
+    // Deferred DMA requests wait in the channel queues and are never owned by
+    // the driver while stopped; anything owned here is completed by the thread
+    // currently copying it. Let suspends proceed and leave purges to that thread.
+    //
+    if (ActionFlags & WdfRequestStopActionSuspend)
+    {
+        WdfRequestStopAcknowledge(Request, FALSE);
+    }
+
     return;
 }
 
@@ -593,10 +1184,18 @@ VOID litepciedrvEvtFileCleanup(IN WDFFILEOBJECT FileObject) {
 
     if (file->dev == LITEPCIE_CTRL)
     {
-
+        //Release the register mapping while still in the owning process
+        litepciedrv_UnmapUser(&file->regsMap);
     }
     if (file->dev == LITEPCIE_DMA)
     {
+        //Release user mappings while still in the owning process
+        litepciedrv_MunmapDma(file);
+
+        //Cancel this file's deferred reads and writes
+        litepciedrv_ChannelFlush(file->dmaChan->dma.readQueue, FileObject);
+        litepciedrv_ChannelFlush(file->dmaChan->dma.writeQueue, FileObject);
+
         if (file->reader)
         {
             //Unlock reader